@@ -0,0 +1,189 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* convert_float_half.c
+ *
+ * Description:
+ *   Convert native floats to and from 16 bit floating point
+ *
+ * Information:
+ *   Two 16 bit formats are handled:
+ *     HALF_FLOAT16   IEEE 754 binary16: 1 sign, 5 exponent (bias 15) and 10 mantissa bits
+ *     HALF_BFLOAT16  bfloat16, the top 16 bits of an IEEE 32-bit float: 1 sign,
+ *                    8 exponent (bias 127) and 7 mantissa bits
+ *   Values are rounded to nearest, ties to even. Values too big for float16
+ *   become infinite, and those too small become float16 subnormals or zero;
+ *   bfloat16 covers the whole float range. NaNs stay NaNs, made quiet,
+ *   keeping as much of the payload as fits.
+ *   Values equal to mdi are given as a 16 bit value of the caller's
+ *   choosing instead, e.g. a NaN or the most negative value.
+ *   Conversion to float16 uses the F16C instructions when the processor
+ *   has them, giving the same results, NaN payloads included.
+ */
+
+/* Standard header files used */
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define HALF_X86_KERNELS 1
+  #include <immintrin.h>
+#endif
+
+/* End of header */
+
+static uint16_t float_to_float16(float value) {
+  uint32_t bits;
+  uint32_t sign;
+  uint32_t magnitude;
+  uint32_t mantissa;
+  uint32_t rounded;
+  uint32_t remainder;
+  int      shift;
+
+  memcpy(&bits, &value, sizeof(bits));
+  sign=(bits>>16) & 0x8000;
+  magnitude=bits & 0x7fffffff;
+  if (magnitude>=0x7f800000) {
+    if (magnitude>0x7f800000) {
+      return sign | 0x7e00 | ((magnitude & 0x7fffff)>>13);      /* Quiet NaN, keeping the payload */
+    }
+    return sign | 0x7c00;                                      /* Infinity */
+  }
+  if (magnitude>=0x477ff000) {
+    return sign | 0x7c00;                                      /* Rounds to 65536 or more */
+  }
+  if (magnitude<0x33000000) {
+    return sign;                                               /* 2^-25 or less rounds to zero */
+  }
+  if (magnitude<0x38800000) {
+    /* Below 2^-14, so a subnormal: the value in units of 2^-24, rounded */
+    mantissa=(magnitude & 0x7fffff) | 0x800000;
+    shift=126-(magnitude>>23);
+    rounded=mantissa>>shift;
+    remainder=mantissa & ((1u<<shift)-1);
+    if (remainder>(1u<<(shift-1)) || (remainder==(1u<<(shift-1)) && (rounded & 1))) {
+      rounded++;
+    }
+    return sign | (uint16_t)rounded;
+  }
+  /* Take 112 from the exponent and round off 13 bits of mantissa */
+  return sign | (uint16_t)((magnitude-0x38000000+0xfff+((magnitude>>13) & 1))>>13);
+}
+
+static uint16_t float_to_bfloat16(float value) {
+  uint32_t bits;
+
+  memcpy(&bits, &value, sizeof(bits));
+  if ((bits & 0x7fffffff)>0x7f800000) {
+    return (uint16_t)((bits>>16) | 0x0040);                    /* Keep NaNs quiet NaNs */
+  }
+  return (uint16_t)((bits+0x7fff+((bits>>16) & 1))>>16);
+}
+
+static float float16_to_float(uint16_t half) {
+  uint32_t sign=(uint32_t)(half & 0x8000)<<16;
+  uint32_t exponent=(half>>10) & 0x1f;
+  uint32_t mantissa=half & 0x3ff;
+  uint32_t bits;
+  float value;
+
+  if (exponent==0) {
+    value=mantissa/16777216.0f;                                /* Zero or subnormal */
+    return sign ? -value : value;
+  }
+  if (exponent==31) {
+    bits=sign | 0x7f800000 | (mantissa<<13);                   /* Infinity or NaN */
+  } else {
+    bits=sign | ((exponent+112)<<23) | (mantissa<<13);
+  }
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+#ifdef HALF_X86_KERNELS
+/* As the float16 loop of convert_float_ieee32_to_half, 8 values at a time for as many as
+   it can. Returns the number of values converted */
+__attribute__((target("avx,f16c")))
+static int float16_f16c(const float* in, uint16_t* out, int n, float mdi, uint16_t mdi_half) {
+  __m256 mdis=_mm256_set1_ps(mdi);
+  __m256 values;
+  int clashes;
+  int i;
+
+  for (i=0; i+8<=n; i+=8) {
+    values=_mm256_loadu_ps(in+i);
+    _mm_storeu_si128((__m128i*)(out+i), _mm256_cvtps_ph(values, _MM_FROUND_TO_NEAREST_INT));
+    clashes=_mm256_movemask_ps(_mm256_cmp_ps(values, mdis, _CMP_EQ_OQ));
+    while (clashes) {
+      out[i+__builtin_ctz(clashes)]=mdi_half;
+      clashes&=clashes-1;
+    }
+  }
+  return i;
+}
+#endif
+
+/* Convert n floats of in to 16 bit format (HALF_FLOAT16 or HALF_BFLOAT16) in out,
+   values equal to mdi becoming mdi_half */
+void convert_float_ieee32_to_half(const float* in, uint16_t* out, int n, int format,
+                                  float mdi, uint16_t mdi_half) {
+  int i=0;
+
+  if (format==HALF_BFLOAT16) {
+    for (; i<n; i++) {
+      out[i]=(in[i]==mdi ? mdi_half : float_to_bfloat16(in[i]));
+    }
+    return;
+  }
+#ifdef HALF_X86_KERNELS
+  if (__builtin_cpu_supports("f16c")) {
+    i=float16_f16c(in, out, n, mdi, mdi_half);
+  }
+#endif
+  for (; i<n; i++) {
+    out[i]=(in[i]==mdi ? mdi_half : float_to_float16(in[i]));
+  }
+}
+
+/* Convert n 16 bit values of in (HALF_FLOAT16 or HALF_BFLOAT16) back to floats in out */
+void convert_float_half_to_ieee32(const uint16_t* in, float* out, int n, int format) {
+  uint32_t bits;
+  int i;
+
+  for (i=0; i<n; i++) {
+    if (format==HALF_BFLOAT16) {
+      bits=(uint32_t)in[i]<<16;
+      memcpy(&out[i], &bits, sizeof(bits));
+    } else {
+      out[i]=float16_to_float(in[i]);
+    }
+  }
+}
@@ -69,54 +69,87 @@
  * =================================================================== *        
  */                                                                             
 #include <stdint.h>
+#include "wgdosbits.h"
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
 #define   exp   0x7F000000                                                      
 #define   sign  0x80000000                                                      
 #define   tiss  0x00FFFFFF                                                      
 #define   etis  0x007FFFFF                                                      
 #define   nrm   0x00F00000                                                      
+#define   inf   0x7F800000
                                                                                 
 #pragma linkage (cfsi32, fortran)                                               
 
+/* Convert one number without branching on its value. k is the number of leading zero bits
+   in the top hex digit of the mantissa. Unnormalised numbers (k >= 4) are kept intact, and
+   the original's "+ 0e0" renormalisation is a no-op on IEEE hardware so is not needed */
+static inline int32_t ibm_to_ieee32(int32_t ibm, int32_t* overflow)
+{
+  uint32_t ibs, ibt, normal;
+  int32_t ibe, k;
+
+  ibs = ibm & sign;
+  ibt = ibm & tiss;
+  k = CLZ64(((uint64_t)ibt << 40) | 1);
+  ibe = (int32_t)((ibm & exp) >> 22) - 256 + 127 - k - 1;
+  normal = ibs | ((uint32_t)ibe << 23) | ((uint32_t)((uint64_t)ibt << k) & etis);
+
+  *overflow |= (ibt != 0) & (k < 4) & (ibe >= 255);
+  return (int32_t)(ibt == 0 ? ibs : k >= 4 ? (uint32_t)ibm : ibe < 0 ? ibs : ibe >= 255 ? (ibs | inf) : normal);
+}
+
+#ifdef __SSE2__
+  /* M ? A : B, lane by lane */
+  #define SELECT128(M, A, B) _mm_or_si128(_mm_and_si128((M), (A)), _mm_andnot_si128((M), (B)))
+#endif
+
 int convert_float_ibm_to_ieee32(int ibm[], int ieee[], int* n)
 {
-  int status = 0;
-  int32_t j, ibs, ibe, ibt, it, k;
-  union { int32_t i; float r; } u;
+  int32_t j = 0;
+  int32_t overflow = 0;
 
-  for(j = 0; j < *n; j++) {
-    ibs = ibm[j] & sign;
-    ibe = ibm[j] & exp ;
-    ibt = ibm[j] & tiss;
-    if (ibt == 0) {
-      ibe = 0 ;
-    } else {
-      if ( (ibe != 0) && (ibt & nrm) == 0 ) {
-        u.i = ibm[j] ;
-        u.r = u.r + 0e0 ;
-        ibe = u.i & exp ;
-        ibt = u.i & tiss ;
-      }
-      /* mantissa */
-      it = ibt << 8;
-      for (k = 0; (k < 5) && (it >= 0); k++ ) {
-        it = it << 1;
+#ifdef __SSE2__
+  /* Four at a time, normalising by shifting the mantissa one bit at most three times */
+  {
+    __m128i over = _mm_setzero_si128();
+    for(; j + 4 <= *n; j += 4) {
+      __m128i x = _mm_loadu_si128((__m128i*)&ibm[j]);
+      __m128i ibs = _mm_and_si128(x, _mm_set1_epi32(sign));
+      __m128i ibt = _mm_and_si128(x, _mm_set1_epi32(tiss));
+      __m128i it = ibt, k = _mm_setzero_si128(), ibe, c, out;
+      __m128i zero, keep, big;
+      int i;
+
+      for (i = 0; i < 3; i++) {
+        c = _mm_cmplt_epi32(it, _mm_set1_epi32(0x00800000));
+        it = _mm_add_epi32(it, _mm_and_si128(it, c));
+        k = _mm_sub_epi32(k, c);
       }
-      if ( k < 4 ) {
-        ibt = (it >> 8) & etis;
-        ibe = (ibe >> 22) - 256 + 127 - k - 1;
-        if (ibe < 0) {
-          ibe = ibt = 0;
-        }
-        if (ibe >= 255) {
-         ibe = 255; ibt = 0;
-        }
-        ibe = ibe << 23;
-       }
-    }
-    ieee[j] = ibs | ibe | ibt;
-    if (ibe == 255<<23) {
-      status = -1;
+      ibe = _mm_sub_epi32(_mm_srli_epi32(_mm_and_si128(x, _mm_set1_epi32(exp)), 22),
+                          _mm_add_epi32(k, _mm_set1_epi32(256 - 127 + 1)));
+      out = _mm_or_si128(_mm_or_si128(ibs, _mm_slli_epi32(ibe, 23)),
+                         _mm_and_si128(it, _mm_set1_epi32(etis)));
+
+      /* Zero mantissa or underflow gives zero, an unnormalised number is kept as it is */
+      zero = _mm_cmpeq_epi32(ibt, _mm_setzero_si128());
+      keep = _mm_andnot_si128(zero, _mm_cmplt_epi32(ibt, _mm_set1_epi32(0x00100000)));
+      zero = _mm_or_si128(zero, _mm_cmplt_epi32(ibe, _mm_setzero_si128()));
+      big = _mm_andnot_si128(_mm_or_si128(zero, keep), _mm_cmpgt_epi32(ibe, _mm_set1_epi32(254)));
+      over = _mm_or_si128(over, big);
+
+      out = SELECT128(big, _mm_or_si128(ibs, _mm_set1_epi32(inf)), out);
+      out = SELECT128(zero, ibs, out);
+      out = SELECT128(keep, x, out);
+      _mm_storeu_si128((__m128i*)&ieee[j], out);
     }
+    overflow = _mm_movemask_epi8(over) != 0;
+  }
+#endif
+
+  for(; j < *n; j++) {
+    ieee[j] = ibm_to_ieee32(ibm[j], &overflow);
   }
-  return status;
+  return overflow ? -1 : 0;
 }
@@ -74,42 +74,83 @@
  * =================================================================== *
  */                                                                             
 #include <stdint.h>
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
 #define last 0x000000ff
 #define impl 0x00800000
 #define sign 0x80000000
 #define tiss 0x007fffff
                                                                                 
 #pragma linkage (cfi32s, fortran)
+
+/* Convert one number without branching on its value. k is the position of the IEEE exponent
+   within its hex digit, and the mantissa is rounded and shifted right by (4-k)%4 bits.
+   Zero and denormal numbers are passed through unchanged, as by the original loop */
+static inline int32_t ieee32_to_ibm(int32_t ieee, int32_t* nonzero, int32_t* nan)
+{
+  uint32_t ibs, ibe, ibt, shift;
+
+  ibs = ieee & sign;
+  ibe = (ieee >> 23) & last;
+  shift = (2 - ibe) & 3;
+  ibt = (ieee & tiss) | impl;
+  ibt = (ibt + ((1U << shift) >> 1)) >> shift;
+  ibt = ibs | (((ibe + 130 + 3) >> 2) << 24) | ibt;
+
+  *nonzero |= ibe != 0;
+  *nan |= ibe == 255;
+  return ibe == 0 ? ieee : ibe == 255 ? (int32_t)(ibs | 0x7fffffff) : (int32_t)ibt;
+}
+
+#ifdef __SSE2__
+  /* M ? A : B, lane by lane */
+  #define SELECT128(M, A, B) _mm_or_si128(_mm_and_si128((M), (A)), _mm_andnot_si128((M), (B)))
+#endif
+
 int convert_float_ieee32_to_ibm(int ieee[], int ibm[], int* n)
 {
-  int status = 0;
-  int32_t j, k, ibs, ibe, ibt;
-  for(j = 0; j < *n; j++) {
-    ibt = ieee[j];
-    ibs = ieee[j] & sign;
-    ibe = (ieee[j] >> 23) & last;
+  int32_t j = 0;
+  int32_t nonzero = 0, nan = 0;
+
+#ifdef __SSE2__
+  /* Four at a time, choosing between the three possible mantissa shifts */
+  {
+    __m128i anynonzero = _mm_setzero_si128(), anynan = _mm_setzero_si128();
+    for(; j + 4 <= *n; j += 4) {
+      __m128i x = _mm_loadu_si128((__m128i*)&ieee[j]);
+      __m128i ibs = _mm_and_si128(x, _mm_set1_epi32(sign));
+      __m128i ibe = _mm_and_si128(_mm_srli_epi32(x, 23), _mm_set1_epi32(last));
+      __m128i k = _mm_and_si128(_mm_add_epi32(ibe, _mm_set1_epi32(2)), _mm_set1_epi32(3));
+      __m128i ibt = _mm_or_si128(_mm_and_si128(x, _mm_set1_epi32(tiss)), _mm_set1_epi32(impl));
+      __m128i out, iszero, isnan;
+
+      ibt = SELECT128(_mm_cmpeq_epi32(k, _mm_set1_epi32(1)),
+                      _mm_srli_epi32(_mm_add_epi32(ibt, _mm_set1_epi32(4)), 3), ibt);
+      ibt = SELECT128(_mm_cmpeq_epi32(k, _mm_set1_epi32(2)),
+                      _mm_srli_epi32(_mm_add_epi32(ibt, _mm_set1_epi32(2)), 2), ibt);
+      ibt = SELECT128(_mm_cmpeq_epi32(k, _mm_set1_epi32(3)),
+                      _mm_srli_epi32(_mm_add_epi32(ibt, _mm_set1_epi32(1)), 1), ibt);
+      out = _mm_or_si128(_mm_or_si128(ibs, ibt),
+                         _mm_slli_epi32(_mm_srli_epi32(_mm_add_epi32(ibe, _mm_set1_epi32(130 + 3)), 2), 24));
 
-    if (ibe != 0)
-    {
-      if (ibe == 255)
-      { ibe = 378;
-        ibt = tiss;
-      status = -1; /* Inf or NaN */
-      }
-      ibe = ibe - 127 + 256 +1;
-      k = ibe%4;
-      ibe = ibe >> 2;
-      if (k != 0)
-        ibe = ibe + 1;
-      ibe = ibe << 24 ;
-      ibt = (ibt & tiss) | impl ;
-      if (k != 0)
-        ibt = ( ibt + (1 << (3-k) )  ) >> (4-k);
-      if (status == 0) {
-        status = 1; /* Rounding error */
-      }
+      iszero = _mm_cmpeq_epi32(ibe, _mm_setzero_si128());
+      isnan = _mm_cmpeq_epi32(ibe, _mm_set1_epi32(last));
+      anynonzero = _mm_or_si128(anynonzero, _mm_andnot_si128(iszero, _mm_set1_epi32(-1)));
+      anynan = _mm_or_si128(anynan, isnan);
+
+      out = SELECT128(isnan, _mm_or_si128(ibs, _mm_set1_epi32(0x7fffffff)), out);
+      out = SELECT128(iszero, x, out);
+      _mm_storeu_si128((__m128i*)&ibm[j], out);
     }
-    ibm[j] = ibs | ibe | ibt;
+    nonzero = _mm_movemask_epi8(anynonzero) != 0;
+    nan = _mm_movemask_epi8(anynan) != 0;
+  }
+#endif
+
+  for(; j < *n; j++) {
+    ibm[j] = ieee32_to_ibm(ieee[j], &nonzero, &nan);
   }
-  return status;
+  /* -1 for Inf or NaN, otherwise 1 if any number may have been rounded */
+  return nan ? -1 : nonzero ? 1 : 0;
 }
@@ -63,9 +63,23 @@
  *  Machine independent: the given array of values are, as the spcification says, 
  *   treated as a bytestream, I.e. unsigned char type.
  *
+ *  Eight n-bit values always take exactly n bytes, so the bulk of the values are
+ *   unpacked eight at a time by a kernel generated for each bits_per_value from
+ *   1 to 31, in which every byte offset and shift is a constant. On x86 processors
+ *   that have them, SSE4.1 or AVX2 kernels do the same for 8 to 16 bits per value.
+ *   Whatever is left over at the end of the values goes through the byte by byte
+ *   method described below. All of them give identical results.
+ *
  */
 
+#include <stdint.h>
 #include "wgdosstuff.h"
+#include "wgdosbits.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define NBIT_X86_KERNELS 1
+  #include <immintrin.h>
+#endif
 
 /* Return Value of function: number of items actually unpacked */
 
@@ -120,15 +134,15 @@ We can mask these out by ANDing with (2^15)-1
 */
 
 #include <stdio.h>
-int extract_nbit_words(
-  /* IN */
-  void *packed,           /* Integers in packed form */
-  int bits_per_value,   /* Length of each packed integer in bits */
-                              /* 1 <= bits_per_value <= 32 */
-  int nitems,           /* Number of values to unpack */
-  /* OUT */
-  int *unpacked              /* Array of nitems integers. On exit contains */
-                              /* the integers in unpacked form */
+
+/* The original method: walk back through the bytes holding each value in turn.
+   Unpacks values first to nitems-1 */
+static void extract_nbit_words_bytewise(
+  unsigned char* packed,      /* Integers in packed form */
+  int bits_per_value,         /* Length of each packed integer in bits */
+  int first,                  /* First value to unpack */
+  int nitems,                 /* Number of values in total */
+  int *unpacked               /* Array of nitems integers */
 )
 {
   int right_shift;            /* How far to shift the numbers left */
@@ -140,15 +154,11 @@ int extract_nbit_words(
   unsigned int val;            /* Store the useful bits, once they have been extracted from a byte */
   unsigned int tval;            /* the value at "ptr" */
   unsigned int mask;            /* Masks out the unneeded higher bits */
-    
-  if (bits_per_value>32 || bits_per_value<=0) {
-    return -1;
-  }
-    
+
   mask = (1<<bits_per_value)-1; /* The lowest bits_per_value bits of mask are set to 1 */
 
   /* Loop for each item to be unpacked */
-  for ( i = 0; i < nitems; i++ ) {
+  for ( i = first; i < nitems; i++ ) {
 
     offset = packed + (i * bits_per_value/8); /* What is the first byte that contains bits we need? */
     ptr = packed + ((i+1) * bits_per_value/8); /* What is the last byte that contains bits we need? */
@@ -172,5 +182,162 @@ int extract_nbit_words(
     }
     unpacked[i] = val&mask; /* Mask out the unneeded bits in the final result  and put in the unpacked array */
   }
+}
+
+/* Value J of a group of eight W-bit values starting at byte IN */
+#define NBIT_VALUE(W, J, IN) NBIT_VALUE_AT(IN, (J)*(W), W)
+
+/* Generate the kernel that unpacks ngroups groups of eight W-bit values. Reads up to
+   8 bytes past the last group */
+#define NBIT_KERNEL(W) \
+static void extract_##W##_bit_words(const unsigned char* in, int ngroups, int* out) \
+{ \
+  int g; \
+  for (g=0; g<ngroups; g++, in+=(W), out+=8) { \
+    out[0]=NBIT_VALUE(W, 0, in); \
+    out[1]=NBIT_VALUE(W, 1, in); \
+    out[2]=NBIT_VALUE(W, 2, in); \
+    out[3]=NBIT_VALUE(W, 3, in); \
+    out[4]=NBIT_VALUE(W, 4, in); \
+    out[5]=NBIT_VALUE(W, 5, in); \
+    out[6]=NBIT_VALUE(W, 6, in); \
+    out[7]=NBIT_VALUE(W, 7, in); \
+  } \
+}
+
+NBIT_KERNEL(1)  NBIT_KERNEL(2)  NBIT_KERNEL(3)  NBIT_KERNEL(4)
+NBIT_KERNEL(5)  NBIT_KERNEL(6)  NBIT_KERNEL(7)  NBIT_KERNEL(8)
+NBIT_KERNEL(9)  NBIT_KERNEL(10) NBIT_KERNEL(11) NBIT_KERNEL(12)
+NBIT_KERNEL(13) NBIT_KERNEL(14) NBIT_KERNEL(15) NBIT_KERNEL(16)
+NBIT_KERNEL(17) NBIT_KERNEL(18) NBIT_KERNEL(19) NBIT_KERNEL(20)
+NBIT_KERNEL(21) NBIT_KERNEL(22) NBIT_KERNEL(23) NBIT_KERNEL(24)
+NBIT_KERNEL(25) NBIT_KERNEL(26) NBIT_KERNEL(27) NBIT_KERNEL(28)
+NBIT_KERNEL(29) NBIT_KERNEL(30) NBIT_KERNEL(31)
+
+typedef void (*nbit_kernel)(const unsigned char* in, int ngroups, int* out);
+
+static const nbit_kernel nbit_kernels[32] = { NULL,
+  extract_1_bit_words,  extract_2_bit_words,  extract_3_bit_words,  extract_4_bit_words,
+  extract_5_bit_words,  extract_6_bit_words,  extract_7_bit_words,  extract_8_bit_words,
+  extract_9_bit_words,  extract_10_bit_words, extract_11_bit_words, extract_12_bit_words,
+  extract_13_bit_words, extract_14_bit_words, extract_15_bit_words, extract_16_bit_words,
+  extract_17_bit_words, extract_18_bit_words, extract_19_bit_words, extract_20_bit_words,
+  extract_21_bit_words, extract_22_bit_words, extract_23_bit_words, extract_24_bit_words,
+  extract_25_bit_words, extract_26_bit_words, extract_27_bit_words, extract_28_bit_words,
+  extract_29_bit_words, extract_30_bit_words, extract_31_bit_words };
+
+#ifdef NBIT_X86_KERNELS
+/* For 8 to 16 bits per value, a group of eight values fits in one 16 byte vector and
+   each value lies within 3 bytes. Shuffle the 3 bytes of each value into the top of a
+   32-bit lane, MSB first, then shift the value up to the top of the lane and back down. */
+static void nbit_shuffle(int bits_per_value, int first, unsigned char* shuffle, int* shift) {
+  int j, b, bit;
+  for (j=0; j<4; j++) {
+    bit=(first+j)*bits_per_value;
+    shuffle[4*j]=0x80; /* zero */
+    for (b=0; b<3; b++) {
+      shuffle[4*j+3-b]=(bit/8+b<16 ? bit/8+b : 0x80);
+    }
+    shift[j]=bit%8;
+  }
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static void extract_8_16_bit_words_sse4(const unsigned char* in, int bits_per_value, int ngroups, int* out) {
+  unsigned char shuffle[32];
+  int shift[8];
+  int j, g;
+  __m128i lo_shuffle, hi_shuffle, lo_multiply, hi_multiply, right_shift, packed;
+
+  nbit_shuffle(bits_per_value, 0, shuffle, shift);
+  nbit_shuffle(bits_per_value, 4, shuffle+16, shift+4);
+  lo_shuffle=_mm_loadu_si128((__m128i*)shuffle);
+  hi_shuffle=_mm_loadu_si128((__m128i*)(shuffle+16));
+  /* No variable shifts in SSE4.1: multiply by a power of two instead */
+  for (j=0; j<8; j++) {
+    shift[j]=1<<shift[j];
+  }
+  lo_multiply=_mm_loadu_si128((__m128i*)shift);
+  hi_multiply=_mm_loadu_si128((__m128i*)(shift+4));
+  right_shift=_mm_cvtsi32_si128(32-bits_per_value);
+
+  for (g=0; g<ngroups; g++, in+=bits_per_value, out+=8) {
+    packed=_mm_loadu_si128((__m128i*)in);
+    _mm_storeu_si128((__m128i*)out,
+      _mm_srl_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(packed, lo_shuffle), lo_multiply), right_shift));
+    _mm_storeu_si128((__m128i*)(out+4),
+      _mm_srl_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(packed, hi_shuffle), hi_multiply), right_shift));
+  }
+}
+
+__attribute__((target("avx2")))
+static void extract_8_16_bit_words_avx2(const unsigned char* in, int bits_per_value, int ngroups, int* out) {
+  unsigned char shuffle[32];
+  int shift[8];
+  int g;
+  __m256i shuffles, left_shift, packed;
+  __m128i right_shift;
+
+  /* The shuffle works within each 128-bit half, so both halves get the whole group */
+  nbit_shuffle(bits_per_value, 0, shuffle, shift);
+  nbit_shuffle(bits_per_value, 4, shuffle+16, shift+4);
+  shuffles=_mm256_loadu_si256((__m256i*)shuffle);
+  left_shift=_mm256_loadu_si256((__m256i*)shift);
+  right_shift=_mm_cvtsi32_si128(32-bits_per_value);
+
+  for (g=0; g<ngroups; g++, in+=bits_per_value, out+=8) {
+    packed=_mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)in));
+    _mm256_storeu_si256((__m256i*)out,
+      _mm256_srl_epi32(_mm256_sllv_epi32(_mm256_shuffle_epi8(packed, shuffles), left_shift), right_shift));
+  }
+}
+#endif
+
+int extract_nbit_words(
+  /* IN */
+  void *packed,           /* Integers in packed form, at least bits_per_value*nitems */
+                          /* bits rounded up to the next complete numeric storage unit */
+  int bits_per_value,   /* Length of each packed integer in bits */
+                              /* 1 <= bits_per_value <= 32 */
+  int nitems,           /* Number of values to unpack */
+  /* OUT */
+  int *unpacked              /* Array of nitems integers. On exit contains */
+                              /* the integers in unpacked form */
+)
+{
+  int nbytes;                 /* Bytes of packed data that may be read */
+  int ngroups;                /* Groups of eight values for the specialised kernels */
+    
+  if (bits_per_value>32 || bits_per_value<=0) {
+    return -1;
+  }
+
+  /* The kernels read up to 8 bytes past the end of their last group, and the SIMD kernels
+     16 bytes from the start of it, so stay clear of the end of the packed data */
+  ngroups=0;
+  if (bits_per_value<32) {
+    nbytes=((bits_per_value*nitems+PP_BITS_PER_NUMERIC-1)/PP_BITS_PER_NUMERIC)*PP_BYTES_PER_NUMERIC;
+    ngroups=nitems/8;
+    if (nbytes<8) {
+      ngroups=0;
+    } else if (ngroups>(nbytes-8)/bits_per_value) {
+      ngroups=(nbytes-8)/bits_per_value;
+    }
+  }
+
+  if (ngroups>0) {
+#ifdef NBIT_X86_KERNELS
+    if (bits_per_value>=8 && bits_per_value<=16 && __builtin_cpu_supports("avx2")) {
+      extract_8_16_bit_words_avx2(packed, bits_per_value, ngroups, unpacked);
+    } else if (bits_per_value>=8 && bits_per_value<=16 && __builtin_cpu_supports("sse4.1")) {
+      extract_8_16_bit_words_sse4(packed, bits_per_value, ngroups, unpacked);
+    } else {
+      nbit_kernels[bits_per_value](packed, ngroups, unpacked);
+    }
+#else
+    nbit_kernels[bits_per_value](packed, ngroups, unpacked);
+#endif
+  }
+  extract_nbit_words_bytewise(packed, bits_per_value, 8*ngroups, nitems, unpacked);
   return 0;
 }
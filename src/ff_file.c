@@ -0,0 +1,300 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* ff_file.c
+ *
+ * Description:
+ *   Read fields from a UM fieldsfile, unpacking each only when asked for
+ *
+ * Information:
+ *   The file is memory mapped, and its fixed length header and lookup
+ *   table are read once, in native order. Each field's data is found from
+ *   its lookup entry (LBEGIN, the word address of the field, and LBNREC,
+ *   the number of words it takes on disk), so only the fields asked for
+ *   are ever read from disk. ff_file_prefetch starts reading a list of
+ *   fields at once, ahead of unpacking them. The mapping is only ever
+ *   read, so a number of threads may unpack fields from one file at once.
+ *   Fieldsfiles are big endian with 64 bit words. Unpacked fields are held
+ *   as 64 bit reals, and LBPACK n1=2 fields as 32 bit reals.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "ppfield_lookup.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+
+/* Fixed length header words, from 0 */
+#define FIXHD_LOOKUP_START 149       /* Word address (from 1) of the lookup table */
+#define FIXHD_LOOKUP_LENGTH 150      /* Words in each lookup entry */
+#define FIXHD_LOOKUP_COUNT 151       /* Number of lookup entries */
+/* Lookup entry words, from 0 */
+#define LBYR 0
+#define LBPACK 20
+#define LBEGIN 28
+#define LBNREC 29
+#define LBLREC 14
+#define FF_UNUSED -99
+#define CRAY32_PACKED 2
+/* End of header */
+
+/* Open a fieldsfile and read its lookup table. Returns 0 if it worked, nonzero if not,
+   with no file open */
+int ff_file_open(const char* path, ff_file* file, function* parent) {
+  struct stat st;
+  int64_t   lookup_start;
+  int64_t   lookup_length;
+  int64_t   lookup_count;
+  int64_t   words;
+  int64_t   begin;
+  int64_t   nrec;
+  ff_file_field* field;
+  int64_t   entry;
+  int       fd;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  memset(file, 0, sizeof(*file));
+  fd=open(path, O_RDONLY);
+  if (fd<0 || fstat(fd, &st)) {
+    snprintf(message, MAX_MESSAGE_SIZE, "Cannot open %s: %s", path, strerror(errno));
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    set_logerrno(LOGERRNO_IO_EXCEPTION);
+    if (fd>=0) {
+      close(fd);
+    }
+    return 1;
+  }
+  file->length=st.st_size;
+  if (file->length<sizeof(file->fixed_header)) {
+    snprintf(message, MAX_MESSAGE_SIZE, "%s is too short to be a fieldsfile", path);
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+    close(fd);
+    return 1;
+  }
+  file->map=mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file->map==MAP_FAILED) {
+    snprintf(message, MAX_MESSAGE_SIZE, "Cannot map %s: %s", path, strerror(errno));
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    set_logerrno(LOGERRNO_IO_EXCEPTION);
+    file->map=NULL;
+    return 1;
+  }
+
+  network_order_words64(file->map, file->fixed_header, FF_FIXED_HEADER_WORDS);
+  lookup_start=file->fixed_header[FIXHD_LOOKUP_START]-1;
+  lookup_length=file->fixed_header[FIXHD_LOOKUP_LENGTH];
+  lookup_count=file->fixed_header[FIXHD_LOOKUP_COUNT];
+  /* Divide rather than multiply, so that no header can overflow the check */
+  words=file->length/8;
+  if (lookup_start<FF_FIXED_HEADER_WORDS || lookup_length<PP_LOOKUP_WORDS || lookup_count<0 ||
+      lookup_start>words || lookup_count>(words-lookup_start)/lookup_length) {
+    snprintf(message, MAX_MESSAGE_SIZE, "%s: lookup table of %ld entries at word %ld does not fit in the file",
+             path, (long)lookup_count, (long)lookup_start+1);
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+    ff_file_close(file);
+    return 1;
+  }
+
+  file->fields = (ff_file_field *) malloc(sizeof(ff_file_field) * (lookup_count>0 ? lookup_count : 1));
+  if (!file->fields) {
+    MO_syslog(VERBOSITY_ERROR, "Out of memory for the lookup table", &subroutine);
+    ff_file_close(file);
+    return 1;
+  }
+
+  /* Keep the entries in use, checking each field lies within the file */
+  for (entry=0; entry<lookup_count; entry++) {
+    field=&file->fields[file->nfields];
+    network_order_words64(file->map+8*(lookup_start+entry*lookup_length), field->lookup, PP_LOOKUP_WORDS);
+    if ((int64_t)field->lookup[LBYR]==FF_UNUSED || (int64_t)field->lookup[LBEGIN]==FF_UNUSED) {
+      continue;
+    }
+    begin=field->lookup[LBEGIN];
+    nrec=field->lookup[LBNREC]>0 ? (int64_t)field->lookup[LBNREC] : (int64_t)field->lookup[LBLREC];
+    if (begin<=0 || nrec<0 || begin>words || nrec>words-begin) {
+      snprintf(message, MAX_MESSAGE_SIZE, "%s: field %ld at word %ld, %ld words long, is not within the file",
+               path, (long)entry+1, (long)begin, (long)nrec);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      ff_file_close(file);
+      return 1;
+    }
+    field->data_offset=8*(size_t)begin;
+    field->data_length=8*(size_t)nrec;
+    file->nfields++;
+  }
+
+  snprintf(message, MAX_MESSAGE_SIZE, "%s: %d fields", path, file->nfields);
+  MO_syslog(VERBOSITY_INFO, message, &subroutine);
+  return 0;
+}
+
+/* Unmap the file and free the lookup table */
+void ff_file_close(ff_file* file) {
+  if (file->map) {
+    munmap(file->map, file->length);
+  }
+  free(file->fields);
+  memset(file, 0, sizeof(*file));
+}
+
+/* Start reading the data of the given fields from disk, all at once, so that
+   unpacking them does not wait on each in turn */
+void ff_file_prefetch(const ff_file* file, const int* which, int n) {
+  long      page=sysconf(_SC_PAGESIZE);
+  size_t    start;
+  int       i;
+  for (i=0; i<n; i++) {
+    if (which[i]<0 || which[i]>=file->nfields) {
+      continue;
+    }
+    start=file->fields[which[i]].data_offset & ~(size_t)(page-1);
+    posix_madvise(file->map+start,
+                  file->fields[which[i]].data_offset+file->fields[which[i]].data_length-start,
+                  POSIX_MADV_WILLNEED);
+  }
+}
+
+/* Unpack field number n (from 0) of the file into to, which must hold
+   LBROW*LBNPT values. NULL to test unpack. Returns 0 if it worked */
+int ff_file_unpack(const ff_file* file, int n, float* to, function* parent) {
+  wgdos_context context;
+  int retval;
+  wgdos_context_init(&context);
+  retval=ff_file_unpack_ctx(&context, file, n, to, parent);
+  wgdos_context_free(&context);
+  return retval;
+}
+
+/* As ff_file_unpack, taking the work areas from the context */
+int ff_file_unpack_ctx(wgdos_context* context, const ff_file* file, int n, float* to, function* parent) {
+  const ff_file_field* field;
+  char*     data;
+  char*     copy;
+  double*   values;
+  uint64_t  lookup[PP_LOOKUP_WORDS];
+  float     mdi;
+  int       data_size;
+  int       pack;
+  int       unpacked_size;
+  int       i;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  if (n<0 || n>=file->nfields) {
+    snprintf(message, MAX_MESSAGE_SIZE, "No field %d, the file has %d", n, file->nfields);
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    return 1;
+  }
+  field=&file->fields[n];
+  data=file->map+field->data_offset;
+  memcpy(lookup, field->lookup, sizeof(lookup));
+  read_ppfield_lookup(lookup, TRUE, &mdi, &data_size, &pack, &unpacked_size);
+  if (pack==CRAY32_PACKED) {
+    /* LBLREC-LBEXT counts 64 bit words, each holding two 32 bit values */
+    data_size=(data_size>INT_MAX/2 ? INT_MAX : 2*data_size);
+  }
+  if (data_size<0 || (size_t)data_size>field->data_length/4) {
+    data_size=field->data_length/4;
+  }
+
+  switch (pack) {
+  case UNPACKED:
+    /* 64 bit reals, to native floats */
+    if ((size_t)unpacked_size>field->data_length/8) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Field %d has %d values but only %lu on disk",
+               n, unpacked_size, (unsigned long)(field->data_length/8));
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      return 1;
+    }
+    if (to!=NULL) {
+      values=wgdos_context_scratch(context, WGDOS_SCRATCH_PACKED_FIELD, sizeof(double)*(size_t)unpacked_size);
+      if (!values) {
+        MO_syslog(VERBOSITY_ERROR, "Out of memory for the field", &subroutine);
+        return 1;
+      }
+      network_order_words64(data, values, unpacked_size);
+      for (i=0; i<unpacked_size; i++) {
+        to[i]=(float)values[i];
+      }
+    }
+    return 0;
+  case CRAY32_PACKED:
+    /* 32 bit reals, as a PP file's unpacked field */
+    if (data_size<unpacked_size) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Field %d has %d values but only %d on disk",
+               n, unpacked_size, data_size);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      return 1;
+    }
+    return unpack_ppfield_ctx(context, mdi, unpacked_size, data, UNPACKED, unpacked_size, to, &subroutine);
+  case WGDOS_PACKED:
+    /* Make sure a damaged field can't be read beyond its end */
+    if (field->data_length<12 || 4*(size_t)ntohl(*(uint32_t*)data)>field->data_length) {
+      snprintf(message, MAX_MESSAGE_SIZE, "WGDOS field %d is longer than its space in the file", n);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      return 1;
+    }
+    return unpack_ppfield_ctx(context, mdi, data_size, data, pack, unpacked_size, to, &subroutine);
+  case RLE_PACKED:
+    /* Run length decoding changes its input, so give it a copy of the mapped data */
+    copy=wgdos_context_scratch(context, WGDOS_SCRATCH_PACKED_FIELD, 4*(size_t)data_size);
+    if (!copy) {
+      MO_syslog(VERBOSITY_ERROR, "Out of memory for the packed field", &subroutine);
+      return 1;
+    }
+    memcpy(copy, data, 4*(size_t)data_size);
+    return unpack_ppfield_ctx(context, mdi, data_size, copy, pack, unpacked_size, to, &subroutine);
+  default:
+    snprintf(message, MAX_MESSAGE_SIZE, "Field %d has unrecognised packing code %d", n, pack);
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    return 1;
+  }
+}
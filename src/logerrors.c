@@ -34,11 +34,14 @@
 
 #include "logerrors.h"
 
+/* Settings, for the whole program. Set these before starting any threads */
 int verbosity=VERBOSITY_ALL;  /* How much logging should be done */
-int logerror=VERBOSITY_ALL; /* What is the most serious error so far */
-int logerrno=LOGERRNO_NO_EXCEPTION; /* What exit code should we use on exit() */
 int error_level=VERBOSITY_ERROR; /* What level do we want to throw an error on? */
 
+/* Error state, kept separately by each thread for the calls it has made */
+THREAD_LOCAL int logerror=VERBOSITY_ALL; /* What is the most serious error so far */
+THREAD_LOCAL int logerrno=LOGERRNO_NO_EXCEPTION; /* What exit code should we use on exit() */
+
 void set_error_level(int val) {
   error_level=val;
 }
@@ -49,6 +52,14 @@ void set_logerrno(int val) {
   }
 }
 
+int get_logerrno(void) {
+  return logerrno;
+}
+
+void reset_logerrno(void) {
+  logerrno=LOGERRNO_NO_EXCEPTION;
+}
+
 void reset_logerror(void) {
   logerror=VERBOSITY_ALL;
 }
@@ -40,6 +40,21 @@
   #define LOGERRNO_FORMAT_EXCEPTION 2
   #define LOGERRNO_IO_EXCEPTION 3
 
+  /* Storage for state that each thread keeps for itself: the error state and the
+     message buffers. The library can then be called from several threads at once.
+     Other compilers may be given theirs with -DTHREAD_LOCAL=... */
+  #if defined(THREAD_LOCAL)
+  #elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+    #define THREAD_LOCAL _Thread_local
+  #elif defined(__GNUC__)
+    #define THREAD_LOCAL __thread
+  #elif defined(_MSC_VER)
+    #define THREAD_LOCAL __declspec(thread)
+  #else
+    /* Without it every thread would share one error state and message buffer */
+    #error "No thread local storage class known for this compiler: define THREAD_LOCAL"
+  #endif
+
   typedef struct function {
     char name[128];
     struct function* parent;
@@ -57,6 +72,8 @@
   void set_verbosity(int val);
   int get_logerror(void);
   void set_logerrno(int val);
+  int get_logerrno(void);
+  void reset_logerrno(void);
   void set_error_level(int val);
 
   /* NOTE: Your main function must define the MO_syslog routine */
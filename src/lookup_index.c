@@ -0,0 +1,287 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* lookup_index.c
+ *
+ * Description:
+ *   Find fields by STASH code, level, processing code and time, from an
+ *   index built once over a lookup table
+ *
+ * Information:
+ *   The header words searched on are copied out into one array each. Two
+ *   orders of the fields are kept as sorted key arrays: by STASH code, then
+ *   level, then validity time; and by validity time alone. A query narrows
+ *   down to a run of one of these by binary search (by STASH code if it
+ *   gives one, else by validity time), and only the fields in that run are
+ *   checked against the rest of the query. Works on 32 and 64 bit lookups,
+ *   and on lookups held inside other structures (e.g. pp_file_field), by
+ *   taking the distance in bytes between one lookup and the next.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "logerrors.h"
+
+/* Lookup words, from 0 */
+#define LBYR 0
+#define LBYRD 6
+#define LBREL 21
+#define LBPROC 24
+#define LBLEV 32
+#define LBUSER4 41
+/* End of header */
+
+typedef struct index_key {
+  int       stash;
+  int       level;
+  int64_t   validity;
+  int       field;
+} index_key;
+
+/* Sortable time: YYYYMMDDhhmmss as a number */
+int64_t lookup_time(int year, int month, int day, int hour, int minute, int second) {
+  return ((((year*(int64_t)100+month)*100+day)*100+hour)*100+minute)*100+second;
+}
+
+/* Lookup word n as an int, for either word length */
+static int64_t lookup_word(const char* lookup, int lookup64, int n) {
+  if (lookup64) {
+    return ((const int64_t*)lookup)[n];
+  }
+  return ((const int32_t*)lookup)[n];
+}
+
+/* The time starting at word first: year, month, day, hour, minute, then the
+   seconds from header release 3 on (the day number before that) */
+static int64_t read_lookup_time(const char* lookup, int lookup64, int first) {
+  return lookup_time(lookup_word(lookup, lookup64, first),
+                     lookup_word(lookup, lookup64, first+1),
+                     lookup_word(lookup, lookup64, first+2),
+                     lookup_word(lookup, lookup64, first+3),
+                     lookup_word(lookup, lookup64, first+4),
+                     lookup_word(lookup, lookup64, LBREL)>=3 ? lookup_word(lookup, lookup64, first+5) : 0);
+}
+
+static int compare_key(int stash_a, int level_a, int64_t validity_a,
+                       int stash_b, int level_b, int64_t validity_b) {
+  if (stash_a!=stash_b) {
+    return stash_a<stash_b ? -1 : 1;
+  }
+  if (level_a!=level_b) {
+    return level_a<level_b ? -1 : 1;
+  }
+  return (validity_a>validity_b) - (validity_a<validity_b);
+}
+
+static int compare_stash_key(const void* a, const void* b) {
+  const index_key* ka=(const index_key*)a;
+  const index_key* kb=(const index_key*)b;
+  int c=compare_key(ka->stash, ka->level, ka->validity, kb->stash, kb->level, kb->validity);
+  return c ? c : ka->field-kb->field;
+}
+
+static int compare_time_key(const void* a, const void* b) {
+  const index_key* ka=(const index_key*)a;
+  const index_key* kb=(const index_key*)b;
+  int c=(ka->validity>kb->validity) - (ka->validity<kb->validity);
+  return c ? c : ka->field-kb->field;
+}
+
+static int compare_int(const void* a, const void* b) {
+  return *(const int*)a - *(const int*)b;
+}
+
+/* Build an index over nlookups lookups, stride bytes apart, 64 bit words if
+   lookup64 is set. Returns 0 if it worked */
+int lookup_index_build(lookup_index* index, const void* lookups, int nlookups, size_t stride,
+                       int lookup64, function* parent) {
+  index_key* keys;
+  const char* lookup;
+  int       i;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  memset(index, 0, sizeof(*index));
+  if (nlookups<0) {
+    nlookups=0;
+  }
+  index->stash         = (int *) malloc(sizeof(int) * (nlookups+1));
+  index->level         = (int *) malloc(sizeof(int) * (nlookups+1));
+  index->lbproc        = (int *) malloc(sizeof(int) * (nlookups+1));
+  index->validity      = (int64_t *) malloc(sizeof(int64_t) * (nlookups+1));
+  index->data_time     = (int64_t *) malloc(sizeof(int64_t) * (nlookups+1));
+  index->by_stash      = (int *) malloc(sizeof(int) * (nlookups+1));
+  index->stash_key     = (int *) malloc(sizeof(int) * (nlookups+1));
+  index->level_key     = (int *) malloc(sizeof(int) * (nlookups+1));
+  index->validity_key  = (int64_t *) malloc(sizeof(int64_t) * (nlookups+1));
+  index->by_time       = (int *) malloc(sizeof(int) * (nlookups+1));
+  index->time_key      = (int64_t *) malloc(sizeof(int64_t) * (nlookups+1));
+  keys                 = (index_key *) malloc(sizeof(index_key) * (nlookups+1));
+  if (!(index->stash && index->level && index->lbproc && index->validity && index->data_time &&
+        index->by_stash && index->stash_key && index->level_key && index->validity_key &&
+        index->by_time && index->time_key && keys)) {
+    MO_syslog(VERBOSITY_ERROR, "Out of memory for the lookup index", &subroutine);
+    free(keys);
+    lookup_index_free(index);
+    return 1;
+  }
+  index->n=nlookups;
+
+  for (i=0; i<nlookups; i++) {
+    lookup=(const char*)lookups+i*stride;
+    index->stash[i]=lookup_word(lookup, lookup64, LBUSER4);
+    index->level[i]=lookup_word(lookup, lookup64, LBLEV);
+    index->lbproc[i]=lookup_word(lookup, lookup64, LBPROC);
+    index->validity[i]=read_lookup_time(lookup, lookup64, LBYR);
+    index->data_time[i]=read_lookup_time(lookup, lookup64, LBYRD);
+    keys[i].stash=index->stash[i];
+    keys[i].level=index->level[i];
+    keys[i].validity=index->validity[i];
+    keys[i].field=i;
+  }
+
+  qsort(keys, nlookups, sizeof(index_key), compare_stash_key);
+  for (i=0; i<nlookups; i++) {
+    index->by_stash[i]=keys[i].field;
+    index->stash_key[i]=keys[i].stash;
+    index->level_key[i]=keys[i].level;
+    index->validity_key[i]=keys[i].validity;
+  }
+  qsort(keys, nlookups, sizeof(index_key), compare_time_key);
+  for (i=0; i<nlookups; i++) {
+    index->by_time[i]=keys[i].field;
+    index->time_key[i]=keys[i].validity;
+  }
+  free(keys);
+  return 0;
+}
+
+void lookup_index_free(lookup_index* index) {
+  free(index->stash);
+  free(index->level);
+  free(index->lbproc);
+  free(index->validity);
+  free(index->data_time);
+  free(index->by_stash);
+  free(index->stash_key);
+  free(index->level_key);
+  free(index->validity_key);
+  free(index->by_time);
+  free(index->time_key);
+  memset(index, 0, sizeof(*index));
+}
+
+/* A query matching every field */
+void lookup_query_init(lookup_query* query) {
+  query->stash=LOOKUP_ANY;
+  query->level=LOOKUP_ANY;
+  query->lbproc=LOOKUP_ANY;
+  query->validity_from=LOOKUP_ANY_TIME_FROM;
+  query->validity_to=LOOKUP_ANY_TIME_TO;
+  query->data_time_from=LOOKUP_ANY_TIME_FROM;
+  query->data_time_to=LOOKUP_ANY_TIME_TO;
+}
+
+/* First place in the STASH order not before (stash, level, validity), or
+   not after it if upper is set */
+static int stash_bound(const lookup_index* index, int stash, int level, int64_t validity, int upper) {
+  int lo=0;
+  int hi=index->n;
+  int mid, c;
+  while (lo<hi) {
+    mid=lo+(hi-lo)/2;
+    c=compare_key(index->stash_key[mid], index->level_key[mid], index->validity_key[mid],
+                  stash, level, validity);
+    if (c<0 || (upper && c==0)) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+static int time_bound(const lookup_index* index, int64_t validity, int upper) {
+  int lo=0;
+  int hi=index->n;
+  int mid;
+  while (lo<hi) {
+    mid=lo+(hi-lo)/2;
+    if (index->time_key[mid]<validity || (upper && index->time_key[mid]==validity)) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+/* Put the numbers of the fields matching the query into found, which must
+   have room for index->n, in field order. Returns how many there are */
+int lookup_index_query(const lookup_index* index, const lookup_query* query, int* found) {
+  const int* order=NULL;
+  int       first=0;
+  int       last=index->n;
+  int       nfound=0;
+  int       i, field;
+
+  if (query->stash!=LOOKUP_ANY) {
+    order=index->by_stash;
+    if (query->level!=LOOKUP_ANY) {
+      first=stash_bound(index, query->stash, query->level, query->validity_from, FALSE);
+      last=stash_bound(index, query->stash, query->level, query->validity_to, TRUE);
+    } else {
+      first=stash_bound(index, query->stash, LOOKUP_ANY, LOOKUP_ANY_TIME_FROM, FALSE);
+      last=stash_bound(index, query->stash, INT32_MAX, LOOKUP_ANY_TIME_TO, TRUE);
+    }
+  } else if (query->validity_from!=LOOKUP_ANY_TIME_FROM || query->validity_to!=LOOKUP_ANY_TIME_TO) {
+    order=index->by_time;
+    first=time_bound(index, query->validity_from, FALSE);
+    last=time_bound(index, query->validity_to, TRUE);
+  }
+
+  for (i=first; i<last; i++) {
+    field=(order ? order[i] : i);
+    if ((query->stash==LOOKUP_ANY || index->stash[field]==query->stash) &&
+        (query->level==LOOKUP_ANY || index->level[field]==query->level) &&
+        (query->lbproc==LOOKUP_ANY || index->lbproc[field]==query->lbproc) &&
+        index->validity[field]>=query->validity_from && index->validity[field]<=query->validity_to &&
+        index->data_time[field]>=query->data_time_from && index->data_time[field]<=query->data_time_to) {
+      found[nfound++]=field;
+    }
+  }
+  if (order) {
+    qsort(found, nfound, sizeof(int), compare_int);
+  }
+  return nfound;
+}
@@ -0,0 +1,168 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* network_order_words.c
+ *
+ * Description:
+ *   Swap arrays of 32 or 64 bit words between host and network (big endian) byte order
+ *
+ * Information:
+ *   One routine for all the whole-field byte order loops, swapping either in place or
+ *   while copying to another array, so that a copy and a swap are a single pass over the
+ *   data. Uses AVX2 or SSSE3 byte shuffles where the processor supports them. On a big
+ *   endian host there is nothing to swap, so only the copy (if any) is done.
+ */
+
+/* Standard header files used */
+#include <stdint.h>
+#include <string.h>
+#ifdef _AIX
+  #include <sys/machine.h>
+#elif _DARWIN_SOURCE
+  #include <architecture/byte_order.h>
+#else
+  #include <endian.h>
+#endif
+/* Package header files used */
+#include "wgdosstuff.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define BSWAP_X86_KERNELS 1
+  #include <immintrin.h>
+#endif
+
+/* End of header */
+
+#ifdef __GNUC__
+  #define BSWAP32(x) __builtin_bswap32(x)
+  #define BSWAP64(x) __builtin_bswap64(x)
+#else
+  #define BSWAP32(x) ((((x) & 0xff) << 24) | (((x) & 0xff00) << 8) | (((x) >> 8) & 0xff00) | ((x) >> 24))
+  #define BSWAP64(x) (((uint64_t)BSWAP32((uint32_t)(x)) << 32) | BSWAP32((uint32_t)((x) >> 32)))
+#endif
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+
+/* Byte shuffles reversing each 4 or 8 byte word of a 16 byte vector */
+static const unsigned char reverse32[16]={3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12};
+static const unsigned char reverse64[16]={7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8};
+
+#ifdef BSWAP_X86_KERNELS
+/* Swap nbytes (a multiple of 32) of in to out, a vector at a time. in and out may be the
+   same array, since each vector is loaded before it is stored */
+__attribute__((target("avx2")))
+static void swap_bytes_avx2(const unsigned char* in, unsigned char* out, size_t nbytes,
+                            const unsigned char* reverse) {
+  __m256i shuffle=_mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)reverse));
+  size_t i;
+  for (i=0; i<nbytes; i+=32) {
+    _mm256_storeu_si256((__m256i*)(out+i),
+      _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i*)(in+i)), shuffle));
+  }
+}
+
+/* As swap_bytes_avx2, for a multiple of 16 bytes */
+__attribute__((target("ssse3")))
+static void swap_bytes_ssse3(const unsigned char* in, unsigned char* out, size_t nbytes,
+                             const unsigned char* reverse) {
+  __m128i shuffle=_mm_loadu_si128((__m128i*)reverse);
+  size_t i;
+  for (i=0; i<nbytes; i+=16) {
+    _mm_storeu_si128((__m128i*)(out+i),
+      _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(in+i)), shuffle));
+  }
+}
+#endif
+
+/* Swap as much of the start of the nbytes from in to out as the vector kernels can,
+   returning the number of bytes done */
+static size_t swap_bytes_vector(const void* in, void* out, size_t nbytes, const unsigned char* reverse) {
+  size_t done=0;
+#ifdef BSWAP_X86_KERNELS
+  if (__builtin_cpu_supports("avx2")) {
+    done=nbytes & ~(size_t)31;
+    swap_bytes_avx2(in, out, done, reverse);
+  } else if (__builtin_cpu_supports("ssse3")) {
+    done=nbytes & ~(size_t)15;
+    swap_bytes_ssse3(in, out, done, reverse);
+  }
+#endif
+  return done;
+}
+
+#endif
+
+/* Put nwords 32-bit words into network byte order, or back into host order, copying them
+   from in to out. in and out may be the same array, but must not otherwise overlap */
+void network_order_words32(const void* in, void* out, int nwords) {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+  const uint32_t* ip_in=(const uint32_t*)in;
+  uint32_t* ip_out=(uint32_t*)out;
+  uint32_t word;
+  size_t count;
+
+  if (nwords<=0) {
+    return;
+  }
+  count=swap_bytes_vector(in, out, (size_t)nwords*sizeof(uint32_t), reverse32)/sizeof(uint32_t);
+  for (; count<(size_t)nwords; count++) {
+    memcpy(&word, ip_in+count, sizeof(word));
+    word=BSWAP32(word);
+    memcpy(ip_out+count, &word, sizeof(word));
+  }
+#else
+  if (nwords>0 && in!=out) {
+    memcpy(out, in, (size_t)nwords*sizeof(uint32_t));
+  }
+#endif
+}
+
+/* As network_order_words32, for 64-bit words */
+void network_order_words64(const void* in, void* out, int nwords) {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+  const uint64_t* ip_in=(const uint64_t*)in;
+  uint64_t* ip_out=(uint64_t*)out;
+  uint64_t word;
+  size_t count;
+
+  if (nwords<=0) {
+    return;
+  }
+  count=swap_bytes_vector(in, out, (size_t)nwords*sizeof(uint64_t), reverse64)/sizeof(uint64_t);
+  for (; count<(size_t)nwords; count++) {
+    memcpy(&word, ip_in+count, sizeof(word));
+    word=BSWAP64(word);
+    memcpy(ip_out+count, &word, sizeof(word));
+  }
+#else
+  if (nwords>0 && in!=out) {
+    memcpy(out, in, (size_t)nwords*sizeof(uint64_t));
+  }
+#endif
+}
@@ -43,11 +43,12 @@
   #include <endian.h>
 #endif
 #include "wgdosstuff.h"
+#include "wgdosrow.h"
 #include "logerrors.h"
 #include "rlencode.h"
 
 // Message buffer for the syslog interface
-static char message[MAX_MESSAGE_SIZE];
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
 
 // DATA field structure interface
 // pack the data, calling the correct method based on the lookup associated with it
@@ -56,35 +57,42 @@ static char message[MAX_MESSAGE_SIZE];
    return nonzero and the original packed field but in Big Endian form (MSB first) so that the post-call process is identical on success
    or failure */
 int pack_ppfield(float mdi, int ncols, int nrows, float* data, int pack, int bpacc, int nbits, int* packed_size, char* to, function* parent) {
+  wgdos_context context;
+  int retcode;
+  wgdos_context_init(&context);
+  retcode=pack_ppfield_ctx(&context, mdi, ncols, nrows, data, pack, bpacc, nbits, packed_size, to, parent);
+  wgdos_context_free(&context);
+  return retcode;
+}
+
+/* As pack_ppfield, taking the work areas from the context so that they can be kept from one field to the next */
+int pack_ppfield_ctx(wgdos_context* context, float mdi, int ncols, int nrows, float* data, int pack, int bpacc, int nbits, int* packed_size, char* to, function* parent) {
   char* packed;
-  int* ip_in;
-  int* ip_out;
-  int count;
   int retcode=0;
   int unpacked_size=nrows*ncols;
   int pack_rcode=0; /* return code from the wgdos_pack function */
   function subroutine;
   set_function_name(__func__, &subroutine, parent);
 
-  packed=malloc(unpacked_size*sizeof(int));
+  packed=wgdos_context_scratch(context, WGDOS_SCRATCH_FIELD, unpacked_size*sizeof(int));
+  if (packed==NULL) {
+    MO_syslog(VERBOSITY_ERROR, "Out of memory for the packed field", &subroutine);
+    return 1;
+  }
   snprintf(message, MAX_MESSAGE_SIZE, "MDI %f, packing code %d", mdi, pack);
   MO_syslog(VERBOSITY_INFO, message, &subroutine);
   switch(pack) {
   case UNPACKED:
     /* No packing? Just make the numbers big endian then */
     MO_syslog(VERBOSITY_INFO, "Not packing data", &subroutine);
-    ip_in=(int*)data;
-    ip_out=(int*)packed;
-    for (count=0; count<unpacked_size; count++) {
-      ip_out[count]=htonl(ip_in[count]);
-    }
+    network_order_words32(data, packed, unpacked_size);
     *packed_size=unpacked_size;
     /* There's no way to fail packing unless you've given it extreme rubbish */
     break;
   case WGDOS_PACKED:
     /* WGDOS packing packs as a bytestream, MSB first */
     MO_syslog(VERBOSITY_INFO, "WGDOS packing data", &subroutine);
-    pack_rcode = wgdos_pack(ncols, nrows, data, mdi, bpacc, packed, packed_size, parent);
+    pack_rcode = wgdos_pack_ctx(context, ncols, nrows, data, mdi, bpacc, (unsigned char*)packed, packed_size, parent);
     if (pack_rcode != 0) {
       /* Couldn't pack, so remember this when exiting */
       MO_syslog(VERBOSITY_INFO, "wgdos_pack Failed", &subroutine);
@@ -103,11 +111,7 @@ int pack_ppfield(float mdi, int ncols, int nrows, float* data, int pack, int bpa
       MO_syslog(VERBOSITY_INFO, "runlen_encode Failed", &subroutine);
       retcode=1;
     } else {
-      ip_in=(int*)data;
-      ip_out=(int*)packed;
-      for (count=0; count<unpacked_size; count++) {
-        ip_out[count]=htonl(ip_in[count]);
-      }
+      network_order_words32(packed, packed, *packed_size);
     }
     break;
   default:
@@ -121,17 +125,12 @@ int pack_ppfield(float mdi, int ncols, int nrows, float* data, int pack, int bpa
 
     if (retcode!=0) {
       /* And packing didn't work, copy the unpacked data in and make it Big Endian (MSB first) */
-      ip_in=(int*)data;
-      ip_out=(int*)to;
-      for (count=0; count<unpacked_size; count++) {
-        ip_out[count]=htonl(ip_in[count]);
-      }
+      network_order_words32(data, to, unpacked_size);
       *packed_size=unpacked_size;
     } else {
       /* Else, copy the correctly packed data array */
       memcpy(to, packed, (*packed_size)*sizeof(int));
     }
   }
-  free(packed);
   return retcode;
 }
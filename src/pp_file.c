@@ -0,0 +1,240 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* pp_file.c
+ *
+ * Description:
+ *   Read fields from a PP file, unpacking each only when asked for
+ *
+ * Information:
+ *   The file is memory mapped and read once from start to end, noting
+ *   where the header and data records of each field are by their Fortran
+ *   record markers. Only the header pages are touched by this. A field's
+ *   data is unpacked straight from the mapped pages when it is asked for,
+ *   so only the fields wanted are read from disk. PP files are big endian;
+ *   the headers are kept in native order. The mapping is only ever read,
+ *   so a number of threads may unpack fields from the same file at once.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "ppfield_lookup.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+
+#define PP_HEADER_BYTES (PP_LOOKUP_WORDS*4)
+/* End of header */
+
+/* The length in a Fortran record marker at offset, or -1 if there is no room for one */
+static long record_marker(const pp_file* file, size_t offset) {
+  uint32_t marker;
+  if (offset+4>file->length) {
+    return -1;
+  }
+  memcpy(&marker, file->map+offset, 4);
+  return ntohl(marker);
+}
+
+/* Check a record of length bytes starting at offset, and give where the next one starts */
+static int read_record(const pp_file* file, size_t offset, long length, size_t* next) {
+  if (length<0 || offset+4+(size_t)length+4>file->length ||
+      record_marker(file, offset+4+length)!=length) {
+    return -1;
+  }
+  *next=offset+4+length+4;
+  return 0;
+}
+
+/* Open and index a PP file. Returns 0 if it worked, nonzero if not, with no file open */
+int pp_file_open(const char* path, pp_file* file, function* parent) {
+  struct stat st;
+  pp_file_field* grown;
+  size_t    offset=0;
+  size_t    next;
+  long      length;
+  int       capacity=0;
+  int       fd;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  memset(file, 0, sizeof(*file));
+  fd=open(path, O_RDONLY);
+  if (fd<0 || fstat(fd, &st)) {
+    snprintf(message, MAX_MESSAGE_SIZE, "Cannot open %s: %s", path, strerror(errno));
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    set_logerrno(LOGERRNO_IO_EXCEPTION);
+    if (fd>=0) {
+      close(fd);
+    }
+    return 1;
+  }
+  file->length=st.st_size;
+  if (file->length>0) {
+    file->map=mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (file->map==MAP_FAILED) {
+    snprintf(message, MAX_MESSAGE_SIZE, "Cannot map %s: %s", path, strerror(errno));
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    set_logerrno(LOGERRNO_IO_EXCEPTION);
+    file->map=NULL;
+    return 1;
+  }
+
+  /* Each field is a header record then a data record */
+  while (offset<file->length) {
+    if (file->nfields==capacity) {
+      capacity=(capacity>0 ? 2*capacity : 64);
+      grown = (pp_file_field *) realloc(file->fields, sizeof(pp_file_field) * capacity);
+      if (!grown) {
+        MO_syslog(VERBOSITY_ERROR, "Out of memory for the field index", &subroutine);
+        pp_file_close(file);
+        return 1;
+      }
+      file->fields=grown;
+    }
+    length=record_marker(file, offset);
+    if (length!=PP_HEADER_BYTES || read_record(file, offset, length, &next)) {
+      snprintf(message, MAX_MESSAGE_SIZE, "%s: no PP header record at byte %lu (field %d)",
+               path, (unsigned long)offset, file->nfields+1);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      pp_file_close(file);
+      return 1;
+    }
+    network_order_words32(file->map+offset+4, file->fields[file->nfields].lookup, PP_LOOKUP_WORDS);
+    offset=next;
+
+    length=record_marker(file, offset);
+    if (read_record(file, offset, length, &next)) {
+      snprintf(message, MAX_MESSAGE_SIZE, "%s: no PP data record at byte %lu (field %d)",
+               path, (unsigned long)offset, file->nfields+1);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      pp_file_close(file);
+      return 1;
+    }
+    file->fields[file->nfields].data_offset=offset+4;
+    file->fields[file->nfields].data_length=length;
+    file->nfields++;
+    offset=next;
+  }
+
+  snprintf(message, MAX_MESSAGE_SIZE, "%s: %d fields", path, file->nfields);
+  MO_syslog(VERBOSITY_INFO, message, &subroutine);
+  return 0;
+}
+
+/* Unmap the file and free the index */
+void pp_file_close(pp_file* file) {
+  if (file->map) {
+    munmap(file->map, file->length);
+  }
+  free(file->fields);
+  memset(file, 0, sizeof(*file));
+}
+
+/* Unpack field number n (from 0) of the file into to, which must hold
+   LBROW*LBNPT values. NULL to test unpack. Returns 0 if it worked */
+int pp_file_unpack(const pp_file* file, int n, float* to, function* parent) {
+  wgdos_context context;
+  int retval;
+  wgdos_context_init(&context);
+  retval=pp_file_unpack_ctx(&context, file, n, to, parent);
+  wgdos_context_free(&context);
+  return retval;
+}
+
+/* As pp_file_unpack, taking the work areas from the context */
+int pp_file_unpack_ctx(wgdos_context* context, const pp_file* file, int n, float* to, function* parent) {
+  const pp_file_field* field;
+  char*     data;
+  char*     copy;
+  uint32_t  lookup[PP_LOOKUP_WORDS];
+  float     mdi;
+  int       data_size;
+  int       pack;
+  int       unpacked_size;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  if (n<0 || n>=file->nfields) {
+    snprintf(message, MAX_MESSAGE_SIZE, "No field %d, the file has %d", n, file->nfields);
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    return 1;
+  }
+  field=&file->fields[n];
+  data=file->map+field->data_offset;
+  memcpy(lookup, field->lookup, sizeof(lookup));
+  read_ppfield_lookup(lookup, FALSE, &mdi, &data_size, &pack, &unpacked_size);
+  if (data_size<0 || data_size>field->data_length/4) {
+    data_size=field->data_length/4;
+  }
+  if (pack==UNPACKED && data_size>unpacked_size) {
+    data_size=unpacked_size;
+  }
+
+  /* Make sure a damaged field can't be read beyond its record: the field length must fit
+     in the record, wgdos_unpack_ctx checks each row header and row length against the
+     field length, and the row's bitmaps and packed values against the row length,
+     before reading them */
+  if (pack==WGDOS_PACKED &&
+      (field->data_length<12 || 4*(long)ntohl(*(uint32_t*)data)>field->data_length)) {
+    snprintf(message, MAX_MESSAGE_SIZE, "WGDOS field %d is longer than its record", n);
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+    return 1;
+  }
+
+  /* Run length decoding changes its input, so give it a copy of the mapped data */
+  if (pack==RLE_PACKED) {
+    copy=wgdos_context_scratch(context, WGDOS_SCRATCH_PACKED_FIELD, 4*(size_t)data_size);
+    if (!copy) {
+      MO_syslog(VERBOSITY_ERROR, "Out of memory for the packed field", &subroutine);
+      return 1;
+    }
+    memcpy(copy, data, 4*(size_t)data_size);
+    data=copy;
+  }
+
+  return unpack_ppfield_ctx(context, mdi, data_size, data, pack, unpacked_size, to, &subroutine);
+}
@@ -74,6 +74,8 @@
 /* Package header files used */
 
 #include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "wgdosbits.h"
 
 /* End of header */
 
@@ -151,7 +153,59 @@ int read_wgdos_bitmaps(
   return 0;
 }
 
+/* As read_wgdos_bitmaps, but keep the bitmaps packed, 64 columns to a word. Column c is
+   bit 63-c%64 of word c/64 (MSB first, as in the packed field), set when the column is
+   missing data or zero respectively, so the zeros bitmap is inverted from its packed form.
+   Bits after the last column are clear. Counts with popcount rather than column by column */
+int read_wgdos_bitmap_words(
+  /* IN */
+  char** data,                     /* PP field to read from */
+  int ncols,                 /* Number of elements in row, >=0 */
+  Boolean missing_data_present,  /* Is missing data bitmap present? */
+  Boolean zeros_bitmap_present,  /* Is zeros bitmap present? */
+  /* OUT */
+  uint64_t *missing_data,         /* (ncols+63)/64 words of missing data bitmap */
+  uint64_t *zero,                 /* (ncols+63)/64 words of zeros bitmap */
+  int *missing_data_count,    /* Num set bits in missing_data,>=0 */
+  int *zeros_count           /* Num set bits in zero, >=0 */
+)
+{
+  int nsus_to_read;      /* Number of numeric storage units occupied */
+                          /* by bitmaps */
+  int zeros_start_bit;   /* Bit number in the bitmaps where zeros bitmap starts */
+  int nwords=(ncols+63)/64;
+  int nbits;
+  int word;
+  unsigned char* bitmaps=(unsigned char*)*data;
 
+  /* Determine length of bitmaps in numeric storage units */
+  nsus_to_read = (ncols*(missing_data_present + zeros_bitmap_present)+ PP_BITS_PER_NUMERIC - 1) / PP_BITS_PER_NUMERIC;
+  *data = *data + sizeof(int)*nsus_to_read;
+
+  *missing_data_count = 0;
+  *zeros_count = 0;
+
+  /* Missing data bitmap */
+  for (word=0; word<nwords; word++) {
+    if ( missing_data_present ) {
+      nbits=(ncols-64*word<64 ? ncols-64*word : 64);
+      missing_data[word]=bitstream_word64(bitmaps, 64*word, nbits);
+      *missing_data_count+=POPCOUNT64(missing_data[word]);
+    } else {
+      missing_data[word]=0;
+    }
+  }
 
-
-
+  /* Zeros bitmap, 0 meaning zero in the packed form */
+  zeros_start_bit = (missing_data_present ? ncols : 0);
+  for (word=0; word<nwords; word++) {
+    if ( zeros_bitmap_present ) {
+      nbits=(ncols-64*word<64 ? ncols-64*word : 64);
+      zero[word]=~bitstream_word64(bitmaps, zeros_start_bit+64*word, nbits) & TOP_BITS64(nbits);
+      *zeros_count+=POPCOUNT64(zero[word]);
+    } else {
+      zero[word]=0;
+    }
+  }
+  return 0;
+}
@@ -28,11 +28,12 @@
 */
 
 #include <stdio.h>
+#include <string.h>
 #include "rlencode.h"
 #include "wgdosstuff.h"
 #include "logerrors.h"
 
-static char message[MAX_MESSAGE_SIZE];
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
 #define debug 0
 /*
  * runlenEncode returns RL_OK if success, RL_ERR if input the number of
@@ -99,68 +100,272 @@ int runlen_encode (float *fatvec, int fatlen, float *thinvec, int *thinlen, floa
 }
 
 /*
- * runlenDecode returns RL_OK if success, RL_ERR if the number of expanded
- * points is more than the input length "fatlen" => possible corrupt input
- * data. fatlen contains the size of expanded field on return. Missing data
- * values represented by "bmdi"  are followed by a value indicating the
- * length of the run of missing data values are expanded out. fatvec and
- * thinvec are the full (output) and compressed (input) fields respectively.
+ * runlen_decoder_init starts the run length decode of a field expanding to
+ * fatlen values, with missing data values represented by "bmdi". The packed
+ * field may then be given to runlen_decoder_feed in as many pieces as it
+ * comes in, and runlen_decoder_finish checks that it was all there.
  */
-int runlen_decode(float *fatvec, int fatlen, float *thinvec, int thinlen, float bmdi, function* parent)
+void runlen_decoder_init(runlen_decoder* decoder, int fatlen, float bmdi)
+{
+  decoder->fatlen = fatlen;
+  decoder->fatpos = 0;
+  decoder->bmdi = bmdi;
+  decoder->run_pending = FALSE;
+}
+
+/*
+ * runlen_decoder_feed decodes the next thinlen words of the packed field,
+ * giving each stretch of values that are not missing data to sink->values
+ * and each run of missing data values to sink->run, with where in the
+ * expanded field they start. A run length may be in the piece after its
+ * missing data value. Returns RL_OK if success, RL_ERR if a run length is
+ * not a whole number of values that fit in the field, the values would
+ * expand to more than fatlen or the sink fails.
+ */
+int runlen_decoder_feed(runlen_decoder* decoder, const float* thinvec, int thinlen,
+                        const runlen_sink* sink, function* parent)
 {
   int i = 0;        /* loop over encoded field */
-  int j = 0;        /* loop over current run of mdi */
-  int nmdi = 0;        /* length of current run of mdi */
-  int checklen = fatlen;   /* Field size which expanded data must not exceed */ 
-  float *vp = fatvec;   /* pointer used to set expanded field */
+  int start;        /* first of a stretch of values that are not mdi */
+  int nmdi;         /* length of current run of mdi */
+  double run;       /* run length as packed, compared before it is an int */
   int log_messages=(get_verbosity()>=VERBOSITY_MESSAGE);
   function subroutine;
   set_function_name(__func__, &subroutine, parent);
-  snprintf(message, MAX_MESSAGE_SIZE, "Started a with input data %d long, expect to get %d (when the mdi=%f)", thinlen, checklen, bmdi);
-  MO_syslog(VERBOSITY_MESSAGE, message, &subroutine);
-  fatlen=0; /* start output size from 0 */
 
   while (i<thinlen) {
-    if (*thinvec == bmdi) {
-      thinvec++;
-      nmdi = *thinvec;
-      thinvec++;
+    if (decoder->run_pending) {
+      run = thinvec[i++];
+      /* Check the run looks sensible i.e. a positive integer that fits */
+      if (!(run >= 1 && run <= decoder->fatlen-decoder->fatpos && run == (int)run)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "RLE error: run of %g mdi values at %d of %d",
+                 run, decoder->fatpos, decoder->fatlen);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return RL_ERR;
+      }
+      nmdi = run;
       if (log_messages) {
         snprintf(message, MAX_MESSAGE_SIZE, "adding %d mdi values", nmdi);
         MO_syslog(VERBOSITY_MESSAGE, message, &subroutine);
       }
-      /* Check nmdi looks sensible i.e positive integer */
-      if (!(nmdi >= 1 && nmdi < checklen)) {
+      if (sink->run(sink->state, decoder->fatpos, nmdi, &subroutine)) {
         return RL_ERR;
       }
-      i+=2;
-      for (j=0; j<nmdi; j++) {
-        if (++fatlen > checklen) {
-          snprintf(message, MAX_MESSAGE_SIZE, "Too many values out (%d>=%d) at byte %d of packed field", fatlen, checklen, i);
-          MO_syslog(VERBOSITY_ERROR, message, &subroutine);
-          set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
-          return RL_ERR;
-        }
-        *vp++ = bmdi;
-      }
+      decoder->fatpos += nmdi;
+      decoder->run_pending = FALSE;
+    } else if (thinvec[i] == decoder->bmdi) {
+      decoder->run_pending = TRUE;
+      i++;
     } else {
-      if (++fatlen > checklen) {
-        snprintf(message, MAX_MESSAGE_SIZE, "Too a many bytes %d>=%d at %d/%d", fatlen, checklen, i, thinlen);
+      for (start=i; i<thinlen && thinvec[i] != decoder->bmdi; i++);
+      if (i-start > decoder->fatlen-decoder->fatpos) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Too many values out (%d>%d) at %d/%d",
+                 decoder->fatpos+(i-start), decoder->fatlen, i, thinlen);
         MO_syslog(VERBOSITY_ERROR, message, &subroutine);
         set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
         return RL_ERR;
       }
-      *vp++ = *thinvec++;
-      i++;
+      if (sink->values(sink->state, decoder->fatpos, thinvec+start, i-start, &subroutine)) {
+        return RL_ERR;
+      }
+      decoder->fatpos += i-start;
     }
   }
-  snprintf(message, MAX_MESSAGE_SIZE, "Finished with output data %d long", fatlen);
+  return RL_OK;
+}
+
+/*
+ * runlen_decoder_finish returns RL_OK if the packed field fed to the decoder
+ * expanded to exactly fatlen values, RL_ERR if not or it ended on a missing
+ * data value with no run length after it.
+ */
+int runlen_decoder_finish(const runlen_decoder* decoder, function* parent)
+{
+  if (decoder->run_pending) {
+    MO_syslog(VERBOSITY_ERROR, "RLE error: run of mdi with no length", parent);
+    set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+    return RL_ERR;
+  }
+  if (decoder->fatpos!=decoder->fatlen) {
+    snprintf(message, MAX_MESSAGE_SIZE, "RLE error: unpacked %d numbers, expected %d.",
+             decoder->fatpos, decoder->fatlen);
+    MO_syslog(VERBOSITY_ERROR, message, parent);
+    set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+    return RL_ERR;
+  }
+  return RL_OK;
+}
+
+static int expand_values(void* state, int fatpos, const float* values, int nvalues, function* parent)
+{
+  (void)parent;
+  memcpy(((runlen_expansion*)state)->fatvec+fatpos, values, nvalues*sizeof(float));
+  return RL_OK;
+}
+
+static int expand_run(void* state, int fatpos, int nmdi, function* parent)
+{
+  runlen_expansion* expansion = (runlen_expansion*)state;
+  float* vp = expansion->fatvec+fatpos;
+  (void)parent;
+  while (nmdi-- > 0) {
+    *vp++ = expansion->mdi;
+  }
+  return RL_OK;
+}
+
+/*
+ * runlen_expansion_sink sets sink up to write the decoded field to fatvec,
+ * with each run of missing data values expanded out to mdi values.
+ */
+void runlen_expansion_sink(runlen_sink* sink, runlen_expansion* expansion, float* fatvec, float mdi)
+{
+  expansion->fatvec = fatvec;
+  expansion->mdi = mdi;
+  sink->values = expand_values;
+  sink->run = expand_run;
+  sink->state = expansion;
+}
+
+/*
+ * runlenDecode returns RL_OK if success, RL_ERR if the number of expanded
+ * points is other than the input length "fatlen" => possible corrupt input
+ * data. Missing data values represented by "bmdi" are followed by a value
+ * indicating the length of the run of missing data values are expanded out.
+ * fatvec and thinvec are the full (output) and compressed (input) fields
+ * respectively.
+ */
+int runlen_decode(float *fatvec, int fatlen, float *thinvec, int thinlen, float bmdi, function* parent)
+{
+  runlen_decoder decoder;
+  runlen_expansion expansion;
+  runlen_sink sink;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+  snprintf(message, MAX_MESSAGE_SIZE, "Started a with input data %d long, expect to get %d (when the mdi=%f)", thinlen, fatlen, bmdi);
   MO_syslog(VERBOSITY_MESSAGE, message, &subroutine);
-  if (fatlen!=checklen) {
-    snprintf(message, MAX_MESSAGE_SIZE, "RLE error: unpacked %d numbers, expected %d.", fatlen, checklen);
-    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+
+  runlen_decoder_init(&decoder, fatlen, bmdi);
+  runlen_expansion_sink(&sink, &expansion, fatvec, bmdi);
+  if (runlen_decoder_feed(&decoder, thinvec, thinlen, &sink, &subroutine)) {
+    return RL_ERR;
+  }
+  snprintf(message, MAX_MESSAGE_SIZE, "Finished with output data %d long", decoder.fatpos);
+  MO_syslog(VERBOSITY_MESSAGE, message, &subroutine);
+  return runlen_decoder_finish(&decoder, &subroutine);
+}
+
+/* Where runlen_decode_sparse puts the values that are not missing */
+typedef struct sparse_points {
+  int*   indices;
+  float* values;
+  int    max_points;
+  int*   npoints;
+} sparse_points;
+
+static int sparse_values(void* state, int fatpos, const float* values, int nvalues, function* parent)
+{
+  sparse_points* points = (sparse_points*)state;
+  int j;
+
+  if (nvalues > points->max_points-*points->npoints) {
+    snprintf(message, MAX_MESSAGE_SIZE, "RLE error: too many values out (%d>%d)",
+             *points->npoints+nvalues, points->max_points);
+    MO_syslog(VERBOSITY_ERROR, message, parent);
     set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
     return RL_ERR;
   }
+  for (j=0; j<nvalues; j++) {
+    points->indices[*points->npoints] = fatpos+j;
+    points->values[(*points->npoints)++] = values[j];
+  }
+  return RL_OK;
+}
+
+static int sparse_run(void* state, int fatpos, int nmdi, function* parent)
+{
+  (void)state;
+  (void)fatpos;
+  (void)nmdi;
+  (void)parent;
+  return RL_OK;
+}
+
+/*
+ * runlen_decode_sparse decodes as runlen_decode does, but instead of expanding
+ * the field it gives only the values that are not missing, as their flat index
+ * in the expanded field (indices) and value (values). A run of missing data
+ * values just moves the index on. npoints is set to the number of values given,
+ * which must not be more than max_points. Returns RL_OK if success, RL_ERR if
+ * the data would expand to other than fatlen values or there is no room.
+ */
+int runlen_decode_sparse(int* indices, float* values, int max_points, int* npoints, int fatlen,
+                         float* thinvec, int thinlen, float bmdi, function* parent)
+{
+  runlen_decoder decoder;
+  sparse_points points = {indices, values, max_points, npoints};
+  runlen_sink sink = {sparse_values, sparse_run, &points};
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  *npoints = 0;
+  runlen_decoder_init(&decoder, fatlen, bmdi);
+  if (runlen_decoder_feed(&decoder, thinvec, thinlen, &sink, &subroutine)) {
+    return RL_ERR;
+  }
+  return runlen_decoder_finish(&decoder, &subroutine);
+}
+
+/* How runlen_decode_affine changes the values as it expands them */
+typedef struct affine_expansion {
+  float* fatvec;
+  double scale;
+  double offset;
+  float  mdi_out;
+} affine_expansion;
+
+static int affine_values(void* state, int fatpos, const float* values, int nvalues, function* parent)
+{
+  affine_expansion* expansion = (affine_expansion*)state;
+  float* vp = expansion->fatvec+fatpos;
+  int j;
+  (void)parent;
+
+  for (j=0; j<nvalues; j++) {
+    vp[j] = values[j]*expansion->scale+expansion->offset;
+  }
   return RL_OK;
 }
+
+static int affine_run(void* state, int fatpos, int nmdi, function* parent)
+{
+  affine_expansion* expansion = (affine_expansion*)state;
+  float* vp = expansion->fatvec+fatpos;
+  (void)parent;
+  while (nmdi-- > 0) {
+    *vp++ = expansion->mdi_out;
+  }
+  return RL_OK;
+}
+
+/*
+ * runlen_decode_affine decodes as runlen_decode does, giving value*scale+offset
+ * for each value that is not missing data and mdi_out for each missing one, as
+ * the field is expanded. Returns RL_OK if success, RL_ERR as runlen_decode.
+ */
+int runlen_decode_affine(float *fatvec, int fatlen, float *thinvec, int thinlen, float bmdi,
+                         double scale, double offset, float mdi_out, function* parent)
+{
+  runlen_decoder decoder;
+  affine_expansion expansion = {fatvec, scale, offset, mdi_out};
+  runlen_sink sink = {affine_values, affine_run, &expansion};
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  runlen_decoder_init(&decoder, fatlen, bmdi);
+  if (runlen_decoder_feed(&decoder, thinvec, thinlen, &sink, &subroutine)) {
+    return RL_ERR;
+  }
+  return runlen_decoder_finish(&decoder, &subroutine);
+}
@@ -46,4 +46,43 @@
    * indicating the length of the run of missing data values.
    */
   int runlen_decode(float* unpacked, int size, float* data, int data_size, float mdi, function* parent);
+  /*
+   * A run length decode that may be given the packed field in pieces. Each
+   * stretch of values that are not missing data and each run of missing
+   * data values is given to a sink, with its place in the expanded field,
+   * so every decoder checks the runs the same way.
+   */
+  typedef struct runlen_decoder {
+    int   fatlen;        /* Size of the expanded field */
+    int   fatpos;        /* Values expanded so far */
+    float bmdi;
+    int   run_pending;   /* The last word fed was mdi, so the next is its run length */
+  } runlen_decoder;
+  typedef struct runlen_sink {
+    int (*values)(void* state, int fatpos, const float* values, int nvalues, function* parent);
+    int (*run)(void* state, int fatpos, int nmdi, function* parent);
+    void* state;
+  } runlen_sink;
+  /* The sink runlen_decode uses, expanding the field into fatvec */
+  typedef struct runlen_expansion {
+    float* fatvec;
+    float  mdi;
+  } runlen_expansion;
+  void runlen_decoder_init(runlen_decoder* decoder, int size, float mdi);
+  int runlen_decoder_feed(runlen_decoder* decoder, const float* data, int data_size,
+                          const runlen_sink* sink, function* parent);
+  int runlen_decoder_finish(const runlen_decoder* decoder, function* parent);
+  void runlen_expansion_sink(runlen_sink* sink, runlen_expansion* expansion, float* unpacked, float mdi);
+  /*
+   * Function to run length decode the field, giving only the values that are not
+   * missing data, as their index in the expanded field and their value.
+   */
+  int runlen_decode_sparse(int* indices, float* values, int max_points, int* npoints, int size,
+                           float* data, int data_size, float mdi, function* parent);
+  /*
+   * Function to run length decode the field, changing each value to value*scale+offset
+   * and each missing data value to mdi_out as it is expanded.
+   */
+  int runlen_decode_affine(float* unpacked, int size, float* data, int data_size, float mdi,
+                           double scale, double offset, float mdi_out, function* parent);
 #endif
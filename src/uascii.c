@@ -44,7 +44,7 @@ int uascii(int nchar)
 {
     /* Initialized data */
 
-    static int ebcasc[256] = { 0,1,2,3,156,9,134,127,151,141,142,11,12,13,
+    static const int ebcasc[256] = { 0,1,2,3,156,9,134,127,151,141,142,11,12,13,
           14,15,16,17,18,19,157,133,8,135,24,25,146,143,28,29,30,31,128,129,
           130,131,132,10,23,27,136,137,138,139,140,5,6,7,144,145,22,147,148,
           149,150,4,152,153,154,155,20,21,158,26,32,160,161,162,163,164,165,
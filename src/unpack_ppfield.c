@@ -43,6 +43,8 @@
   #include <endian.h>
 #endif
 #include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "ppfield_lookup.h"
 #include "logerrors.h"
 #include "rlencode.h"
 
@@ -50,62 +52,171 @@
 
 // Message buffer for the syslog interface
 #define MAX_MESSAGE_SIZE 1024
-static char message[MAX_MESSAGE_SIZE];
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+
+// Words of an unpacked field put into native order at a time by unpack_ppfield_sparse
+#define SPARSE_BLOCK_WORDS 1024
 
 // DATA field structure interface
-// unpack the data, calling the correct method based on the lookup associated with it
+// unpack the data, calling the correct method based on the lookup associated with it.
+// The data is unpacked straight into "to". Only when there is nowhere to put it (a test
+// unpack) is a work area reserved for the unpacked field.
 
 int unpack_ppfield(float mdi, int data_size, char* data, int pack, int unpacked_size, float* to, function* parent) {
+  wgdos_context context;
+  int retval;
+  wgdos_context_init(&context);
+  retval=unpack_ppfield_ctx(&context, mdi, data_size, data, pack, unpacked_size, to, parent);
+  wgdos_context_free(&context);
+  return retval;
+}
+
+// As unpack_ppfield, taking the work areas from the context so that they can be kept
+// from one field to the next
+int unpack_ppfield_ctx(wgdos_context* context, float mdi, int data_size, char* data, int pack, int unpacked_size, float* to, function* parent) {
   float* unpacked;
-  int* ip_in;
-  int* ip_out;
-  int count;
+  int retval=0;
   function subroutine;
   set_function_name(__func__, &subroutine, parent);
-  unpacked=malloc(unpacked_size*sizeof(float));
   snprintf(message, MAX_MESSAGE_SIZE, "MDI %f", mdi);
   MO_syslog(VERBOSITY_INFO, message, &subroutine);
+  unpacked=to;
+  if (unpacked==NULL && pack!=0) {
+    unpacked=wgdos_context_scratch(context, WGDOS_SCRATCH_FIELD, unpacked_size*sizeof(float));
+    if (unpacked==NULL) {
+      MO_syslog(VERBOSITY_ERROR, "Out of memory for the unpacked field", &subroutine);
+      return 1;
+    }
+  }
   switch(pack) {
   case 0:
     MO_syslog(VERBOSITY_INFO, "Unpacked data", &subroutine);
-    ip_in=(int*)data;
-    ip_out=(int*)unpacked;
-    for (count=0; count<data_size; count++) {
-      ip_out[count]=htonl(ip_in[count]);
+    if (to!=NULL) {
+      network_order_words32(data, to, data_size);
     }
     break;
   case 1:
     MO_syslog(VERBOSITY_INFO, "WGDOS packed data", &subroutine);
-    if (wgdos_unpack(data, unpacked_size, unpacked, mdi, parent)) {
+    if (wgdos_unpack_ctx(context, data, unpacked_size, unpacked, mdi, parent)) {
       MO_syslog(VERBOSITY_INFO, "wgdos_unpack Failed", &subroutine);
-      free(unpacked);
-      return 1;
+      retval=1;
     }
     break;
   case 4:
     MO_syslog(VERBOSITY_INFO, "RLE packed data", &subroutine);
-    ip_in=(int*)data;
-    ip_out=(int*)data;
-    for (count=0; count<data_size; count++) {
-      ip_out[count]=htonl(ip_in[count]);
-    }
+    network_order_words32(data, data, data_size);
     if (runlen_decode(unpacked, unpacked_size, (float*)data, data_size, mdi, &subroutine)) {
       MO_syslog(VERBOSITY_INFO, "runlen_decode Failed", &subroutine);
-      free(unpacked);
-      return 1;
+      retval=1;
     }
     break;
   default:
     MO_syslog(VERBOSITY_ERROR, "Unrecognised packing code", &subroutine);
+    retval=1;
+  }
+  return retval;
+}
+
+// As unpack_ppfield, giving the field as 16 bit floating point (HALF_FLOAT16 or
+// HALF_BFLOAT16) with missing values given as mdi_half. WGDOS packed fields are
+// converted a row at a time as they are unpacked
+int unpack_ppfield_half(float mdi, int data_size, char* data, int pack, int unpacked_size,
+                        int format, uint16_t* to, uint16_t mdi_half, function* parent) {
+  wgdos_context context;
+  int retval;
+  wgdos_context_init(&context);
+  retval=unpack_ppfield_half_ctx(&context, mdi, data_size, data, pack, unpacked_size, format, to, mdi_half, parent);
+  wgdos_context_free(&context);
+  return retval;
+}
+
+// As unpack_ppfield_half, taking the work areas from the context
+int unpack_ppfield_half_ctx(wgdos_context* context, float mdi, int data_size, char* data, int pack,
+                            int unpacked_size, int format, uint16_t* to, uint16_t mdi_half, function* parent) {
+  float* unpacked;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  if (pack==1) {
+    return wgdos_unpack_half_ctx(context, data, unpacked_size, format, to, mdi, mdi_half, &subroutine)!=0;
+  }
+  if (format!=HALF_FLOAT16 && format!=HALF_BFLOAT16) {
+    MO_syslog(VERBOSITY_ERROR, "Unknown 16 bit format", &subroutine);
     return 1;
   }
-  if (to!=NULL) {
-    memcpy(to, unpacked, unpacked_size*sizeof(float));
+  unpacked=wgdos_context_scratch(context, WGDOS_SCRATCH_FIELD,
+                                 (data_size>unpacked_size ? data_size : unpacked_size)*sizeof(float));
+  if (unpacked==NULL) {
+    MO_syslog(VERBOSITY_ERROR, "Out of memory for the unpacked field", &subroutine);
+    return 1;
+  }
+  if (pack==0) {
+    network_order_words32(data, unpacked, data_size);
+    unpacked_size=data_size;
+  } else if (unpack_ppfield_ctx(context, mdi, data_size, data, pack, unpacked_size, unpacked, &subroutine)) {
+    return 1;
   }
-  free(unpacked);
+  convert_float_ieee32_to_half(unpacked, to, unpacked_size, format, mdi, mdi_half);
   return 0;
 }
 
+// As unpack_ppfield, giving only the points that are not missing data, as their
+// flat index in the field (indices) and value (values), npoints of them. There is
+// room for max_points. As for unpack_ppfield, RLE packed data is changed in place
+int unpack_ppfield_sparse(float mdi, int data_size, char* data, int pack, int unpacked_size,
+                          int max_points, int* indices, float* values, int* npoints, function* parent) {
+  wgdos_context context;
+  int retval;
+  wgdos_context_init(&context);
+  retval=unpack_ppfield_sparse_ctx(&context, mdi, data_size, data, pack, unpacked_size, max_points,
+                                   indices, values, npoints, parent);
+  wgdos_context_free(&context);
+  return retval;
+}
+
+// As unpack_ppfield_sparse, taking the work areas from the context
+int unpack_ppfield_sparse_ctx(wgdos_context* context, float mdi, int data_size, char* data, int pack,
+                              int unpacked_size, int max_points, int* indices, float* values,
+                              int* npoints, function* parent) {
+  float block[SPARSE_BLOCK_WORDS];
+  int start;
+  int nblock;
+  int i;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  *npoints=0;
+  switch(pack) {
+  case 0:
+    // Put a block at a time into native order, then pick its points out while it is in cache
+    for (start=0; start<data_size; start+=nblock) {
+      nblock=(data_size-start<SPARSE_BLOCK_WORDS ? data_size-start : SPARSE_BLOCK_WORDS);
+      network_order_words32(data+(size_t)start*sizeof(float), block, nblock);
+      for (i=0; i<nblock; i++) {
+        if (block[i]!=mdi) {
+          if (*npoints>=max_points) {
+            MO_syslog(VERBOSITY_ERROR, "No room for the points of the field", &subroutine);
+            return 1;
+          }
+          indices[*npoints]=start+i;
+          values[(*npoints)++]=block[i];
+        }
+      }
+    }
+    return 0;
+  case 1:
+    return wgdos_unpack_sparse_ctx(context, data, unpacked_size, max_points, indices, values,
+                                   NULL, npoints, mdi, &subroutine)!=0;
+  case 4:
+    network_order_words32(data, data, data_size);
+    return runlen_decode_sparse(indices, values, max_points, npoints, unpacked_size,
+                                (float*)data, data_size, mdi, &subroutine)!=RL_OK;
+  default:
+    MO_syslog(VERBOSITY_ERROR, "Unrecognised packing code", &subroutine);
+    return 1;
+  }
+}
+
 // Structure definitions
 /* Required for these function calls that use the PP header information, so specific to PP fields only */
 
@@ -120,28 +231,57 @@ int unpack_ppfield(float mdi, int data_size, char* data, int pack, int unpacked_
 #define PACKED_SIZE 29
 #define FC 23
 
+// Read what is needed to unpack a field from its PP header, 64 bit words if lookup64
+// is set (the UM Fieldsfile layout) or 32 bit words otherwise
+void read_ppfield_lookup(void* lookup, int lookup64, float* mdi, int* data_size, int* pack, int* unpacked_size) {
+  uint64_t* lookup_64=(uint64_t*)lookup;
+  uint32_t* lookup_32=(uint32_t*)lookup;
+  double dmdi;
+
+  if (lookup64) {
+    if (sizeof(float) != 8) {
+      dmdi=*(double*)(lookup_64+MDI);
+      *mdi=(float)dmdi;
+    } else {
+      *mdi=*(float*)(lookup_64+MDI);
+    }
+    *unpacked_size=lookup_64[NROWS]*lookup_64[NCOLS];
+    *data_size = (lookup_64[FIELD_LENGTH] - lookup_64[EXT]);
+    *pack=lookup_64[PACK] % 10;
+  } else {
+    *mdi=*(float*)(lookup_32+MDI);
+    *unpacked_size=lookup_32[NROWS]*lookup_32[NCOLS];
+    *data_size = lookup_32[FIELD_LENGTH] - lookup_32[EXT];
+    *pack=lookup_32[PACK] % 10;
+  }
+}
+
+// Update a PP header to describe the field once unpacked
+void set_ppfield_lookup_unpacked(void* lookup, int lookup64, int unpacked_size) {
+  uint64_t* lookup_64=(uint64_t*)lookup;
+  uint32_t* lookup_32=(uint32_t*)lookup;
+
+  if (lookup64) {
+    lookup_64[FIELD_LENGTH]=unpacked_size + lookup_64[EXT];
+    lookup_64[PACK]=0;
+  } else {
+    lookup_32[FIELD_LENGTH]=unpacked_size + lookup_32[EXT];
+    lookup_32[PACK]=0;
+  }
+}
+
 int unpack_ppfield64(uint64_t* lookup, char* data, float* to, function* parent) {
   int unpacked_size;
   int data_size;
   int pack;
   float mdi;
-  double dmdi;
   int ret;
   function subroutine;
   set_function_name(__func__, &subroutine, parent);
 
-  if (sizeof(float) != 8) {
-    dmdi=*(double*)(lookup+MDI);
-    mdi=(float)dmdi;
-  } else {
-    mdi=*(float*)(lookup+MDI);
-  }
-  unpacked_size=lookup[NROWS]*lookup[NCOLS];
-  data_size = (lookup[FIELD_LENGTH] - lookup[EXT]);
-  pack=lookup[PACK] % 10;
+  read_ppfield_lookup(lookup, TRUE, &mdi, &data_size, &pack, &unpacked_size);
   ret=unpack_ppfield(mdi, data_size, data, pack, unpacked_size, to, parent);
-  lookup[FIELD_LENGTH]=unpacked_size + lookup[EXT];
-  lookup[PACK]=0;
+  set_ppfield_lookup_unpacked(lookup, TRUE, unpacked_size);
   return (ret);
 }
 
@@ -154,13 +294,9 @@ int unpack_ppfield32(uint32_t* lookup, char* data, float* to, function* parent)
   function subroutine;
   set_function_name(__func__, &subroutine, parent);
 
-  mdi=*(float*)(lookup+MDI);
-  unpacked_size=lookup[NROWS]*lookup[NCOLS];
-  data_size = lookup[FIELD_LENGTH] - lookup[EXT];
-  pack=lookup[PACK] % 10;
+  read_ppfield_lookup(lookup, FALSE, &mdi, &data_size, &pack, &unpacked_size);
   ret=unpack_ppfield(mdi, data_size, data, pack, unpacked_size, to, parent);
-  lookup[FIELD_LENGTH]=unpacked_size + lookup[EXT];
-  lookup[PACK]=0;
+  set_ppfield_lookup_unpacked(lookup, FALSE, unpacked_size);
   return (ret);
 }
 
@@ -168,11 +304,7 @@ int byteorder_data_unpack_ppfield(float mdi, int data_size, char* data, int netw
                                   int pack, int unpacked_size, float* to, int network_order_out,
                                   function* parent) {
   int retval=0;
-  int* ip_in;
-  int* ip_out;
-  int count;
-  char* newdata=NULL;
-  int temp;
+  char* newdata=data;
   function subroutine;
   set_function_name(__func__, &subroutine, parent);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
@@ -180,14 +312,10 @@ int byteorder_data_unpack_ppfield(float mdi, int data_size, char* data, int netw
     switch (pack) {
     case 1:
       newdata=malloc(data_size*sizeof(int));
-      ip_in=(int*)data;
-      ip_out=(int*)newdata;
-      for (count=0; count<data_size; count++) {
-        ip_out[count]=ntohl(ip_in[count]);
-      }
+      network_order_words32(data, newdata, data_size);
       break;
     default:
-      newdata=data;
+      break;
     }
   }
 #endif
@@ -196,11 +324,7 @@ int byteorder_data_unpack_ppfield(float mdi, int data_size, char* data, int netw
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
   if (network_order_out && (to!=NULL)) {
-    ip_in=(int*)to;
-    ip_out=(int*)to;
-    for (count=0; count<unpacked_size; count++) {
-      ip_out[count]=htonl(ip_in[count]);
-    }
+    network_order_words32(to, to, unpacked_size);
   }
 #endif
 
@@ -218,11 +342,6 @@ int byteorder_unpack_ppfield(int* lookup, char* data, int network_order_in,
   int data_size;
   int pack;
   float mdi;
-  int* ip_in;
-  int* ip_out;
-  int count;
-  char* newdata=NULL;
-  int temp;
   function subroutine;
   set_function_name(__func__, &subroutine, parent);
 
@@ -230,7 +349,8 @@ int byteorder_unpack_ppfield(int* lookup, char* data, int network_order_in,
   unpacked_size=lookup[NROWS]*lookup[NCOLS];
   data_size = lookup[FIELD_LENGTH] - lookup[EXT];
   pack=lookup[PACK] % 10;
-  byteorder_data_unpack_ppfield(mdi, data_size, data, network_order_in,
-                                pack, unpacked_size, to, network_order_out,
-                                &subroutine);
+  retval=byteorder_data_unpack_ppfield(mdi, data_size, data, network_order_in,
+                                       pack, unpacked_size, to, network_order_out,
+                                       &subroutine);
+  return retval;
 }
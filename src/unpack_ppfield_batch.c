@@ -0,0 +1,489 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* unpack_ppfield_batch.c
+ *
+ * Description:
+ *   Unpack many PP fields at once, sharing the work between threads
+ *
+ * Information:
+ *   Each thread keeps a queue of tasks. A task is either a whole field or,
+ *   for a large WGDOS field, a run of its rows. A thread takes the newest
+ *   task from its own queue, and when that is empty steals the oldest task
+ *   from another thread's queue. The fields are dealt out largest first.
+ *   A large WGDOS field is split into runs of rows once its row offsets
+ *   have been found, and the runs go on the queue of the thread that found
+ *   them, where idle threads can steal them. So one big field among many
+ *   small ones is still shared out across all the threads.
+ *   Each thread has its own work areas (wgdos_context) for all its tasks.
+ *   A field that fails does not stop the others: each has its own status.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "ppfield_lookup.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+
+/* Aim for about this many points in each run of rows */
+#define BATCH_CHUNK_POINTS 16384
+/* End of header */
+
+/* A whole field if nrows is 0, otherwise a run of rows in a WGDOS field */
+typedef struct batch_task {
+  int       field;
+  int       first_row;
+  int       nrows;
+} batch_task;
+
+/* A thread's task queue, kept in a ring. The owner works from the bottom
+   (newest) end and thieves from the top (oldest) end */
+typedef struct batch_queue {
+  pthread_mutex_t lock;
+  batch_task* tasks;
+  int       capacity;                /* Always a power of 2 */
+  int       top;
+  int       bottom;
+} batch_queue;
+
+/* What is known about each field while it is being unpacked */
+typedef struct batch_field {
+  ppfield_batch_item* item;
+  float     mdi;                     /* Missing data indicator value */
+  int       data_size;               /* Packed length in words */
+  int       pack;                    /* Packing code */
+  int       unpacked_size;           /* Number of values once unpacked */
+  float     accuracy;                /* WGDOS fields split into rows only */
+  int       ncols;
+  int*      row_offsets;
+  int       chunks_left;             /* Runs of rows not yet unpacked */
+} batch_field;
+
+typedef struct batch_pool {
+  batch_field* fields;
+  batch_queue* queues;
+  int       nthreads;
+  int       lookup64;
+  pthread_mutex_t lock;              /* Guards the rest, and each field's */
+  pthread_cond_t  changed;           /* chunks_left and status */
+  int       pending;                 /* Tasks queued or running */
+  int       generation;              /* Counts changes worth waking up for */
+  function* parent;
+} batch_pool;
+
+typedef struct batch_worker {
+  batch_pool* pool;
+  int       id;
+} batch_worker;
+
+/* Add a task at the bottom of the queue, growing it if full. Returns -1, leaving
+   the queue as it was, if there is no memory for the task */
+static int queue_push(batch_queue* queue, batch_task task) {
+  batch_task* grown;
+  int i;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tasks==NULL) {
+    pthread_mutex_unlock(&queue->lock);
+    return -1;
+  }
+  if (queue->bottom-queue->top==queue->capacity) {
+    grown = (batch_task *) malloc(sizeof(batch_task) * 2 * queue->capacity);
+    if (!grown) {
+      pthread_mutex_unlock(&queue->lock);
+      return -1;
+    }
+    for (i=queue->top; i<queue->bottom; i++) {
+      grown[i & (2*queue->capacity-1)]=queue->tasks[i & (queue->capacity-1)];
+    }
+    free(queue->tasks);
+    queue->tasks=grown;
+    queue->capacity*=2;
+  }
+  queue->tasks[queue->bottom & (queue->capacity-1)]=task;
+  queue->bottom++;
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
+
+static int queue_pop(batch_queue* queue, batch_task* task) {
+  int found=0;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->bottom>queue->top) {
+    queue->bottom--;
+    *task=queue->tasks[queue->bottom & (queue->capacity-1)];
+    found=1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static int queue_steal(batch_queue* queue, batch_task* task) {
+  int found=0;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->bottom>queue->top) {
+    *task=queue->tasks[queue->top & (queue->capacity-1)];
+    queue->top++;
+    found=1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+/* Take the next task, from this thread's own queue if it can */
+static int next_task(batch_pool* pool, int id, batch_task* task) {
+  int t;
+  if (queue_pop(&pool->queues[id], task)) {
+    return 1;
+  }
+  for (t=1; t<pool->nthreads; t++) {
+    if (queue_steal(&pool->queues[(id+t)%pool->nthreads], task)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Queue a task for this thread. The task adding it is still pending, so
+   pending cannot reach zero before it is counted */
+static int add_task(batch_pool* pool, int id, batch_task task) {
+  if (queue_push(&pool->queues[id], task)) {
+    return -1;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->pending++;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+static void task_done(batch_pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->pending--;
+  if (pool->pending==0) {
+    pool->generation++;
+    pthread_cond_broadcast(&pool->changed);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Count a run of rows of a field as finished, failed or not. The last run
+   of rows to finish tidies up the field */
+static void end_rows(batch_pool* pool, batch_field* field, int failed) {
+  pthread_mutex_lock(&pool->lock);
+  if (failed) {
+    field->item->status=1;
+  }
+  field->chunks_left--;
+  if (field->chunks_left==0) {
+    free(field->row_offsets);
+    field->row_offsets=NULL;
+    set_ppfield_lookup_unpacked(field->item->lookup, pool->lookup64, field->unpacked_size);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* A run of rows of a WGDOS field, straight into its place in the field */
+static void unpack_rows(batch_pool* pool, wgdos_context* context, batch_task* task) {
+  batch_field* field=&pool->fields[task->field];
+  uint64_t* missing_data;
+  uint64_t* zero;
+  char*     packed_row;
+  int       row_mdi_clashes;
+  int       failed_row=-1;
+  int       row;
+
+  missing_data = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((field->ncols+63)/64));
+  zero         = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((field->ncols+63)/64));
+  if (!(missing_data && zero)) {
+    failed_row=task->first_row;
+  } else {
+    for (row=task->first_row; row<task->first_row+task->nrows; row++) {
+      packed_row=field->item->data+field->row_offsets[row];
+      if (wgdos_unpack_row(&packed_row, field->ncols, field->accuracy, field->mdi,
+                           missing_data, zero,
+                           &field->item->to[row*field->ncols], &row_mdi_clashes, pool->parent)) {
+        failed_row=row;
+        break;
+      }
+    }
+  }
+  if (failed_row>=0) {
+    snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d of field %d", failed_row, task->field);
+    MO_syslog(VERBOSITY_ERROR, message, pool->parent);
+  }
+  end_rows(pool, field, failed_row>=0);
+}
+
+/* A whole field, or for a large WGDOS field the start of one: find its
+   rows and queue them up in runs */
+static void unpack_field(batch_pool* pool, int id, wgdos_context* context, batch_task* task) {
+  batch_field* field=&pool->fields[task->field];
+  batch_task chunk;
+  char*     packed_data=field->item->data;
+  int       rows_per_chunk;
+  int       nchunks;
+  int       nrows;
+  int       c;
+
+  if (field->pack==WGDOS_PACKED && field->item->to!=NULL &&
+      wgdos_decode_field_parameters(&packed_data, field->unpacked_size, &field->accuracy,
+                                    &field->ncols, &nrows, pool->parent)==0) {
+    rows_per_chunk=BATCH_CHUNK_POINTS/(field->ncols>0 ? field->ncols : 1);
+    if (rows_per_chunk<1) {
+      rows_per_chunk=1;
+    }
+    nchunks=(nrows+rows_per_chunk-1)/rows_per_chunk;
+    if (nchunks>1) {
+      field->row_offsets = (int *) malloc(sizeof(int) * (nrows+1));
+      if (field->row_offsets &&
+          wgdos_scan_row_offsets(field->item->data, nrows, field->row_offsets, pool->parent)) {
+        /* A broken field, unpacked as a whole below to report it as usual */
+        free(field->row_offsets);
+        field->row_offsets=NULL;
+      } else if (field->row_offsets) {
+        field->chunks_left=nchunks;
+        /* Last run first, so that this thread takes them in order */
+        for (c=nchunks-1; c>=0; c--) {
+          chunk.field=task->field;
+          chunk.first_row=c*rows_per_chunk;
+          chunk.nrows=(c==nchunks-1 ? nrows-chunk.first_row : rows_per_chunk);
+          if (add_task(pool, id, chunk)) {
+            /* Out of memory to queue it, so the field fails */
+            snprintf(message, MAX_MESSAGE_SIZE, "Out of memory to queue rows %d of field %d",
+                     chunk.first_row, task->field);
+            MO_syslog(VERBOSITY_ERROR, message, pool->parent);
+            end_rows(pool, field, TRUE);
+          }
+        }
+        return;
+      }
+    }
+  }
+
+  field->item->status=unpack_ppfield_ctx(context, field->mdi, field->data_size, field->item->data,
+                                         field->pack, field->unpacked_size, field->item->to, pool->parent);
+  set_ppfield_lookup_unpacked(field->item->lookup, pool->lookup64, field->unpacked_size);
+}
+
+static void* batch_worker_run(void* arg) {
+  batch_worker* worker=(batch_worker*)arg;
+  batch_pool* pool=worker->pool;
+  wgdos_context context;
+  batch_task task;
+  int generation;
+
+  wgdos_context_init(&context);
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    generation=pool->generation;
+    if (pool->pending==0) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (next_task(pool, worker->id, &task)) {
+      if (task.nrows>0) {
+        unpack_rows(pool, &context, &task);
+      } else {
+        unpack_field(pool, worker->id, &context, &task);
+      }
+      task_done(pool);
+    } else {
+      /* Nothing to do until a task is queued or the last one finishes */
+      pthread_mutex_lock(&pool->lock);
+      while (pool->pending>0 && pool->generation==generation) {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+      }
+      pthread_mutex_unlock(&pool->lock);
+    }
+  }
+  wgdos_context_free(&context);
+  return NULL;
+}
+
+/* Largest fields first */
+static int compare_field_size(const void* a, const void* b) {
+  const batch_field* fa=*(const batch_field* const*)a;
+  const batch_field* fb=*(const batch_field* const*)b;
+  return (fb->unpacked_size > fa->unpacked_size) - (fb->unpacked_size < fa->unpacked_size);
+}
+
+static int unpack_ppfield_batch(ppfield_batch_item* fields, int nfields, int nthreads,
+                                int lookup64, function* parent) {
+  batch_pool pool;
+  batch_worker* workers;
+  batch_field** order;
+  pthread_t* threads;
+  Boolean*  started;
+  batch_task task;
+  long      ntasks=0;
+  int       nfailed=0;
+  int       i, t;
+  function subroutine;
+
+  set_function_name(__func__, &subroutine, parent);
+  if (nfields<=0) {
+    return 0;
+  }
+
+  pool.fields = (batch_field *) malloc(sizeof(batch_field) * nfields);
+  order       = (batch_field **) malloc(sizeof(batch_field*) * nfields);
+  if (!(pool.fields && order)) {
+    free(pool.fields);
+    free(order);
+    MO_syslog(VERBOSITY_ERROR, "Out of memory for the batch of fields", &subroutine);
+    return nfields;
+  }
+  for (i=0; i<nfields; i++) {
+    pool.fields[i].item=&fields[i];
+    pool.fields[i].row_offsets=NULL;
+    pool.fields[i].chunks_left=0;
+    fields[i].status=0;
+    read_ppfield_lookup(fields[i].lookup, lookup64, &pool.fields[i].mdi, &pool.fields[i].data_size,
+                        &pool.fields[i].pack, &pool.fields[i].unpacked_size);
+    ntasks+=pool.fields[i].unpacked_size/BATCH_CHUNK_POINTS+1;
+    order[i]=&pool.fields[i];
+  }
+  qsort(order, nfields, sizeof(batch_field*), compare_field_size);
+
+  if (nthreads<=0) {
+    nthreads=sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads>ntasks) {
+    nthreads=ntasks;
+  }
+  if (nthreads<1) {
+    nthreads=1;
+  }
+
+  pool.queues = (batch_queue *) malloc(sizeof(batch_queue) * nthreads);
+  workers     = (batch_worker *) malloc(sizeof(batch_worker) * nthreads);
+  threads     = (pthread_t *) malloc(sizeof(pthread_t) * nthreads);
+  started     = (Boolean *) malloc(sizeof(Boolean) * nthreads);
+  if (!(pool.queues && workers && threads && started)) {
+    free(pool.queues);
+    free(workers);
+    free(threads);
+    free(started);
+    free(order);
+    free(pool.fields);
+    MO_syslog(VERBOSITY_ERROR, "Out of memory for the batch of fields", &subroutine);
+    return nfields;
+  }
+
+  pool.nthreads=nthreads;
+  pool.lookup64=lookup64;
+  pool.pending=0;
+  pool.generation=0;
+  pool.parent=&subroutine;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.changed, NULL);
+  for (t=0; t<nthreads; t++) {
+    pthread_mutex_init(&pool.queues[t].lock, NULL);
+    pool.queues[t].capacity=1;
+    while (pool.queues[t].capacity<nfields/nthreads+1) {
+      pool.queues[t].capacity*=2;
+    }
+    pool.queues[t].tasks = (batch_task *) malloc(sizeof(batch_task) * pool.queues[t].capacity);
+    pool.queues[t].top=0;
+    pool.queues[t].bottom=0;
+    workers[t].pool=&pool;
+    workers[t].id=t;
+  }
+
+  /* Deal the fields out largest first, each queue getting its largest
+     field last so that its thread starts on that one */
+  for (i=nfields-1; i>=0; i--) {
+    task.field=order[i]-pool.fields;
+    task.first_row=0;
+    task.nrows=0;
+    if (queue_push(&pool.queues[i%nthreads], task)) {
+      /* Out of memory, so leave this field out */
+      order[i]->item->status=1;
+      continue;
+    }
+    pool.pending++;
+  }
+
+  /* The calling thread works too. If a thread can't be started, its queue
+     is emptied by the others */
+  for (t=1; t<nthreads; t++) {
+    started[t]=(pthread_create(&threads[t], NULL, batch_worker_run, &workers[t])==0);
+  }
+  batch_worker_run(&workers[0]);
+  for (t=1; t<nthreads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+
+  for (i=0; i<nfields; i++) {
+    if (fields[i].status) {
+      nfailed++;
+    }
+  }
+  if (nfailed) {
+    snprintf(message, MAX_MESSAGE_SIZE, "%d of %d fields failed to unpack", nfailed, nfields);
+    MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+    set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+  }
+
+  for (t=0; t<nthreads; t++) {
+    pthread_mutex_destroy(&pool.queues[t].lock);
+    free(pool.queues[t].tasks);
+  }
+  pthread_cond_destroy(&pool.changed);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.queues);
+  free(workers);
+  free(threads);
+  free(started);
+  free(order);
+  free(pool.fields);
+  return nfailed;
+}
+
+/* Unpack a batch of fields with 32 bit PP headers, returning how many failed */
+int unpack_ppfield_batch32(ppfield_batch_item* fields, int nfields, int nthreads, function* parent) {
+  return unpack_ppfield_batch(fields, nfields, nthreads, FALSE, parent);
+}
+
+/* Unpack a batch of fields with 64 bit PP headers, returning how many failed */
+int unpack_ppfield_batch64(ppfield_batch_item* fields, int nfields, int nthreads, function* parent) {
+  return unpack_ppfield_batch(fields, nfields, nthreads, TRUE, parent);
+}
@@ -0,0 +1,234 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* unpack_ppfield_iov.c
+ *
+ * Description:
+ *   Unpack a PP field whose packed data is in several pieces
+ *
+ * Information:
+ *   As unpack_ppfield, but the packed data is given as a list of
+ *   segments (struct iovec, as for readv), e.g. the cache blocks a record
+ *   was read into, instead of one array. The segments are read where
+ *   they are and are not changed:
+ *   - unpacked and RLE packed fields are read a block of words at a time,
+ *     gathering only the words split between two segments;
+ *   - WGDOS packed fields are fed segment by segment to a push decoder,
+ *     which unpacks each row where it lies unless the row is split
+ *     between two segments, when that row alone is gathered.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "ppfield_lookup.h"
+#include "rlencode.h"
+#include "logerrors.h"
+
+/* End of header */
+
+#define RLE_BLOCK_WORDS 1024
+
+/* Where the next word is in a list of segments */
+typedef struct word_reader {
+  const struct iovec* iov;
+  int    iovcnt;
+  int    segment;
+  size_t offset;                     /* Bytes of the segment already read */
+} word_reader;
+
+/* Read up to nwords 32 bit words into words, in native order. Returns how many
+   were read, fewer only if the segments ran out */
+static int read_words(word_reader* reader, void* words, int nwords) {
+  char*  out=(char*)words;
+  char   split[sizeof(uint32_t)];
+  size_t have;
+  size_t left;
+  size_t take;
+  int    whole;
+  int    count=0;
+
+  while (count<nwords && reader->segment<reader->iovcnt) {
+    left=reader->iov[reader->segment].iov_len-reader->offset;
+    if (left==0) {
+      reader->segment++;
+      reader->offset=0;
+    } else if (left>=sizeof(uint32_t)) {
+      whole=(left/sizeof(uint32_t)<(size_t)(nwords-count) ? (int)(left/sizeof(uint32_t)) : nwords-count);
+      network_order_words32((char*)reader->iov[reader->segment].iov_base+reader->offset,
+                            out+count*sizeof(uint32_t), whole);
+      reader->offset+=whole*sizeof(uint32_t);
+      count+=whole;
+    } else {
+      /* A word split between segments */
+      for (have=0; have<sizeof(split) && reader->segment<reader->iovcnt; ) {
+        left=reader->iov[reader->segment].iov_len-reader->offset;
+        take=(left<sizeof(split)-have ? left : sizeof(split)-have);
+        memcpy(split+have, (char*)reader->iov[reader->segment].iov_base+reader->offset, take);
+        have+=take;
+        reader->offset+=take;
+        if (reader->offset==reader->iov[reader->segment].iov_len) {
+          reader->segment++;
+          reader->offset=0;
+        }
+      }
+      if (have<sizeof(split)) {
+        break;
+      }
+      network_order_words32(split, out+count*sizeof(uint32_t), 1);
+      count++;
+    }
+  }
+  return count;
+}
+
+/* As runlen_decode, feeding the decoder the data_size words of RLE packed data
+   a block at a time from the segments */
+static int runlen_decode_iov(float* unpacked, int unpacked_size, word_reader* reader, int data_size,
+                             float mdi, function* parent) {
+  float block[RLE_BLOCK_WORDS];
+  int   nblock;
+  runlen_decoder   decoder;
+  runlen_expansion expansion;
+  runlen_sink      sink;
+
+  runlen_decoder_init(&decoder, unpacked_size, mdi);
+  runlen_expansion_sink(&sink, &expansion, unpacked, mdi);
+  while (data_size>0) {
+    nblock=read_words(reader, block, data_size<RLE_BLOCK_WORDS ? data_size : RLE_BLOCK_WORDS);
+    if (nblock==0) {
+      MO_syslog(VERBOSITY_ERROR, "RLE packed data shorter than its stated length", parent);
+      return RL_ERR;
+    }
+    data_size-=nblock;
+    if (runlen_decoder_feed(&decoder, block, nblock, &sink, parent)) {
+      return RL_ERR;
+    }
+  }
+  return runlen_decoder_finish(&decoder, parent);
+}
+
+/* Unpack a WGDOS packed field fed a segment at a time to the push decoder */
+static int wgdos_unpack_iov(const struct iovec* iov, int iovcnt, int unpacked_size, float* to,
+                            float mdi, function* parent) {
+  wgdos_push_decoder decoder;
+  int segment;
+  int rc=0;
+
+  if (wgdos_push_decoder_open(&decoder, unpacked_size, to, mdi, parent)) {
+    wgdos_push_decoder_close(&decoder);
+    return 1;
+  }
+  for (segment=0; segment<iovcnt && rc==0; segment++) {
+    rc=wgdos_push_decoder_feed(&decoder, iov[segment].iov_base, iov[segment].iov_len, parent);
+  }
+  wgdos_push_decoder_close(&decoder);
+  if (rc==0) {
+    MO_syslog(VERBOSITY_ERROR, "WGDOS packed data ended before its last row", parent);
+  }
+  return rc!=1;
+}
+
+/* As unpack_ppfield, the packed data being the iovcnt segments of iov in turn.
+   The segments are left as they are */
+int unpack_ppfield_iov(float mdi, int data_size, const struct iovec* iov, int iovcnt, int pack,
+                       int unpacked_size, float* to, function* parent) {
+  word_reader reader={iov, iovcnt, 0, 0};
+  int retval=0;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  if (to==NULL) {
+    MO_syslog(VERBOSITY_ERROR, "Nowhere to unpack the field to", &subroutine);
+    return 1;
+  }
+  switch(pack) {
+  case 0:
+    MO_syslog(VERBOSITY_INFO, "Unpacked data", &subroutine);
+    if (read_words(&reader, to, data_size)!=data_size) {
+      MO_syslog(VERBOSITY_ERROR, "Unpacked data shorter than its stated length", &subroutine);
+      retval=1;
+    }
+    break;
+  case 1:
+    MO_syslog(VERBOSITY_INFO, "WGDOS packed data", &subroutine);
+    if (wgdos_unpack_iov(iov, iovcnt, unpacked_size, to, mdi, &subroutine)) {
+      MO_syslog(VERBOSITY_INFO, "wgdos_unpack Failed", &subroutine);
+      retval=1;
+    }
+    break;
+  case 4:
+    MO_syslog(VERBOSITY_INFO, "RLE packed data", &subroutine);
+    if (runlen_decode_iov(to, unpacked_size, &reader, data_size, mdi, &subroutine)) {
+      MO_syslog(VERBOSITY_INFO, "runlen_decode Failed", &subroutine);
+      retval=1;
+    }
+    break;
+  default:
+    MO_syslog(VERBOSITY_ERROR, "Unrecognised packing code", &subroutine);
+    retval=1;
+  }
+  if (retval) {
+    set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+  }
+  return retval;
+}
+
+int unpack_ppfield64_iov(uint64_t* lookup, const struct iovec* iov, int iovcnt, float* to, function* parent) {
+  int unpacked_size;
+  int data_size;
+  int pack;
+  float mdi;
+  int ret;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  read_ppfield_lookup(lookup, TRUE, &mdi, &data_size, &pack, &unpacked_size);
+  ret=unpack_ppfield_iov(mdi, data_size, iov, iovcnt, pack, unpacked_size, to, &subroutine);
+  set_ppfield_lookup_unpacked(lookup, TRUE, unpacked_size);
+  return (ret);
+}
+
+int unpack_ppfield32_iov(uint32_t* lookup, const struct iovec* iov, int iovcnt, float* to, function* parent) {
+  int unpacked_size;
+  int data_size;
+  int pack;
+  float mdi;
+  int ret;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  read_ppfield_lookup(lookup, FALSE, &mdi, &data_size, &pack, &unpacked_size);
+  ret=unpack_ppfield_iov(mdi, data_size, iov, iovcnt, pack, unpacked_size, to, &subroutine);
+  set_ppfield_lookup_unpacked(lookup, FALSE, unpacked_size);
+  return (ret);
+}
@@ -0,0 +1,364 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* unpack_validity.c
+ *
+ * Description:
+ *   Which points of a field are not missing, as a bitset
+ *
+ * Information:
+ *   The mask has a bit for each point of the field, in order of flat index
+ *   (row*ncols+col), set if the point is not missing: bit i is bit i%8
+ *   (least significant first) of byte i/8, the layout of Arrow validity
+ *   bitmaps and numpy.packbits(bitorder="little"). Bits past the end of
+ *   the field in the last byte are clear.
+ *   For WGDOS packed fields it is the missing data bitmap of each row,
+ *   reversed, so the mask is made from the row headers and bitmaps alone
+ *   and no data value is unpacked. For RLE packed fields it is made from
+ *   the runs of missing data, and for unpacked fields by comparing each
+ *   value with mdi.
+ *   wgdos_unpack_masked unpacks a field together with its mask, giving
+ *   missing points a fill value of the caller's choosing rather than mdi.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "wgdosbits.h"
+#include "rlencode.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+/* Words of an unpacked or RLE packed field put into native order at a time */
+#define VALIDITY_BLOCK_WORDS 1024
+
+/* Bits being appended to a mask, least significant first */
+typedef struct bit_writer {
+  uint8_t* out;                      /* Next byte to write */
+  uint64_t pending;                  /* Bits not yet written, from bit 0 */
+  int      npending;                 /* How many, fewer than 8 between appends */
+} bit_writer;
+
+/* Append the bottom nbits (<=32) bits of bits */
+static void append_bits(bit_writer* writer, uint64_t bits, int nbits) {
+  writer->pending|=(bits & (((uint64_t)1<<nbits)-1))<<writer->npending;
+  writer->npending+=nbits;
+  while (writer->npending>=8) {
+    *writer->out++=(uint8_t)writer->pending;
+    writer->pending>>=8;
+    writer->npending-=8;
+  }
+}
+
+/* Append a row's validity, the complement of its missing data bitmap words */
+static void append_row(bit_writer* writer, const uint64_t* missing_data, int ncols) {
+  uint64_t valid;
+  int nbits;
+  int word;
+
+  for (word=0; word<(ncols+63)/64; word++) {
+    nbits=(ncols-64*word<64 ? ncols-64*word : 64);
+    valid=reverse_bits64(~missing_data[word]);
+    append_bits(writer, valid, nbits<32 ? nbits : 32);
+    if (nbits>32) {
+      append_bits(writer, valid>>32, nbits-32);
+    }
+  }
+}
+
+/* Write out the last part byte, if any */
+static void finish_bits(bit_writer* writer) {
+  if (writer->npending>0) {
+    *writer->out++=(uint8_t)writer->pending;
+    writer->pending=0;
+    writer->npending=0;
+  }
+}
+
+int wgdos_validity_mask(
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    uint8_t*  mask,                  /* (unpacked_len+7)/8 bytes, bit set where not missing */
+    int*      nvalid,                /* Number of points not missing */
+    function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_validity_mask_ctx(&context, packed_data, unpacked_len, mask, nvalid, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_validity_mask, taking the work areas from the context */
+int wgdos_validity_mask_ctx(
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    uint8_t*  mask,                  /* (unpacked_len+7)/8 bytes, bit set where not missing */
+    int*      nvalid,                /* Number of points not missing */
+    function* parent)
+{
+    float     accuracy;              /* Absolute accuracy to which data held */
+    int       ncols;                 /* Number of columns in each row */
+    int       nrows;                 /* Number of rows in field */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
+    char*     field_data=packed_data;
+    char*     row_start;
+    char*     field_end;             /* End of the field according to the field header */
+    float     base;
+    int       bits_per_value;
+    int       ndata;
+    int       nop;
+    int       word;
+    int       row;
+    bit_writer writer={mask, 0, 0};
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (wgdos_decode_field_parameters(&field_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine)) {
+      return -1;
+    }
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+
+    /* Reserve work areas */
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((ncols+63)/64));
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((ncols+63)/64));
+    if (!(missing_data && zero)) {
+      return -1;
+    }
+
+    *nvalid=nrows*ncols;
+    field_data=packed_data+sizeof(wgdos_field_header);
+    for (row=0; row<nrows; row++) {
+      row_start=field_data;
+      if (!wgdos_row_fits(field_data, field_end) ||
+          wgdos_start_row(&field_data, ncols, missing_data, zero, &base, &bits_per_value,
+                          &ndata, &nop, &subroutine)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+      for (word=0; word<(ncols+63)/64; word++) {
+        *nvalid-=POPCOUNT64(missing_data[word]);
+      }
+      append_row(&writer, missing_data, ncols);
+      field_data=row_start+8+4*nop;
+    }
+    finish_bits(&writer);
+    return 0;
+}
+
+int wgdos_unpack_masked(
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    float*    unpacked_data,         /* unpacked_len values */
+    uint8_t*  mask,                  /* (unpacked_len+7)/8 bytes, bit set where not missing */
+    float     fill,                  /* Value given to missing points */
+    function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_unpack_masked_ctx(&context, packed_data, unpacked_len, unpacked_data, mask, fill, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_unpack_masked, taking the work areas from the context */
+int wgdos_unpack_masked_ctx(
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    float*    unpacked_data,         /* unpacked_len values */
+    uint8_t*  mask,                  /* (unpacked_len+7)/8 bytes, bit set where not missing */
+    float     fill,                  /* Value given to missing points */
+    function* parent)
+{
+    float     accuracy;              /* Absolute accuracy to which data held */
+    int       ncols;                 /* Number of columns in each row */
+    int       nrows;                 /* Number of rows in field */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
+    char*     field_data=packed_data;
+    char*     field_end;             /* End of the field according to the field header */
+    int       row_mdi_clashes;
+    int       row;
+    bit_writer writer={mask, 0, 0};
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (wgdos_decode_field_parameters(&field_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine)) {
+      return -1;
+    }
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+
+    /* Reserve work areas */
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((ncols+63)/64));
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((ncols+63)/64));
+    if (!(missing_data && zero)) {
+      return -1;
+    }
+
+    /* The values as wgdos_unpack gives them, with fill in place of mdi for the missing ones */
+    field_data=packed_data+sizeof(wgdos_field_header);
+    for (row=0; row<nrows; row++) {
+      if (!wgdos_row_fits(field_data, field_end) ||
+          wgdos_unpack_row(&field_data, ncols, accuracy, fill, missing_data, zero,
+                                  unpacked_data+(size_t)row*ncols, &row_mdi_clashes, &subroutine)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+      append_row(&writer, missing_data, ncols);
+    }
+    finish_bits(&writer);
+    return 0;
+}
+
+/* The mask of an RLE packed field being made, and how many of its bits are set */
+typedef struct runlen_mask {
+  uint8_t* mask;
+  int*     nvalid;
+} runlen_mask;
+
+/* Sets the bit of each value that is not missing, as runlen_decoder_feed gives them */
+static int mask_values(void* state, int fatpos, const float* values, int nvalues, function* parent) {
+  runlen_mask* mask=(runlen_mask*)state;
+  int i;
+  (void)values;
+  (void)parent;
+
+  for (i=fatpos; i<fatpos+nvalues; i++) {
+    mask->mask[i/8]|=(uint8_t)(1<<(i%8));
+  }
+  *mask->nvalid+=nvalues;
+  return 0;
+}
+
+/* A run of missing data leaves its bits clear */
+static int mask_run(void* state, int fatpos, int nmdi, function* parent) {
+  (void)state;
+  (void)fatpos;
+  (void)nmdi;
+  (void)parent;
+  return 0;
+}
+
+/* The mask of an RLE packed field, from its runs of missing data. data is left as it is,
+   being put into native order a block at a time to feed the run decoder */
+static int runlen_validity_mask(uint8_t* mask, int fatlen, const char* data, int data_size, float mdi,
+                                int* nvalid, function* parent) {
+  float block[VALIDITY_BLOCK_WORDS];
+  int   start;
+  int   nblock;
+  runlen_decoder decoder;
+  runlen_mask    state={mask, nvalid};
+  runlen_sink    sink={mask_values, mask_run, &state};
+
+  memset(mask, 0, ((size_t)fatlen+7)/8);
+  *nvalid=0;
+  runlen_decoder_init(&decoder, fatlen, mdi);
+  for (start=0; start<data_size; start+=nblock) {
+    nblock=(data_size-start<VALIDITY_BLOCK_WORDS ? data_size-start : VALIDITY_BLOCK_WORDS);
+    network_order_words32(data+(size_t)start*sizeof(float), block, nblock);
+    if (runlen_decoder_feed(&decoder, block, nblock, &sink, parent)) {
+      return 1;
+    }
+  }
+  return runlen_decoder_finish(&decoder, parent)!=RL_OK;
+}
+
+/* The validity mask of a PP field packed in any way unpack_ppfield knows, without
+   unpacking it. Unlike unpack_ppfield, data is left as it is */
+int unpack_ppfield_validity(float mdi, int data_size, char* data, int pack, int unpacked_size,
+                            uint8_t* mask, int* nvalid, function* parent) {
+  wgdos_context context;
+  int retval;
+  wgdos_context_init(&context);
+  retval=unpack_ppfield_validity_ctx(&context, mdi, data_size, data, pack, unpacked_size, mask, nvalid, parent);
+  wgdos_context_free(&context);
+  return retval;
+}
+
+/* As unpack_ppfield_validity, taking the work areas from the context */
+int unpack_ppfield_validity_ctx(wgdos_context* context, float mdi, int data_size, char* data, int pack,
+                                int unpacked_size, uint8_t* mask, int* nvalid, function* parent) {
+  float block[VALIDITY_BLOCK_WORDS];
+  int start;
+  int nblock;
+  int i;
+  int retval=0;
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  switch(pack) {
+  case 0:
+    /* Put a block at a time into native order, then compare it with mdi while it is in cache */
+    memset(mask, 0, ((size_t)data_size+7)/8);
+    *nvalid=0;
+    for (start=0; start<data_size; start+=nblock) {
+      nblock=(data_size-start<VALIDITY_BLOCK_WORDS ? data_size-start : VALIDITY_BLOCK_WORDS);
+      network_order_words32(data+(size_t)start*sizeof(float), block, nblock);
+      for (i=0; i<nblock; i++) {
+        if (block[i]!=mdi) {
+          mask[(start+i)/8]|=(uint8_t)(1<<((start+i)%8));
+          (*nvalid)++;
+        }
+      }
+    }
+    break;
+  case 1:
+    retval=(wgdos_validity_mask_ctx(context, data, unpacked_size, mask, nvalid, &subroutine)!=0);
+    break;
+  case 4:
+    retval=runlen_validity_mask(mask, unpacked_size, data, data_size, mdi, nvalid, &subroutine);
+    break;
+  default:
+    MO_syslog(VERBOSITY_ERROR, "Unrecognised packing code", &subroutine);
+    retval=1;
+  }
+  if (retval) {
+    set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+  }
+  return retval;
+}
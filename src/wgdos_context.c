@@ -0,0 +1,75 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_context.c
+ *
+ * Description:
+ *   Scratch memory kept from one pack or unpack call to the next
+ *
+ * Information:
+ *   Each work area only ever grows, so a program that unpacks or packs many
+ *   fields of similar size with the same context stops allocating memory after
+ *   the first few fields. A context must only be used by one call at a time.
+ */
+
+/* Standard header files used */
+#include <stdlib.h>
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+
+/* End of header */
+
+/* Start a context with no work areas reserved */
+void wgdos_context_init(wgdos_context* context) {
+  memset(context, 0, sizeof(*context));
+}
+
+/* Release a context's work areas. The context may be used again afterwards */
+void wgdos_context_free(wgdos_context* context) {
+  int slot;
+  for (slot=0; slot<WGDOS_CONTEXT_SLOTS; slot++) {
+    free(context->scratch[slot]);
+  }
+  wgdos_context_init(context);
+}
+
+/* Work area number slot of at least size bytes, reserving more memory only if it
+   has not been that big before. The contents are not kept. NULL if out of memory */
+void* wgdos_context_scratch(wgdos_context* context, int slot, size_t size) {
+  void* scratch;
+  if (size>context->scratch_size[slot] || context->scratch[slot]==NULL) {
+    /* Nothing worth keeping, so free before reserving to save a copy */
+    free(context->scratch[slot]);
+    scratch=malloc(size>0 ? size : 1);
+    context->scratch[slot]=scratch;
+    context->scratch_size[slot]=(scratch!=NULL ? size : 0);
+  }
+  return context->scratch[slot];
+}
@@ -81,7 +81,7 @@
 #include "logerrors.h"
 
 #define MAX_MESSAGE_SIZE 1024
-static char message[MAX_MESSAGE_SIZE];
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
 
 /* End of header */
 
@@ -76,11 +76,16 @@
 #include <string.h>
 #include <stdio.h>
 #include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "wgdosbits.h"
 #include "logerrors.h"
 #define debug 0
 
-#define MAX_MESSAGE_SIZE 1024
-static char message[MAX_MESSAGE_SIZE];
+#ifdef DEBUG
+  /* Only the row dumps of a DEBUG build log anything */
+  #define MAX_MESSAGE_SIZE 1024
+  static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+#endif
 
 /* End of header */
 
@@ -111,7 +116,9 @@ int wgdos_expand_row_to_data(
     dacc=accuracy;
     dbase=base;
 
+    #ifdef DEBUG
     message[0]=0;
+    #endif
     for ( col = 0; col < ncols; col ++ ) {
       off=1;
       if ( missing_data[col] ) {
@@ -180,7 +187,9 @@ int wgdos_expand_broken_row_to_data(
     *mdi_clashes = 0;
     non_special_so_far = 0;
     
+    #ifdef DEBUG
     message[0]=0;
+    #endif
     for ( col = 0; col < ncols; col ++ ) {
       off=1;
       if ( missing_data[col]) {
@@ -219,3 +228,295 @@ int wgdos_expand_broken_row_to_data(
     #endif
     return 0;
 } /* end function PP_Wgdos_Expand_Broken_Row */
+
+/* As wgdos_expand_row_to_data, but reading each data value straight out of the packed
+   bitstream as it goes rather than from an array of already extracted integers, and
+   taking the bitmaps as 64-bit words from read_wgdos_bitmap_words. The bitmaps are used
+   to find the runs of data values between missing or zero values, so there is no test
+   on each column; a block of 64 columns with neither is a single run. Uses the same
+   double precision arithmetic, so the values are identical. */
+int wgdos_expand_packed_row_to_data(
+    int       ncols,
+    float     mdi,
+    float     accuracy,
+    float     base,
+    uint64_t *missing_data,         /* Missing data bitmap words, bit set for missing */
+    uint64_t *zero,                 /* Zeros bitmap words, bit set for zero */
+    unsigned char *packed,          /* Packed data values for the row (MSB first) */
+    int       bits_per_value,       /* Bits per packed data value, 0 <= bits_per_value < 32 */
+    int       ndata,                /* Number of packed data values */
+    float    *unpacked_data,
+    int      *mdi_clashes
+)
+{
+    return wgdos_expand_packed_row_window(ncols, 0, ncols, mdi, accuracy, base,
+                                          missing_data, zero, packed, bits_per_value, ndata,
+                                          unpacked_data, mdi_clashes);
+} /* end function wgdos_expand_packed_row_to_data */
+
+/* The kernel of wgdos_expand_packed_row_window and wgdos_expand_packed_row_affine. Each
+   data value is worked out as accuracy*integer+base in double precision; with a transform
+   a value equal to mdi is then given as mdi_out and the others as value*scale+offset */
+static int expand_packed_row_window(
+    int       ncols,
+    int       first_col,            /* First column wanted */
+    int       window_cols,          /* Number of columns wanted */
+    float     mdi,
+    float     accuracy,
+    float     base,
+    const unpack_transform* transform, /* NULL for none */
+    uint64_t *missing_data,         /* Missing data bitmap words, bit set for missing */
+    uint64_t *zero,                 /* Zeros bitmap words, bit set for zero */
+    unsigned char *packed,          /* Packed data values for the row (MSB first) */
+    int       bits_per_value,       /* Bits per packed data value, 0 <= bits_per_value < 32 */
+    int       ndata,                /* Number of packed data values */
+    float    *unpacked_data,        /* The window_cols unpacked values */
+    int      *mdi_clashes           /* Data values equal to mdi */
+)
+{
+    packed_values values;
+    column_runs runs;
+    int  index;               /* Number of the next packed value */
+    int  col, run_end, special_kind;
+    int  end_col;             /* Column after the window */
+    int  word;
+    float value;
+    float missing_value=(transform ? transform->mdi_out : mdi);
+    float zero_value=(transform ? (float)transform->offset : 0.0);
+    double dacc=accuracy, dbase=base;
+
+    *mdi_clashes = 0;
+    end_col=first_col+window_cols;
+    if (end_col>ncols) {
+      end_col=ncols;
+    }
+    packed_values_init(&values, packed, bits_per_value, ndata);
+
+    /* Step over the data values before the window */
+    index=first_col;
+    for (word=0; word<first_col/64; word++) {
+      index-=POPCOUNT64(missing_data[word] | zero[word]);
+    }
+    if (first_col%64) {
+      index-=POPCOUNT64((missing_data[word] | zero[word]) & TOP_BITS64(first_col%64));
+    }
+
+    column_runs_init(&runs, missing_data, zero, first_col, end_col);
+    while (column_runs_next(&runs, &col, &run_end, &special_kind)) {
+      for ( ; col<run_end; col++, index++) {
+        value = dacc*packed_value_at(&values, index)+dbase;
+        if ( value == mdi ) {
+          (*mdi_clashes)++;
+          value = missing_value;
+        } else if (transform) {
+          value = value*transform->scale+transform->offset;
+        }
+        unpacked_data[col-first_col] = value;
+      }
+      if (special_kind>=0) {
+        unpacked_data[col-first_col] = special_kind ? missing_value : zero_value;
+      }
+    }
+    return 0;
+} /* end function expand_packed_row_window */
+
+/* As wgdos_expand_packed_row_to_data, for columns first_col to first_col+window_cols-1
+   only, put at the start of unpacked_data. The packed values of the columns before the
+   window are stepped over by counting the missing and zero bits before it, a word at
+   a time, so none of them are unpacked. */
+int wgdos_expand_packed_row_window(
+    int       ncols,
+    int       first_col,            /* First column wanted */
+    int       window_cols,          /* Number of columns wanted */
+    float     mdi,
+    float     accuracy,
+    float     base,
+    uint64_t *missing_data,         /* Missing data bitmap words, bit set for missing */
+    uint64_t *zero,                 /* Zeros bitmap words, bit set for zero */
+    unsigned char *packed,          /* Packed data values for the row (MSB first) */
+    int       bits_per_value,       /* Bits per packed data value, 0 <= bits_per_value < 32 */
+    int       ndata,                /* Number of packed data values */
+    float    *unpacked_data,        /* The window_cols unpacked values */
+    int      *mdi_clashes
+)
+{
+    return expand_packed_row_window(ncols, first_col, window_cols, mdi, accuracy, base, NULL,
+                                    missing_data, zero, packed, bits_per_value, ndata,
+                                    unpacked_data, mdi_clashes);
+} /* end function wgdos_expand_packed_row_window */
+
+/* As wgdos_expand_packed_row_to_data, applying transform to each value as it is unpacked,
+   as unpack_ppfield_transformed does for unpacked and RLE packed fields: missing values
+   and data values equal to mdi are given as mdi_out, zeros as offset, and the rest as
+   value*scale+offset. With a scale of 1, offset of 0 and mdi_out of mdi the values are
+   those of wgdos_expand_packed_row_to_data. mdi_clashes counts data values equal to mdi. */
+int wgdos_expand_packed_row_affine(
+    int       ncols,
+    float     mdi,
+    float     accuracy,
+    float     base,
+    const unpack_transform* transform,
+    uint64_t *missing_data,         /* Missing data bitmap words, bit set for missing */
+    uint64_t *zero,                 /* Zeros bitmap words, bit set for zero */
+    unsigned char *packed,          /* Packed data values for the row (MSB first) */
+    int       bits_per_value,       /* Bits per packed data value, 0 <= bits_per_value < 32 */
+    int       ndata,                /* Number of packed data values */
+    float    *unpacked_data,
+    int      *mdi_clashes
+)
+{
+    return expand_packed_row_window(ncols, 0, ncols, mdi, accuracy, base, transform,
+                                    missing_data, zero, packed, bits_per_value, ndata,
+                                    unpacked_data, mdi_clashes);
+} /* end function wgdos_expand_packed_row_affine */
+
+/* As wgdos_expand_packed_row_to_data, for every stride'th column from column 0 only,
+   put one after another in unpacked_data. The packed value of each column is found
+   from the number of missing and zero bits before it, so the columns in between are
+   not unpacked. */
+int wgdos_expand_packed_row_strided(
+    int       ncols,
+    int       stride,               /* Unpack columns 0, stride, 2*stride... */
+    float     mdi,
+    float     accuracy,
+    float     base,
+    uint64_t *missing_data,         /* Missing data bitmap words, bit set for missing */
+    uint64_t *zero,                 /* Zeros bitmap words, bit set for zero */
+    unsigned char *packed,          /* Packed data values for the row (MSB first) */
+    int       bits_per_value,       /* Bits per packed data value, 0 <= bits_per_value < 32 */
+    int       ndata,                /* Number of packed data values */
+    float    *unpacked_data,        /* The (ncols+stride-1)/stride unpacked values */
+    int      *mdi_clashes
+)
+{
+    packed_values values;
+    int  col;
+    int  out;
+    int  word;                /* Bitmap word holding col */
+    int  counted_words;       /* Bitmap words before word whose special bits are in special_before */
+    int  special_before;      /* Missing or zero columns before word */
+    int  index;               /* Which packed value col has */
+    uint64_t special;
+    uint64_t col_bit;
+    double dacc, dbase;
+
+    *mdi_clashes = 0;
+    dacc=accuracy;
+    dbase=base;
+    packed_values_init(&values, packed, bits_per_value, ndata);
+
+    counted_words=0;
+    special_before=0;
+    for (col=0, out=0; col<ncols; col+=stride, out++) {
+      word=col/64;
+      while (counted_words<word) {
+        special_before+=POPCOUNT64(missing_data[counted_words] | zero[counted_words]);
+        counted_words++;
+      }
+      special=missing_data[word] | zero[word];
+      col_bit=(uint64_t)1<<(63-col%64);
+      if (special & col_bit) {
+        unpacked_data[out] = (missing_data[word] & col_bit) ? mdi : 0.0;
+        continue;
+      }
+      index=col-special_before-POPCOUNT64(special & TOP_BITS64(col%64));
+      unpacked_data[out] = dacc*packed_value_at(&values, index)+dbase;
+      if ( unpacked_data[out] == mdi ) {
+        (*mdi_clashes)++;
+      }
+    }
+    return 0;
+} /* end function wgdos_expand_packed_row_strided */
+
+/* As wgdos_expand_packed_row_to_data, but giving each column's packed integer itself
+   rather than base+accuracy*integer, as uint16_t if value_size is 2 (bits_per_value
+   must then be at most 16) or uint32_t if it is 4. Missing and zero columns are given
+   as 0, the bitmaps telling them apart from data. No floating point is done. */
+int wgdos_expand_packed_row_quantized(
+    int       ncols,
+    uint64_t *missing_data,         /* Missing data bitmap words, bit set for missing */
+    uint64_t *zero,                 /* Zeros bitmap words, bit set for zero */
+    unsigned char *packed,          /* Packed data values for the row (MSB first) */
+    int       bits_per_value,       /* Bits per packed data value, 0 <= bits_per_value < 32 */
+    int       ndata,                /* Number of packed data values */
+    int       value_size,           /* 2 or 4 bytes per integer */
+    void     *quantized_data        /* The ncols integers */
+)
+{
+    uint16_t *out16=(uint16_t*)quantized_data;
+    uint32_t *out32=(uint32_t*)quantized_data;
+    packed_values values;
+    column_runs runs;
+    int  index=0;             /* Number of the next packed value */
+    int  col, run_end, special_kind;
+
+    packed_values_init(&values, packed, bits_per_value, ndata);
+    column_runs_init(&runs, missing_data, zero, 0, ncols);
+    while (column_runs_next(&runs, &col, &run_end, &special_kind)) {
+      for ( ; col<run_end; col++, index++) {
+        if (value_size==2) {
+          out16[col]=(uint16_t)packed_value_at(&values, index);
+        } else {
+          out32[col]=(uint32_t)packed_value_at(&values, index);
+        }
+      }
+      if (special_kind>=0) {
+        if (value_size==2) {
+          out16[col]=0;
+        } else {
+          out32[col]=0;
+        }
+      }
+    }
+    return 0;
+} /* end function wgdos_expand_packed_row_quantized */
+
+/* As wgdos_expand_packed_row_to_data, but giving only the columns that are not missing,
+   as the flat index first_index+col in indices and the value in values, one after
+   another. Data values that equal mdi are left out too, so the points given are those
+   of the unpacked row that are not mdi. Returns how many points were given, at most
+   ncols less the missing columns. */
+int wgdos_expand_packed_row_sparse(
+    int       ncols,
+    int       first_index,          /* Flat index of column 0 */
+    float     mdi,
+    float     accuracy,
+    float     base,
+    uint64_t *missing_data,         /* Missing data bitmap words, bit set for missing */
+    uint64_t *zero,                 /* Zeros bitmap words, bit set for zero */
+    unsigned char *packed,          /* Packed data values for the row (MSB first) */
+    int       bits_per_value,       /* Bits per packed data value, 0 <= bits_per_value < 32 */
+    int       ndata,                /* Number of packed data values */
+    int      *indices,
+    float    *values
+)
+{
+    packed_values data;
+    column_runs runs;
+    int  index=0;             /* Number of the next packed value */
+    int  col, run_end, special_kind;
+    int  npoints=0;
+    float fval;
+    double dacc, dbase;
+
+    dacc=accuracy;
+    dbase=base;
+    packed_values_init(&data, packed, bits_per_value, ndata);
+    column_runs_init(&runs, missing_data, zero, 0, ncols);
+    while (column_runs_next(&runs, &col, &run_end, &special_kind)) {
+      for ( ; col<run_end; col++, index++) {
+        fval=dacc*packed_value_at(&data, index)+dbase;
+        if (fval!=mdi) {
+          indices[npoints]=first_index+col;
+          values[npoints]=fval;
+          npoints++;
+        }
+      }
+      if (special_kind==0 && mdi!=0.0) {
+        indices[npoints]=first_index+col;
+        values[npoints]=0.0;
+        npoints++;
+      }
+    }
+    return npoints;
+} /* end function wgdos_expand_packed_row_sparse */
@@ -0,0 +1,226 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_field_stats.c
+ *
+ * Description:
+ *   Statistics of a WGDOS packed field without unpacking it
+ *
+ * Information:
+ *   Each value of a row is base+accuracy*n, n being the packed integer,
+ *   unless the bitmaps mark it missing or zero. The order of the values
+ *   does not matter to their count, sum, least and greatest, so the
+ *   packed integers of a row are read straight through (by
+ *   extract_nbit_words, a block at a time) with no need to place them:
+ *     sum = ndata*base + accuracy*(sum of n)
+ *     min = base + accuracy*(least n), max likewise
+ *   and the bitmaps are only counted. No floating point field is made.
+ *   The least and greatest values are worked out as wgdos_unpack would
+ *   work out those values, so they are identical to those of the
+ *   unpacked field. Data values that happen to equal mdi are counted as
+ *   values, not as missing.
+ *   Every row_step'th row may be read instead of every row, for a
+ *   quicker estimate; the rows in between are stepped over unread.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "wgdosbits.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+
+/* Packed integers read at a time: a multiple of 32, so each block starts on a word */
+#define STATS_BLOCK 256
+/* End of header */
+
+int wgdos_field_stats(
+    /* IN */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       row_step,              /* Read every row_step'th row from the first, 1 for all */
+    float     mdi,                   /* Missing data indicator value */
+    /* OUT */
+    wgdos_stats* stats,
+    function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_field_stats_ctx(&context, packed_data, unpacked_len, row_step, mdi, stats, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_field_stats, taking the work areas from the context */
+int wgdos_field_stats_ctx(
+    /* IN */
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       row_step,              /* Read every row_step'th row from the first, 1 for all */
+    float     mdi,                   /* Missing data indicator value */
+    /* OUT */
+    wgdos_stats* stats,
+    function* parent)
+{
+    float     accuracy;              /* Absolute accuracy to which data held */
+    int       ncols;                 /* Number of columns in each row */
+    int       nrows;                 /* Number of rows in field */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
+    char*     field_data=packed_data;
+    char*     field_end;             /* End of the field according to the field header */
+    char*     start_off;
+    float     base;                  /* Base value for the row */
+    int       bits_per_value;        /* Number of bits per packed data value */
+    int       missing_data_count;    /* Number of missing data elements */
+    int       zeros_count;           /* Number of bitmapped zeros */
+    int       ndata;                 /* Number of non-bitmapped data items */
+    int       nop;                   /* Number of words in the row according to header */
+    int       block[STATS_BLOCK];
+    int       nblock;
+    int       least, greatest;
+    int64_t   total;
+    double    dacc, dbase;
+    float     value;
+    Boolean   any=FALSE;
+    int       row, i, done;
+    int       status;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+    memset(stats, 0, sizeof(*stats));
+    stats->min=mdi;
+    stats->max=mdi;
+
+    /* Read field header information */
+    status=wgdos_decode_field_parameters(&field_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine);
+    if (status) {
+      return -1;
+    }
+    if (row_step<1) {
+      row_step=1;
+    }
+    dacc=accuracy;
+
+    /* Reserve work areas */
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((ncols+63)/64));
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((ncols+63)/64));
+    if (!(missing_data && zero)) {
+      return -1;
+    }
+
+    field_data=packed_data+sizeof(wgdos_field_header);
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+    for (row=0; row<nrows; row+=row_step) {
+      if (row>0 && wgdos_skip_rows(packed_data, row_step-1, &field_data, &subroutine)) {
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+      start_off=field_data;
+      if (!wgdos_row_fits(field_data, field_end) ||
+          wgdos_start_row(&field_data, ncols, missing_data, zero, &base, &bits_per_value,
+                          &ndata, &nop, &subroutine)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+      missing_data_count=0;
+      for (i=0; i<(ncols+63)/64; i++) {
+        missing_data_count+=POPCOUNT64(missing_data[i]);
+      }
+      zeros_count=ncols-missing_data_count-ndata;
+      dbase=base;
+
+      /* The packed integers, in blocks */
+      least=0;
+      greatest=0;
+      total=0;
+      if (bits_per_value>0) {
+        for (done=0; done<ndata; done+=nblock) {
+          nblock=(ndata-done<STATS_BLOCK ? ndata-done : STATS_BLOCK);
+          extract_nbit_words(field_data+(size_t)done*bits_per_value/8, bits_per_value, nblock, block);
+          if (done==0) {
+            least=block[0];
+            greatest=block[0];
+          }
+          for (i=0; i<nblock; i++) {
+            total+=block[i];
+            least=(block[i]<least ? block[i] : least);
+            greatest=(block[i]>greatest ? block[i] : greatest);
+          }
+        }
+        if (ndata>0) {
+          field_data+=((bits_per_value*ndata+PP_BITS_PER_NUMERIC-1)/PP_BITS_PER_NUMERIC)*PP_BYTES_PER_NUMERIC;
+        }
+      }
+      if (field_data-start_off != nop*4+8) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+
+      stats->rows++;
+      stats->nmissing+=missing_data_count;
+      stats->nzeros+=zeros_count;
+      stats->ndata+=ndata;
+      stats->sum+=ndata*dbase+dacc*total;
+      if (ndata>0) {
+        value=dacc*least+dbase;
+        if (!any || value<stats->min) {
+          stats->min=value;
+        }
+        value=dacc*greatest+dbase;
+        if (!any || value>stats->max) {
+          stats->max=value;
+        }
+        any=TRUE;
+      }
+      if (zeros_count>0) {
+        if (!any || stats->min>0.0) {
+          stats->min=0.0;
+        }
+        if (!any || stats->max<0.0) {
+          stats->max=0.0;
+        }
+        any=TRUE;
+      }
+    }
+    stats->count=stats->ndata+stats->nzeros;
+    return 0;
+}
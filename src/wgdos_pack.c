@@ -58,9 +58,13 @@
 #include <limits.h>
 /* Package header files used */
 #include "wgdosstuff.h"
+#include "wgdosrow.h"
 #include "logerrors.h"
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
 
-static char message[MAX_MESSAGE_SIZE];
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
 /* End of header */
 
 
@@ -127,6 +131,142 @@ int fill_bitmap(int ncols, float* row_data, float bitmap_value, int true, unsign
   return count;
 }
 
+/* Everything wgdos_pack needs to know about a row before packing it */
+typedef struct row_analysis {
+  int zeros;                   /* Number of values equal to zero */
+  int mdis;                    /* Number of values equal to mdi */
+  float nonzero_min;           /* Range of the values other than zero, mdi included, as count_zeros */
+  float nonzero_max;
+  float data_min;              /* Range of the values that are neither zero nor mdi */
+  float data_max;
+  float first_zero;            /* The first zero in the row, keeping its sign */
+} row_analysis;
+
+/* Bit reversal of a nibble, to put the first column of a movemask in the top bit of the byte */
+static const unsigned char reverse_nibble[16]={0,8,4,12,2,10,6,14,1,9,5,13,3,11,7,15};
+
+/* Add up the columns from first_col on, one at a time */
+static int analyse_row_tail(int ncols, int first_col, float* row_data, float mdi,
+                            unsigned char* zero_bitmap, unsigned char* mdi_bitmap, row_analysis* stats)
+{
+  int i,j;
+  unsigned char zero_byte, mdi_byte;
+  float value;
+
+  for (i=first_col;i<ncols;i+=8) {
+    zero_byte=0;
+    mdi_byte=0;
+    for (j=0;j<8 && i+j<ncols;j++) {
+      value=row_data[i+j];
+      if (value!=value) return 1;
+      zero_byte=zero_byte<<1;
+      mdi_byte=mdi_byte<<1;
+      if (value==0.0) {
+        if (stats->zeros==0) stats->first_zero=value;
+        zero_byte+=1;
+        stats->zeros++;
+        continue;
+      }
+      if (value<stats->nonzero_min) stats->nonzero_min=value;
+      if (value>stats->nonzero_max) stats->nonzero_max=value;
+      if (value==mdi) {
+        mdi_byte+=1;
+        stats->mdis++;
+      } else {
+        if (value<stats->data_min) stats->data_min=value;
+        if (value>stats->data_max) stats->data_max=value;
+      }
+    }
+    /* Pad the last byte out as fill_bitmap does, the zero bitmap being inverted */
+    zero_bitmap[i/8]=~(unsigned char)(zero_byte<<(8-j));
+    mdi_bitmap[i/8]=mdi_byte<<(8-j);
+  }
+  return 0;
+}
+
+#ifdef __SSE2__
+/* Eight columns at a time, the comparison masks giving the bitmap bytes directly */
+static int analyse_row_sse2(int ncols, float* row_data, float mdi,
+                            unsigned char* zero_bitmap, unsigned char* mdi_bitmap, row_analysis* stats)
+{
+  __m128 zero=_mm_setzero_ps();
+  __m128 vmdi=_mm_set1_ps(mdi);
+  __m128 plus_inf=_mm_set1_ps(HUGE_VALF);
+  __m128 minus_inf=_mm_set1_ps(-HUGE_VALF);
+  __m128 nonzero_min=plus_inf, nonzero_max=minus_inf;
+  __m128 data_min=plus_inf, data_max=minus_inf;
+  __m128 nan=zero;
+  float lanes[4];
+  int zero_bits, mdi_bits;
+  int i,k;
+
+  for (i=0;i+8<=ncols;i+=8) {
+    __m128 lo=_mm_loadu_ps(&row_data[i]);
+    __m128 hi=_mm_loadu_ps(&row_data[i+4]);
+    __m128 zero_lo=_mm_cmpeq_ps(lo, zero);
+    __m128 zero_hi=_mm_cmpeq_ps(hi, zero);
+    __m128 skip_lo=_mm_or_ps(zero_lo, _mm_cmpeq_ps(lo, vmdi));
+    __m128 skip_hi=_mm_or_ps(zero_hi, _mm_cmpeq_ps(hi, vmdi));
+
+    nan=_mm_or_ps(nan, _mm_or_ps(_mm_cmpunord_ps(lo, lo), _mm_cmpunord_ps(hi, hi)));
+    zero_bits=_mm_movemask_ps(zero_lo) | (_mm_movemask_ps(zero_hi)<<4);
+    mdi_bits=(_mm_movemask_ps(skip_lo) | (_mm_movemask_ps(skip_hi)<<4)) & ~zero_bits;
+    zero_bitmap[i/8]=~(unsigned char)((reverse_nibble[zero_bits&15]<<4) | reverse_nibble[zero_bits>>4]);
+    mdi_bitmap[i/8]=(reverse_nibble[mdi_bits&15]<<4) | reverse_nibble[mdi_bits>>4];
+    if (zero_bits) {
+      if (stats->zeros==0) stats->first_zero=row_data[i+__builtin_ctz(zero_bits)];
+      stats->zeros+=__builtin_popcount(zero_bits);
+    }
+    stats->mdis+=__builtin_popcount(mdi_bits);
+
+    /* Excluded columns are swapped for infinities that cannot move the range */
+    nonzero_min=_mm_min_ps(nonzero_min, _mm_or_ps(_mm_and_ps(zero_lo, plus_inf), _mm_andnot_ps(zero_lo, lo)));
+    nonzero_min=_mm_min_ps(nonzero_min, _mm_or_ps(_mm_and_ps(zero_hi, plus_inf), _mm_andnot_ps(zero_hi, hi)));
+    nonzero_max=_mm_max_ps(nonzero_max, _mm_or_ps(_mm_and_ps(zero_lo, minus_inf), _mm_andnot_ps(zero_lo, lo)));
+    nonzero_max=_mm_max_ps(nonzero_max, _mm_or_ps(_mm_and_ps(zero_hi, minus_inf), _mm_andnot_ps(zero_hi, hi)));
+    data_min=_mm_min_ps(data_min, _mm_or_ps(_mm_and_ps(skip_lo, plus_inf), _mm_andnot_ps(skip_lo, lo)));
+    data_min=_mm_min_ps(data_min, _mm_or_ps(_mm_and_ps(skip_hi, plus_inf), _mm_andnot_ps(skip_hi, hi)));
+    data_max=_mm_max_ps(data_max, _mm_or_ps(_mm_and_ps(skip_lo, minus_inf), _mm_andnot_ps(skip_lo, lo)));
+    data_max=_mm_max_ps(data_max, _mm_or_ps(_mm_and_ps(skip_hi, minus_inf), _mm_andnot_ps(skip_hi, hi)));
+  }
+  if (_mm_movemask_ps(nan)) return 1;
+
+  /* Fold the lanes into the scalar ranges */
+  _mm_storeu_ps(lanes, nonzero_min);
+  for (k=0;k<4;k++) if (lanes[k]<stats->nonzero_min) stats->nonzero_min=lanes[k];
+  _mm_storeu_ps(lanes, nonzero_max);
+  for (k=0;k<4;k++) if (lanes[k]>stats->nonzero_max) stats->nonzero_max=lanes[k];
+  _mm_storeu_ps(lanes, data_min);
+  for (k=0;k<4;k++) if (lanes[k]<stats->data_min) stats->data_min=lanes[k];
+  _mm_storeu_ps(lanes, data_max);
+  for (k=0;k<4;k++) if (lanes[k]>stats->data_max) stats->data_max=lanes[k];
+
+  return analyse_row_tail(ncols, i, row_data, mdi, zero_bitmap, mdi_bitmap, stats);
+}
+#endif
+
+/* One pass over the row giving the counts, ranges and both bitmaps, the zero bitmap inverted.
+   Returns nonzero if the row must go through count_zeros and fill_bitmap instead, which is
+   when it holds a NaN or mdi is zero, as the order of the comparisons matters there */
+static int analyse_row(int ncols, float* row_data, float mdi,
+                       unsigned char* zero_bitmap, unsigned char* mdi_bitmap, row_analysis* stats)
+{
+  stats->zeros=0;
+  stats->mdis=0;
+  stats->nonzero_min=HUGE_VALF;
+  stats->nonzero_max=-HUGE_VALF;
+  stats->data_min=HUGE_VALF;
+  stats->data_max=-HUGE_VALF;
+  stats->first_zero=0.0;
+  if (mdi==0.0) return 1;
+
+#ifdef __SSE2__
+  return analyse_row_sse2(ncols, row_data, mdi, zero_bitmap, mdi_bitmap, stats);
+#else
+  return analyse_row_tail(ncols, 0, row_data, mdi, zero_bitmap, mdi_bitmap, stats);
+#endif
+}
+
 /* Pack a 2-D field of floating point numbers stored linearly, storing the data as
    a bytestream (MSB first). If packing fails, return a nonzero code */
 int wgdos_pack(
@@ -138,6 +278,27 @@ int wgdos_pack(
     unsigned char* packed_data,      /* Packed data */
     int*      packed_length,         /* Packed data length */
     function* parent)
+{
+  wgdos_context context;
+  int status;
+
+  wgdos_context_init(&context);
+  status=wgdos_pack_ctx(&context, ncols, nrows, unpacked_data, mdi, bpacc, packed_data, packed_length, parent);
+  wgdos_context_free(&context);
+  return status;
+}
+
+/* As wgdos_pack, taking the work areas from the context */
+int wgdos_pack_ctx(
+    wgdos_context* context,          /* Work areas kept between calls */
+    int       ncols,                 /* Number of columns in each row */
+    int       nrows,                 /* Number of rows in field */
+    float*    unpacked_data,         /* Data to pack */
+    float     mdi,                   /* Missing data indicator value */
+    int       bpacc,                 /* WGDOS packing accuracy */
+    unsigned char* packed_data,      /* Packed data */
+    int*      packed_length,         /* Packed data length */
+    function* parent)
 {
   float accuracy;              /* Absolute accuracy to which data held */
   float minval, maxval;
@@ -145,6 +306,7 @@ int wgdos_pack(
   int* mdi_array;              /* Integer array representation of mdi_bitmap 1=TRUE*/
   unsigned char* zero_bitmap;  /* Zeros bitmap for current row as bitstream*/
   int* zero_array;             /* Integer array representation of zero_bitmap 1=TRUE*/
+  row_analysis stats;          /* Counts and ranges from the single pass over the row */
   int row;                     /* Number of rows transmitted so far */
   int mdis_count;              /* Number of missing data elements */
   int zeros_count;             /* Number of bitmapped zeros */
@@ -158,13 +320,15 @@ int wgdos_pack(
 
   /* wgdos field/row constituents*/
   wgdos_field_header* wgdos_field_header_pointer; /* Where the field header will be filled in */
-  float* row_data;             /* Spare location to write the row as its being constructed */
+  float* row_data;             /* The row being packed */
   int wgdos_row_header[2];     /* Spare location to write the row header as its being constructed */
   int wgdos_field_header[3];   /* Spare location to write the field header as its being constructed */
 
   unsigned char* packed_row;   /* Pointer to the packed row being calculated */
   int offset;                  /* Number of bytes into output field to write the next set of bytes */
   unsigned int digits;         /* Integer equivalent to the row data after compression */
+  float value;                 /* The value being packed */
+  unsigned char bit;           /* Bit for the current column in the bitmap bytes */
   int size_of_packed_field;
   int size_of_packed_row;
   int first_value;
@@ -186,12 +350,15 @@ int wgdos_pack(
   accuracy=powf(2.0, (float)bpacc);
 
   /* Reserve work areas */
-  row_data = (float *) malloc(sizeof(float)  * ncols);
-  zero_bitmap = (unsigned char*) malloc(bitmap_size);
-  mdi_bitmap = (unsigned char*) malloc(bitmap_size);
-  packed_row = (unsigned char*) malloc(sizeof(int) * ncols);
-  mdi_array = (int*) malloc(sizeof(int) * ncols);
-  zero_array = (int*) malloc(sizeof(int) * ncols);
+  zero_bitmap = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO_BITMAP, bitmap_size);
+  mdi_bitmap = wgdos_context_scratch(context, WGDOS_SCRATCH_MDI_BITMAP, bitmap_size);
+  packed_row = wgdos_context_scratch(context, WGDOS_SCRATCH_PACKED_ROW, sizeof(int) * ncols);
+  mdi_array = wgdos_context_scratch(context, WGDOS_SCRATCH_MDI_ARRAY, sizeof(int) * ncols);
+  zero_array = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO_ARRAY, sizeof(int) * ncols);
+  if (!(zero_bitmap && mdi_bitmap && packed_row && mdi_array && zero_array)) {
+    MO_syslog(VERBOSITY_ERROR, "Out of memory for work areas", &subroutine);
+    return 1;
+  }
 
   /* The offset (size of field so far) already skips the field header */
   offset=sizeof(wgdos_field_header);
@@ -199,43 +366,64 @@ int wgdos_pack(
   /* For each row */
   for (row=0;row<nrows;row++) {
 
-    /* Clean up counts, bitmaps etc */
-    zeros_count=0;
-    mdis_count=0;
+    /* Clean up counts etc */
     size_of_packed_row=0;
-    memset(mdi_bitmap, 0, bitmap_size);
-    memset(zero_bitmap, 0, bitmap_size);
     memset(packed_row, 0, ncols * sizeof(int));
+    row_data=&unpacked_data[ncols*row];
 
     snprintf(message, MAX_MESSAGE_SIZE, "Row %d size of packed field at start %d", row, size_of_packed_field);
     MO_syslog(VERBOSITY_MESSAGE, message, &subroutine);
-    first_value=1;
 
-    /* create the zeros bitmap */
-    zeros_count=count_zeros(ncols, &unpacked_data[row*ncols], &subroutine);
-    if (zeros_count>0) {
-      zeros_count=fill_bitmap(ncols, &unpacked_data[ncols*row], 0.0, 0, zero_bitmap, zero_array, &subroutine);
-    }
-    /* create the MDI bitmap */
-    mdis_count=fill_bitmap(ncols, &unpacked_data[ncols*row], mdi, 1, mdi_bitmap, mdi_array, &subroutine);
-
-    /* collect the remaining data values*/
-    ndata=0;
-    for (i=0;i<ncols;i++) {
-      if (mdi==unpacked_data[i+ncols*row]) {
-        /* Skip mdis, we're going to bitmap them out */
-      } else if (zeros_count && (0.0==unpacked_data[i+ncols*row])) {
-        /* Skip zeros if we're going to bitmap them out */
-      } else {
-        row_data[ndata]=unpacked_data[i+ncols*row];
-        if (first_value) {
-          minval=row_data[ndata];
-          maxval=row_data[ndata];
-          first_value=0;
+    if (!analyse_row(ncols, row_data, mdi, zero_bitmap, mdi_bitmap, &stats)) {
+      mdis_count=stats.mdis;
+      /* The same choice about zero bitmaps as count_zeros, whose range starts from the first column */
+      zeros_count=stats.zeros;
+      if (zeros_count>0 && row_data[0]!=0 && stats.nonzero_min>0.0) {
+        if ((stats.nonzero_max-stats.nonzero_min)>(stats.nonzero_max/sqrt(2))) zeros_count=0;
+      }
+      ndata=ncols-mdis_count-zeros_count;
+      if (ncols-mdis_count-stats.zeros>0) {
+        minval=stats.data_min;
+        maxval=stats.data_max;
+        /* Zeros kept as data; where one bounds the range, its sign is that of the first in the row */
+        if (zeros_count==0 && stats.zeros>0) {
+          if (minval>0.0) minval=stats.first_zero;
+          if (maxval<0.0) maxval=stats.first_zero;
+        }
+      } else if (ndata>0) {
+        minval=stats.first_zero;
+        maxval=stats.first_zero;
+      }
+    } else {
+      memset(mdi_bitmap, 0, bitmap_size);
+      memset(zero_bitmap, 0, bitmap_size);
+      first_value=1;
+
+      /* create the zeros bitmap */
+      zeros_count=count_zeros(ncols, row_data, &subroutine);
+      if (zeros_count>0) {
+        zeros_count=fill_bitmap(ncols, row_data, 0.0, 0, zero_bitmap, zero_array, &subroutine);
+      }
+      /* create the MDI bitmap */
+      mdis_count=fill_bitmap(ncols, row_data, mdi, 1, mdi_bitmap, mdi_array, &subroutine);
+
+      /* find the range of the remaining data values */
+      ndata=0;
+      for (i=0;i<ncols;i++) {
+        if (mdi==row_data[i]) {
+          /* Skip mdis, we're going to bitmap them out */
+        } else if (zeros_count && (0.0==row_data[i])) {
+          /* Skip zeros if we're going to bitmap them out */
+        } else {
+          if (first_value) {
+            minval=row_data[i];
+            maxval=row_data[i];
+            first_value=0;
+          }
+          if (row_data[i]<minval) minval=row_data[i];
+          if (row_data[i]>maxval) maxval=row_data[i];
+          ndata++;
         }
-        if (row_data[ndata]<minval) minval=row_data[ndata];
-        if (row_data[ndata]>maxval) maxval=row_data[ndata];
-        ndata++;
       }
     }
     if ((mdis_count+zeros_count)==ncols) minval=maxval;
@@ -267,19 +455,21 @@ int wgdos_pack(
     /* Pack the data as a bitstream of integers as per WGDOS packing scheme */
     message[0]=0;
     for (i=0,ndata=0;i<ncols;i++) {
-      if(mdi_array[i]) {
+      bit=0x80>>(i%8);
+      if(mdi_bitmap[i/8] & bit) {
         if (log_message) {
           snprintf(message+strlen(message), MAX_MESSAGE_SIZE-strlen(message), "%012g / %-12s ", mdi, "MDI");
         }
-      } else if (zeros_count && zero_array[i]){
+      } else if (zeros_count && !(zero_bitmap[i/8] & bit)){
         if (log_message) {
           snprintf(message+strlen(message), MAX_MESSAGE_SIZE-strlen(message), "%012g / %-12s ", 0.0, "Zero");
         }
       } else {
         /* Calculate the packed integer equivalent of the row data*/
-        digits=(row_data[ndata]-minval)/accuracy;
+        value=row_data[i];
+        digits=(value-minval)/accuracy;
         if (log_message) {
-          snprintf(message+strlen(message), MAX_MESSAGE_SIZE-strlen(message), "%012g / %-12d ", row_data[ndata], digits);
+          snprintf(message+strlen(message), MAX_MESSAGE_SIZE-strlen(message), "%012g / %-12d ", value, digits);
         }
         /* Stuff these bits into the row data spare space */
         bitstuff(packed_row, ndata*bpp, digits, bpp, &subroutine);
@@ -349,10 +539,6 @@ int wgdos_pack(
   snprintf(message, MAX_MESSAGE_SIZE, "Packed field size %d", size_of_packed_field);
   MO_syslog(VERBOSITY_INFO, message, &subroutine);
 
-  /* Free the work areas */
-  free(row_data);  
-  free(zero_bitmap);  
-  free(mdi_bitmap);
   return 0;
 }
 
@@ -361,9 +547,10 @@ static int test1_in[]={20,4,0,3,30,11,12,12};
 static char test1_out[]={161,0,63,45,150};
 static int test2_in[]={921,91,2491,1001,3275};
 static char test2_out[]={57,144,91,155,179,233,204,176};
-static unsigned char test_buffer[72];
 int test_bitstuff() {
+  unsigned char test_buffer[72];
   int i,bitnumber, worked;
+  memset(test_buffer, 0, 72);
   for (i=0,bitnumber=0;i<8;i++,bitnumber+=5) {
     bitstuff(test_buffer, bitnumber, test1_in[i], 5, NULL);
   }
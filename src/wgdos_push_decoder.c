@@ -0,0 +1,224 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_push_decoder.c
+ *
+ * Description:
+ *   Unpack a WGDOS packed field as its bytes arrive
+ *
+ * Information:
+ *   The packed field is fed to wgdos_push_decoder_feed in chunks of any
+ *   size, split anywhere. Each row is unpacked into the output as soon as
+ *   its last byte arrives, so unpacking keeps up with the transfer
+ *   rather than waiting for the end of it.
+ *   The field header and the rows are the units. A unit found whole in a
+ *   chunk is unpacked where it lies. One split across chunks is gathered
+ *   into the carry buffer first, 8 bytes of row header to learn the
+ *   length of the row, then the rest of the row. Only a unit that is
+ *   split is copied, and the carry buffer never holds more than one row.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+#define ROW_HEADER_BYTES 8
+
+/* Number of bytes of a row, from its row header */
+static size_t row_bytes(const char* row_header) {
+  return ROW_HEADER_BYTES+4*(size_t)wgdos_row_words(row_header);
+}
+
+/* Unpack the unit starting at data, which is whole. Returns 0 if it worked.
+   A row is only unpacked if it fits in its length bytes, and wgdos_unpack_row
+   checks its bitmaps and values against its header before reading them, so
+   nothing is read past the end of the unit, which may be the carry buffer */
+static int decode_unit(wgdos_push_decoder* decoder, char* data, size_t length, function* parent) {
+  char*     field_data=data;
+  char*     row=data;
+  uint64_t* missing_data;
+  uint64_t* zero;
+  int       row_mdi_clashes;
+
+  if (decoder->nrows<0) {
+    if (wgdos_decode_field_parameters(&field_data, decoder->unpacked_len, &decoder->accuracy,
+                                      &decoder->ncols, &decoder->nrows, parent)) {
+      return 1;
+    }
+    decoder->total_bytes=4*(size_t)ntohl(((wgdos_field_header*)data)->total_length);
+    decoder->consumed=sizeof(wgdos_field_header);
+    return 0;
+  }
+
+  decoder->consumed+=length;
+  missing_data  = wgdos_context_scratch(&decoder->context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((decoder->ncols+63)/64));
+  zero          = wgdos_context_scratch(&decoder->context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((decoder->ncols+63)/64));
+  if (!(missing_data && zero) || decoder->consumed>decoder->total_bytes ||
+      !wgdos_row_fits(row, data+length) ||
+      wgdos_unpack_row(&row, decoder->ncols, decoder->accuracy, decoder->mdi, missing_data, zero,
+                       decoder->unpacked_data+(size_t)decoder->row*decoder->ncols, &row_mdi_clashes, parent) ||
+      row!=data+length) {
+    snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", decoder->row);
+    MO_syslog(VERBOSITY_ERROR, message, parent);
+    return 1;
+  }
+  decoder->row++;
+  return 0;
+}
+
+/* Make the carry buffer hold at least size bytes, keeping what it has. Returns 0 if it worked */
+static int grow_carry(wgdos_push_decoder* decoder, size_t size) {
+  char* carry;
+  if (size<=decoder->carry_size) {
+    return 0;
+  }
+  carry=realloc(decoder->carry, size);
+  if (carry==NULL) {
+    return 1;
+  }
+  decoder->carry=carry;
+  decoder->carry_size=size;
+  return 0;
+}
+
+/* Start unpacking a field of unpacked_len values into unpacked_data. Returns 0 if it worked */
+int wgdos_push_decoder_open(
+    wgdos_push_decoder* decoder,
+    int       unpacked_len,          /* Number of values in the whole field */
+    float*    unpacked_data,         /* Native floating point array to unpack into */
+    float     mdi,                   /* Missing data indicator value */
+    function* parent)
+{
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+    memset(decoder, 0, sizeof(*decoder));
+    wgdos_context_init(&decoder->context);
+    decoder->unpacked_len=unpacked_len;
+    decoder->unpacked_data=unpacked_data;
+    decoder->mdi=mdi;
+    decoder->nrows=-1;               /* Field header not yet read */
+    if (grow_carry(decoder, sizeof(wgdos_field_header))) {
+      MO_syslog(VERBOSITY_ERROR, "Failed to allocate memory", &subroutine);
+      return -1;
+    }
+    return 0;
+}
+
+/* Unpack every row completed by the next length bytes of the packed field.
+   Returns 1 once the last row has been unpacked (anything fed after it is
+   ignored), 0 if more is needed, or -1 if the field is broken or memory ran
+   out, after which the decoder fails every call */
+int wgdos_push_decoder_feed(
+    wgdos_push_decoder* decoder,
+    const char* chunk,
+    size_t    length,
+    function* parent)
+{
+    size_t    unit;
+    size_t    take;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+    if (decoder->failed) {
+      return -1;
+    }
+
+    while (decoder->row<decoder->nrows || decoder->nrows<0) {
+      if (decoder->carry_length==0) {
+        /* Nothing left over, so unpack whatever is whole where it lies */
+        if (decoder->nrows<0) {
+          unit=sizeof(wgdos_field_header);
+        } else if (length>=ROW_HEADER_BYTES) {
+          unit=row_bytes(chunk);
+        } else {
+          unit=0;                    /* Not even the row header */
+        }
+        if (unit>0 && length>=unit) {
+          if (decode_unit(decoder, (char*)chunk, unit, &subroutine)) {
+            break;
+          }
+          chunk+=unit;
+          length-=unit;
+          continue;
+        }
+      }
+
+      /* Gather the unit, reading the row header first to learn its length */
+      if (decoder->nrows<0) {
+        unit=sizeof(wgdos_field_header);
+      } else if (decoder->carry_length<ROW_HEADER_BYTES) {
+        unit=ROW_HEADER_BYTES;
+      } else {
+        unit=row_bytes(decoder->carry);
+      }
+      if (grow_carry(decoder, unit)) {
+        MO_syslog(VERBOSITY_ERROR, "Failed to allocate memory", &subroutine);
+        break;
+      }
+      take=unit-decoder->carry_length;
+      take=(take<length ? take : length);
+      memcpy(decoder->carry+decoder->carry_length, chunk, take);
+      decoder->carry_length+=take;
+      chunk+=take;
+      length-=take;
+      if (decoder->carry_length<unit) {
+        return 0;                    /* The chunk is used up */
+      }
+      if (decoder->nrows>=0 && unit==ROW_HEADER_BYTES && row_bytes(decoder->carry)>unit) {
+        continue;                    /* Only the row header so far */
+      }
+      if (decode_unit(decoder, decoder->carry, unit, &subroutine)) {
+        break;
+      }
+      decoder->carry_length=0;
+    }
+
+    if (decoder->nrows>=0 && decoder->row>=decoder->nrows) {
+      return 1;
+    }
+    decoder->failed=1;
+    set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+    return -1;
+}
+
+/* Free the decoder's work areas */
+void wgdos_push_decoder_close(wgdos_push_decoder* decoder) {
+  free(decoder->carry);
+  wgdos_context_free(&decoder->context);
+  memset(decoder, 0, sizeof(*decoder));
+}
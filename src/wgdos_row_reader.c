@@ -0,0 +1,155 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_row_reader.c
+ *
+ * Description:
+ *   Unpack a WGDOS packed field one row at a time
+ *
+ * Information:
+ *   wgdos_row_reader_open reads the field header, then each call of
+ *   wgdos_row_reader_next unpacks the next row into the caller's ncols
+ *   values. Only the row bitmaps are kept in between, so the memory used
+ *   does not depend on the number of rows, and the rows can be passed on
+ *   as they are unpacked. Rows may also be stepped over unread.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+/* Start reading a field. Returns 0 if it worked, when reader->ncols and reader->nrows give its size */
+int wgdos_row_reader_open(
+    wgdos_row_reader* reader,
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    float     mdi,                   /* Missing data indicator value */
+    function* parent)
+{
+    char*     field_data=packed_data;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+    memset(reader, 0, sizeof(*reader));
+    wgdos_context_init(&reader->context);
+
+    if (wgdos_decode_field_parameters(&field_data, unpacked_len, &reader->accuracy,
+                                      &reader->ncols, &reader->nrows, &subroutine)) {
+      return -1;
+    }
+    reader->packed_data=packed_data;
+    reader->next_row=packed_data+sizeof(wgdos_field_header);
+    reader->total_bytes=4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+    reader->mdi=mdi;
+    return 0;
+}
+
+/* Unpack the next row into the ncols values of row_data. Returns 1 if it
+   did, 0 if there are no more rows, or -1 if the row is broken (reader->row
+   is then the broken row, and the reader stays failed) */
+int wgdos_row_reader_next(
+    wgdos_row_reader* reader,
+    float*    row_data,
+    function* parent)
+{
+    uint64_t* missing_data;          /* Missing data bitmap for the row */
+    uint64_t* zero;                  /* Zeros bitmap for the row */
+    int       row_mdi_clashes;
+    char*     field_end=reader->packed_data+reader->total_bytes;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+    if (reader->row>=reader->nrows) {
+      return 0;
+    }
+    if (!reader->next_row) {
+      return -1;                     /* An earlier row was broken */
+    }
+
+    missing_data  = wgdos_context_scratch(&reader->context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((reader->ncols+63)/64));
+    zero          = wgdos_context_scratch(&reader->context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((reader->ncols+63)/64));
+    if (!(missing_data && zero)) {
+      return -1;
+    }
+
+    /* The row header, and the row it describes, must be within the field before decoding */
+    if (!wgdos_row_fits(reader->next_row, field_end) ||
+        wgdos_unpack_row(&reader->next_row, reader->ncols, reader->accuracy, reader->mdi,
+                         missing_data, zero, row_data, &row_mdi_clashes, &subroutine)) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", reader->row);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      reader->next_row=NULL;
+      return -1;
+    }
+    reader->row++;
+    return 1;
+}
+
+/* Step over the next nskip rows without unpacking them (fewer if the field
+   ends first). Returns 0 if it worked */
+int wgdos_row_reader_skip(
+    wgdos_row_reader* reader,
+    int       nskip,
+    function* parent)
+{
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+    if (nskip>reader->nrows-reader->row) {
+      nskip=reader->nrows-reader->row;
+    }
+    if (nskip<=0) {
+      return 0;
+    }
+    if (!reader->next_row) {
+      return -1;
+    }
+    if (wgdos_skip_rows(reader->packed_data, nskip, &reader->next_row, &subroutine)) {
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      reader->next_row=NULL;
+      return -1;
+    }
+    reader->row+=nskip;
+    return 0;
+}
+
+/* Free the reader's work areas */
+void wgdos_row_reader_close(wgdos_row_reader* reader) {
+  wgdos_context_free(&reader->context);
+  memset(reader, 0, sizeof(*reader));
+}
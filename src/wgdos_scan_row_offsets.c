@@ -0,0 +1,121 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_scan_row_offsets.c
+ *
+ * Description:
+ *   Walk the row headers of a WGDOS packed field to find where each row starts
+ *
+ * Information:
+ *   Each row header carries the number of 32-bit words taken by the row after
+ *   its two-word header, so the rows can be located without decoding any of
+ *   them. The resulting table lets rows be decoded independently, and in any
+ *   order.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <limits.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+int wgdos_scan_row_offsets(
+    /* IN */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       nrows,                 /* Number of rows in field */
+    /* OUT */
+    int*      row_offsets,           /* nrows+1 byte offsets from packed_data: the start
+                                        of each row header then the end of the last row */
+    const function* const parent)
+{
+    wgdos_field_header* field_header_pointer;
+    long      total_bytes;           /* Length of the field according to the field header */
+    long      offset;
+    int       row;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    field_header_pointer=(wgdos_field_header*)packed_data;
+    total_bytes=4*(long)ntohl(field_header_pointer->total_length);
+    if (total_bytes > INT_MAX) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Field length %ld is too long for int row offsets", total_bytes);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      return -1;
+    }
+
+    offset=sizeof(wgdos_field_header);
+    for (row=0; row<nrows; row++) {
+      if (!wgdos_row_fits(packed_data+offset, packed_data+total_bytes)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Row %d at byte %ld runs beyond the field length %ld", row, offset, total_bytes);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        return -1;
+      }
+      row_offsets[row]=(int)offset;
+      offset+=4*(long)wgdos_row_words(packed_data+offset)+8;
+    }
+    row_offsets[nrows]=(int)offset;
+    return 0;
+}
+
+/* Move *row on over nskip rows by the lengths in their headers, without decoding
+   them, checking they are all within the field. *row starts at a row header */
+int wgdos_skip_rows(
+    /* IN */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       nskip,                 /* Number of rows to step over */
+    /* IN/OUT */
+    char**    row,                   /* Row header to start from, moved on to the next row */
+    const function* const parent)
+{
+    long      total_bytes;           /* Length of the field according to the field header */
+    long      offset;
+    int       skipped;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    total_bytes=4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+    offset=*row-packed_data;
+    for (skipped=0; skipped<nskip; skipped++) {
+      if (!wgdos_row_fits(packed_data+offset, packed_data+total_bytes)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Row at byte %ld runs beyond the field length %ld", offset, total_bytes);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        return -1;
+      }
+      offset+=4*(long)wgdos_row_words(packed_data+offset)+8;
+    }
+    *row=packed_data+offset;
+    return 0;
+}
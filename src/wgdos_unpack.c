@@ -92,10 +92,11 @@
 #include <string.h>
 /* Package header files used */
 #include "wgdosstuff.h"
+#include "wgdosrow.h"
 #include "logerrors.h"
 
 #define MAX_MESSAGE_SIZE 1024
-static char message[MAX_MESSAGE_SIZE];
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
 /* End of header */
 
 int wgdos_unpack(
@@ -106,32 +107,39 @@ int wgdos_unpack(
     float*    unpacked_data,
     float     mdi,                   /* Missing data indicator value */
     function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_unpack_ctx(&context, packed_data, unpacked_len, unpacked_data, mdi, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_unpack, taking the work areas from the context */
+int wgdos_unpack_ctx(
+    /* IN */
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data */
+    int       unpacked_len,          /* Expected length that data should expand */
+                                     /* to when unpacked, >=0 */
+    float*    unpacked_data,
+    float     mdi,                   /* Missing data indicator value */
+    function* parent)
 {
     float     accuracy;              /* Absolute accuracy to which data held */
     int       ncols;                 /* Number of columns in each row */
     int       nrows;                 /* Number of rows in field */
 
-    char*     buffer;                /* Buffer for packed data */
-    Boolean*  missing_data;          /* Missing data bitmap for current row */
-    Boolean*  zero;                  /* Zeros bitmap for current row */
-    int*      data;                  /* Non-bitmapped data for current row */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
     int       row;                   /* Number of rows transmitted so far */
-    float     base;                  /* Base value for current row */
-    Boolean   missing_data_present;  /* Is missing data bitmap present? */
-    Boolean   zeros_bitmap_present;  /* Is zeros bitmap present? */
-    int       bits_per_value;        /* Number of bits per packed data value */
-    int       missing_data_count;    /* Number of missing data elements */
-    int       zeros_count;           /* Number of bitmapped zeros */
-    int       ndata;                 /* Number of non-bitmapped data items */
     int       row_mdi_clashes;       /* Number of MDI values in row */
+    char*     field_end;             /* End of the field according to the field header */
     int       mdi_clashes;           /* Number of MDI values in field */
-    float*    unpacked_row;
-    int       nop;                   /* number of values to extract according to header */
-    char*     start_off;
     int status = 0;
     mdi_clashes = 0;
-    int offset;
-    int next_packed_row;
     function subroutine;
     
     set_function_name(__func__, &subroutine, parent);
@@ -142,88 +150,57 @@ int wgdos_unpack(
     #endif
     /* Read field header information */
     status=wgdos_decode_field_parameters(&packed_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine);
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
     packed_data=packed_data+12;
 
+    if (status) {
+      return -1;
+    }
+
     /* Reserve work areas */
-    buffer        = (void *) malloc(PP_BYTES_PER_NUMERIC * ncols); 
-    missing_data  = (Boolean *) malloc(sizeof(Boolean) * ncols);
-    zero          = (Boolean *) malloc(sizeof(Boolean) * ncols);
-    data          = (int *) malloc(sizeof(int) * ncols);
-    unpacked_row  = (float *) malloc(sizeof(float) * ncols); 
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((ncols+63)/64));
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((ncols+63)/64));
     
     /* did it work? */
-    if (status || !(buffer && missing_data && zero && data && unpacked_row)) {
+    if (!(missing_data && zero)) {
       status=-1;
       return status;
     }
 
     /* Unpack each row */
     row = 0;
-    next_packed_row=0;
     while ( row < nrows)  {
       #ifdef DEBUG
       snprintf(message, MAX_MESSAGE_SIZE, "On row %d", row);
       MO_syslog(VERBOSITY_MESSAGE, message, &subroutine);
       #endif
-      start_off=packed_data;
- 
-      /* Read row header information */
-      status=wgdos_decode_row_parameters(&packed_data, &base, &missing_data_present, 
-                           &zeros_bitmap_present, &bits_per_value, &nop, &subroutine );
-      next_packed_row=nop*4+8; /* bytes = nop*4 (32 bit words) + 8 bytes for the row header*/
-      if (status) {
-        #ifdef DEBUG
-        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode row %d parameters. Base %f. bpv %d", row, base, bits_per_value);
+
+      /* Make sure the row header and the row it describes are within the field */
+      if (!wgdos_row_fits(packed_data, field_end)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "WGDOS row %d runs beyond the field length", row);
         MO_syslog(VERBOSITY_ERROR, message, &subroutine);
-        #endif
         set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
         status=-1;
         break;
       }
 
-      /* Read in and expand the bitmaps in the packed data field */
-      status=read_wgdos_bitmaps(&packed_data, ncols, missing_data_present,
-                              zeros_bitmap_present, buffer,
-                              missing_data, zero, &missing_data_count,
-                              &zeros_count);
-      
-      ndata = ncols - missing_data_count - zeros_count;
-
-      /* Read in the packed data into the data buffer */
-      status=extract_wgdos_row(&packed_data, ndata, bits_per_value,
-                           buffer, data);
-      /* Unpack the data in the data buffer */
-      status=wgdos_expand_row_to_data(ncols, mdi,  accuracy, base,
-                            missing_data, zero, data,
-                            unpacked_row, &row_mdi_clashes, &subroutine);
-      #ifdef DEBUG
-      snprintf (message, MAX_MESSAGE_SIZE, "Row %d: Base %g, %d bits per value, accuracy %g", row, base, bits_per_value, accuracy);
-      MO_syslog(VERBOSITY_MESSAGE, message, &subroutine);
-      #endif
-      mdi_clashes += row_mdi_clashes;
-      offset=row*ncols;
-      /* Copy row across from unpacked_row to the right offset in the unpacked_data*/
-      memcpy(&unpacked_data[row*ncols], unpacked_row, sizeof(float)*ncols);
-
-      /* Check that the number of data values read is correct wrt the WGDOS header */
-      if (packed_data-start_off != next_packed_row) {
+      /* Decode the row header, bitmaps and data straight into its place in the field,
+         checking the row length against the header */
+      status=wgdos_unpack_row(&packed_data, ncols, accuracy, mdi,
+                              missing_data, zero,
+                              &unpacked_data[row*ncols], &row_mdi_clashes, &subroutine);
+      if (status) {
         #ifdef DEBUG
-        snprintf (message, MAX_MESSAGE_SIZE, "WGDOS row (%d) length (%d) doesn't agree with disk length (%d) for %d values", \
-                 row, next_packed_row, packed_data-start_off, ndata);
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
         MO_syslog(VERBOSITY_ERROR, message, &subroutine);
         #endif
         set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
         status=-1;
         break;
       }
+      mdi_clashes += row_mdi_clashes;
       row++;
     }
 
-    /* Free the work areas */
-    free(buffer);
-    free(missing_data);
-    free(zero);
-    free(data);
-    free(unpacked_row);  
     return status;
 }
@@ -0,0 +1,128 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_unpack_half.c
+ *
+ * Description:
+ *   Unpack a WGDOS packed field to 16 bit floating point
+ *
+ * Information:
+ *   Each row is unpacked into a row of floats, which stays in cache, and
+ *   converted from there by convert_float_ieee32_to_half, so the field is
+ *   only written once, at half the size, and no full field of floats is
+ *   made. Missing values are given as the caller's 16 bit value.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+int wgdos_unpack_half(
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       format,                /* HALF_FLOAT16 or HALF_BFLOAT16 */
+    uint16_t* unpacked_data,         /* unpacked_len 16 bit values */
+    float     mdi,                   /* Missing data indicator value */
+    uint16_t  mdi_half,              /* What missing values are given as */
+    function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_unpack_half_ctx(&context, packed_data, unpacked_len, format, unpacked_data,
+                                 mdi, mdi_half, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_unpack_half, taking the work areas from the context */
+int wgdos_unpack_half_ctx(
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       format,                /* HALF_FLOAT16 or HALF_BFLOAT16 */
+    uint16_t* unpacked_data,         /* unpacked_len 16 bit values */
+    float     mdi,                   /* Missing data indicator value */
+    uint16_t  mdi_half,              /* What missing values are given as */
+    function* parent)
+{
+    float     accuracy;              /* Absolute accuracy to which data held */
+    int       ncols;                 /* Number of columns in each row */
+    int       nrows;                 /* Number of rows in field */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
+    float*    row_data;              /* Current row, unpacked */
+    char*     field_data=packed_data;
+    char*     field_end;             /* End of the field according to the field header */
+    int       row_mdi_clashes;
+    int       row;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (format!=HALF_FLOAT16 && format!=HALF_BFLOAT16) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Unknown 16 bit format %d", format);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      return -1;
+    }
+    if (wgdos_decode_field_parameters(&field_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine)) {
+      return -1;
+    }
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+
+    /* Reserve work areas */
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((ncols+63)/64));
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((ncols+63)/64));
+    row_data      = wgdos_context_scratch(context, WGDOS_SCRATCH_ROW, sizeof(float) * ncols);
+    if (!(missing_data && zero && row_data)) {
+      return -1;
+    }
+
+    field_data=packed_data+sizeof(wgdos_field_header);
+    for (row=0; row<nrows; row++) {
+      if (!wgdos_row_fits(field_data, field_end) ||
+          wgdos_unpack_row(&field_data, ncols, accuracy, mdi, missing_data, zero, row_data,
+                           &row_mdi_clashes, &subroutine)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+      convert_float_ieee32_to_half(row_data, unpacked_data+(size_t)row*ncols, ncols, format, mdi, mdi_half);
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_unpack_quantized.c
+ *
+ * Description:
+ *   Unpack a WGDOS packed field to its packed integers, without floating point
+ *
+ * Information:
+ *   Each value of a WGDOS field is base+accuracy*n, n being an integer of
+ *   bits_per_value bits, unless the row bitmaps mark it missing or zero.
+ *   This gives the field's accuracy, each row's base, every point's n (0
+ *   at missing and zero points) and, if wanted, the bitmaps, for
+ *   programs that store the field as scaled integers themselves. The
+ *   integers may be given as uint16_t when every row has at most 16 bits
+ *   per value, which is the usual case. The value of a point is then
+ *     missing if its bit is set in missing_data, else
+ *     0.0 if its bit is set in zero, else
+ *     base[row]+accuracy*n, as wgdos_unpack works it out (in double precision)
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+int wgdos_unpack_quantized(
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       value_size,            /* 2 for uint16_t integers or 4 for uint32_t */
+    wgdos_quantized* quantized,      /* Where to put the field */
+    function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_unpack_quantized_ctx(&context, packed_data, unpacked_len, value_size, quantized, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_unpack_quantized, taking the work areas from the context */
+int wgdos_unpack_quantized_ctx(
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       value_size,            /* 2 for uint16_t integers or 4 for uint32_t */
+    wgdos_quantized* quantized,      /* Where to put the field */
+    function* parent)
+{
+    int       nwords;                /* Bitmap words in each row */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
+    char*     field_data=packed_data;
+    char*     field_end;             /* End of the field according to the field header */
+    int       bits_per_value;
+    int       row;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (value_size!=2 && value_size!=4) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Integers of %d bytes asked for, rather than 2 or 4", value_size);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      return -1;
+    }
+    if (wgdos_decode_field_parameters(&field_data, unpacked_len, &quantized->accuracy,
+                                      &quantized->ncols, &quantized->nrows, &subroutine)) {
+      return -1;
+    }
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+    field_data=packed_data+sizeof(wgdos_field_header);
+    nwords=(quantized->ncols+63)/64;
+
+    /* The rows' bitmaps go straight to the caller's, if they are wanted */
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * nwords);
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * nwords);
+    if (!(missing_data && zero)) {
+      return -1;
+    }
+
+    for (row=0; row<quantized->nrows; row++) {
+      if (quantized->missing_data) {
+        missing_data=quantized->missing_data+(size_t)row*nwords;
+      }
+      if (quantized->zero) {
+        zero=quantized->zero+(size_t)row*nwords;
+      }
+      if (!wgdos_row_fits(field_data, field_end) ||
+          wgdos_unpack_row_quantized(&field_data, quantized->ncols, value_size, missing_data, zero,
+                                     (char*)quantized->values+(size_t)row*quantized->ncols*value_size,
+                                     &quantized->base[row], &bits_per_value, &subroutine)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+      if (quantized->bits_per_value) {
+        quantized->bits_per_value[row]=bits_per_value;
+      }
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_unpack_reduced.c
+ *
+ * Description:
+ *   Unpack a WGDOS packed field at a reduced resolution
+ *
+ * Information:
+ *   The field is reduced by a factor k in both directions, giving
+ *   (nrows+k-1)/k rows of (ncols+k-1)/k values, as it is unpacked:
+ *   WGDOS_REDUCE_STRIDE keeps every k'th row and column from the first.
+ *     The rows in between are stepped over by their lengths without
+ *     decoding them, and in each row kept only the columns kept are
+ *     unpacked.
+ *   WGDOS_REDUCE_MEAN gives the mean of each k by k block, leaving out
+ *     missing data. A block with nothing but missing data is missing.
+ *     Each row is unpacked into a one row work area and added into the
+ *     block sums, so the field is never held at full resolution.
+ *   The blocks at the end of the rows and columns may be smaller than k.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+int wgdos_unpack_reduced(
+    /* IN */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       factor,                /* Reduce by this much in each direction, >=1 */
+    int       method,                /* WGDOS_REDUCE_STRIDE or WGDOS_REDUCE_MEAN */
+    /* OUT */
+    float*    unpacked_data,         /* ((nrows+factor-1)/factor)*((ncols+factor-1)/factor) values */
+    float     mdi,                   /* Missing data indicator value */
+    function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_unpack_reduced_ctx(&context, packed_data, unpacked_len, factor, method,
+                                    unpacked_data, mdi, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_unpack_reduced, taking the work areas from the context */
+int wgdos_unpack_reduced_ctx(
+    /* IN */
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       factor,                /* Reduce by this much in each direction, >=1 */
+    int       method,                /* WGDOS_REDUCE_STRIDE or WGDOS_REDUCE_MEAN */
+    /* OUT */
+    float*    unpacked_data,         /* ((nrows+factor-1)/factor)*((ncols+factor-1)/factor) values */
+    float     mdi,                   /* Missing data indicator value */
+    function* parent)
+{
+    float     accuracy;              /* Absolute accuracy to which data held */
+    int       ncols;                 /* Number of columns in each row */
+    int       nrows;                 /* Number of rows in field */
+    int       out_cols;              /* Number of columns once reduced */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
+    float*    row_data;              /* One unpacked row, for the block means */
+    double*   sums;                  /* Sum of the values in each block of the current block row */
+    int*      counts;                /* and how many there were */
+    char*     field_data=packed_data;
+    char*     field_end;             /* End of the field according to the field header */
+    int       row_mdi_clashes;
+    int       row, col, out_row;
+    int       status;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    /* Read field header information */
+    status=wgdos_decode_field_parameters(&field_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine);
+    if (status) {
+      return -1;
+    }
+    if (factor<1 || (method!=WGDOS_REDUCE_STRIDE && method!=WGDOS_REDUCE_MEAN)) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Cannot reduce by %d with method %d", factor, method);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      return -1;
+    }
+    out_cols=(ncols+factor-1)/factor;
+
+    /* Reserve work areas */
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((ncols+63)/64));
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((ncols+63)/64));
+    if (!(missing_data && zero)) {
+      return -1;
+    }
+
+    field_data=packed_data+sizeof(wgdos_field_header);
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+    if (method==WGDOS_REDUCE_STRIDE) {
+      for (row=0, out_row=0; row<nrows; row+=factor, out_row++) {
+        if ((row>0 && wgdos_skip_rows(packed_data, factor-1, &field_data, &subroutine)) ||
+            !wgdos_row_fits(field_data, field_end) ||
+            wgdos_unpack_row_strided(&field_data, ncols, factor, accuracy, mdi,
+                                     missing_data, zero, &unpacked_data[out_row*out_cols],
+                                     &row_mdi_clashes, &subroutine)) {
+          snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+          MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+          set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+          return -1;
+        }
+      }
+      return 0;
+    }
+
+    row_data = wgdos_context_scratch(context, WGDOS_SCRATCH_ROW, sizeof(float) * ncols);
+    sums     = wgdos_context_scratch(context, WGDOS_SCRATCH_SUMS, sizeof(double) * out_cols);
+    counts   = wgdos_context_scratch(context, WGDOS_SCRATCH_COUNTS, sizeof(int) * out_cols);
+    if (!(row_data && sums && counts)) {
+      return -1;
+    }
+    for (row=0, out_row=0; row<nrows; out_row++) {
+      memset(sums, 0, sizeof(double) * out_cols);
+      memset(counts, 0, sizeof(int) * out_cols);
+      for ( ; row<nrows && row<(out_row+1)*factor; row++) {
+        if (!wgdos_row_fits(field_data, field_end) ||
+            wgdos_unpack_row(&field_data, ncols, accuracy, mdi, missing_data, zero,
+                             row_data, &row_mdi_clashes, &subroutine)) {
+          snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+          MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+          set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+          return -1;
+        }
+        for (col=0; col<ncols; col++) {
+          if (row_data[col]!=mdi) {
+            sums[col/factor]+=row_data[col];
+            counts[col/factor]++;
+          }
+        }
+      }
+      for (col=0; col<out_cols; col++) {
+        unpacked_data[out_row*out_cols+col]=(counts[col]>0 ? sums[col]/counts[col] : mdi);
+      }
+    }
+    return 0;
+}
@@ -0,0 +1,340 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_unpack_row.c
+ *
+ * Description:
+ *   Unpack one row of a WGDOS packed field, row header included
+ *
+ * Information:
+ *   Split out of wgdos_unpack so that the same row decode can be driven
+ *   either sequentially or from a table of row offsets. Uses no static
+ *   state outside of DEBUG builds, so separate rows may be decoded at the
+ *   same time on different threads provided each has its own workspace.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <string.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "wgdosbits.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+int wgdos_unpack_row(
+    /* IN */
+    char**    packed_data,           /* Start of the row header, moved on to the next row */
+    int       ncols,                 /* Number of columns in the row */
+    float     accuracy,              /* Absolute accuracy to which data held */
+    float     mdi,                   /* Missing data indicator value */
+    /* IN - Workspace supplied by caller */
+    uint64_t* missing_data,          /* At least (ncols+63)/64 bitmap words */
+    uint64_t* zero,                  /* At least (ncols+63)/64 bitmap words */
+    /* OUT */
+    float*    unpacked_row,          /* The ncols unpacked values */
+    int*      mdi_clashes,           /* Number of data values equal to mdi */
+    const function* const parent)
+{
+    return wgdos_unpack_row_window(packed_data, ncols, 0, ncols, accuracy, mdi,
+                                   missing_data, zero, unpacked_row, mdi_clashes, parent);
+}
+
+/* Whether the row whose header is at row lies within the field: the row header and the
+   nop words it gives the row must all come before field_end. Every driver checks this
+   before it decodes a row, and wgdos_start_row then checks the row's bitmaps and packed
+   values against nop, so no part of a damaged row is read from beyond the field */
+int wgdos_row_fits(const char* row, const char* field_end)
+{
+    if (field_end-row < 8) {
+      return FALSE;
+    }
+    return field_end-row-8 >= 4*(long)wgdos_row_words(row);
+}
+
+/* Decode a row header and bitmaps, leaving *packed_data at the row's packed values.
+   The bitmaps and then the packed values are checked to fit in the nop words the
+   header gives the row before either is read, so that a damaged row header cannot
+   make the row read past its end */
+int wgdos_start_row(
+    char**    packed_data,
+    int       ncols,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    float*    base,
+    int*      bits_per_value,
+    int*      ndata,
+    int*      nop,
+    const function* const parent)
+{
+    Boolean   missing_data_present;  /* Is missing data bitmap present? */
+    Boolean   zeros_bitmap_present;  /* Is zeros bitmap present? */
+    int       missing_data_count;    /* Number of missing data elements */
+    int       zeros_count;           /* Number of bitmapped zeros */
+    long      bitmap_bytes;          /* Bytes taken by the bitmaps */
+    long      data_bytes;            /* Bytes taken by the packed values */
+    int       word;
+
+    /* Read row header information */
+    if (wgdos_decode_row_parameters(packed_data, base, &missing_data_present,
+                         &zeros_bitmap_present, bits_per_value, nop, parent)) {
+      return -1;
+    }
+
+    bitmap_bytes=PP_BYTES_PER_NUMERIC*(((long)ncols*(missing_data_present+zeros_bitmap_present)+
+                                        PP_BITS_PER_NUMERIC-1)/PP_BITS_PER_NUMERIC);
+    if (bitmap_bytes > (long)*nop*PP_BYTES_PER_NUMERIC) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Row bitmaps of %ld bytes do not fit in its %d words",
+               bitmap_bytes, *nop);
+      MO_syslog(VERBOSITY_ERROR, message, parent);
+      return -1;
+    }
+
+    /* Read in the bitmaps in the packed data field */
+    read_wgdos_bitmap_words(packed_data, ncols, missing_data_present,
+                            zeros_bitmap_present,
+                            missing_data, zero, &missing_data_count,
+                            &zeros_count);
+
+    /* The kernels read a value for each column that is neither missing nor zero, so
+       count those rather than trusting the two bitmaps not to overlap */
+    *ndata = ncols;
+    for (word=0; word<(ncols+63)/64; word++) {
+      *ndata -= POPCOUNT64(missing_data[word] | zero[word]);
+    }
+    data_bytes=(*bits_per_value>0 && *ndata>0 ?
+                ((long)*bits_per_value**ndata+PP_BITS_PER_NUMERIC-1)/PP_BITS_PER_NUMERIC*PP_BYTES_PER_NUMERIC : 0);
+    if (bitmap_bytes+data_bytes > (long)*nop*PP_BYTES_PER_NUMERIC) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Row of %d %d bit values does not fit in its %d words",
+               *ndata, *bits_per_value, *nop);
+      MO_syslog(VERBOSITY_ERROR, message, parent);
+      return -1;
+    }
+    return 0;
+}
+
+/* Move *packed_data past the row's packed values, and check that the number of data
+   values read is correct wrt the WGDOS header: bytes = nop*4 (32 bit words) + 8 bytes
+   for the row header */
+static int end_row(char** packed_data, char* start_off, int bits_per_value, int ndata, int nop) {
+    if (bits_per_value>0 && ndata>0) {
+      *packed_data += ((bits_per_value*ndata+PP_BITS_PER_NUMERIC-1)/PP_BITS_PER_NUMERIC)*PP_BYTES_PER_NUMERIC;
+    }
+    if (*packed_data-start_off != nop*4+8) {
+      return -1;
+    }
+    return 0;
+}
+
+/* As wgdos_unpack_row, unpacking only columns first_col to first_col+window_cols-1 */
+int wgdos_unpack_row_window(
+    /* IN */
+    char**    packed_data,           /* Start of the row header, moved on to the next row */
+    int       ncols,                 /* Number of columns in the row */
+    int       first_col,             /* First column wanted */
+    int       window_cols,           /* Number of columns wanted */
+    float     accuracy,              /* Absolute accuracy to which data held */
+    float     mdi,                   /* Missing data indicator value */
+    /* IN - Workspace supplied by caller */
+    uint64_t* missing_data,          /* At least (ncols+63)/64 bitmap words */
+    uint64_t* zero,                  /* At least (ncols+63)/64 bitmap words */
+    /* OUT */
+    float*    unpacked_row,          /* The window_cols unpacked values */
+    int*      mdi_clashes,           /* Number of data values equal to mdi */
+    const function* const parent)
+{
+    float     base;                  /* Base value for the row */
+    int       bits_per_value;        /* Number of bits per packed data value */
+    int       ndata;                 /* Number of non-bitmapped data items */
+    int       nop;                   /* Number of words in the row according to header */
+    char*     start_off=*packed_data;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (wgdos_start_row(packed_data, ncols, missing_data, zero, &base, &bits_per_value, &ndata, &nop, &subroutine)) {
+      return -1;
+    }
+
+    /* Unpack the data values straight from the packed field */
+    wgdos_expand_packed_row_window(ncols, first_col, window_cols, mdi, accuracy, base,
+                                   missing_data, zero,
+                                   (unsigned char*)*packed_data, bits_per_value, ndata,
+                                   unpacked_row, mdi_clashes);
+    return end_row(packed_data, start_off, bits_per_value, ndata, nop);
+}
+
+/* As wgdos_unpack_row, unpacking only columns 0, stride, 2*stride... */
+int wgdos_unpack_row_strided(
+    /* IN */
+    char**    packed_data,           /* Start of the row header, moved on to the next row */
+    int       ncols,                 /* Number of columns in the row */
+    int       stride,                /* Step between the columns wanted */
+    float     accuracy,              /* Absolute accuracy to which data held */
+    float     mdi,                   /* Missing data indicator value */
+    /* IN - Workspace supplied by caller */
+    uint64_t* missing_data,          /* At least (ncols+63)/64 bitmap words */
+    uint64_t* zero,                  /* At least (ncols+63)/64 bitmap words */
+    /* OUT */
+    float*    unpacked_row,          /* The (ncols+stride-1)/stride unpacked values */
+    int*      mdi_clashes,           /* Number of data values equal to mdi */
+    const function* const parent)
+{
+    float     base;                  /* Base value for the row */
+    int       bits_per_value;        /* Number of bits per packed data value */
+    int       ndata;                 /* Number of non-bitmapped data items */
+    int       nop;                   /* Number of words in the row according to header */
+    char*     start_off=*packed_data;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (wgdos_start_row(packed_data, ncols, missing_data, zero, &base, &bits_per_value, &ndata, &nop, &subroutine)) {
+      return -1;
+    }
+    wgdos_expand_packed_row_strided(ncols, stride, mdi, accuracy, base,
+                                    missing_data, zero,
+                                    (unsigned char*)*packed_data, bits_per_value, ndata,
+                                    unpacked_row, mdi_clashes);
+    return end_row(packed_data, start_off, bits_per_value, ndata, nop);
+}
+
+int wgdos_unpack_row_quantized(
+    /* IN */
+    char**    packed_data,           /* Start of the row header, moved on to the next row */
+    int       ncols,                 /* Number of columns in the row */
+    int       value_size,            /* 2 for uint16_t integers or 4 for uint32_t */
+    /* OUT */
+    uint64_t* missing_data,          /* At least (ncols+63)/64 bitmap words */
+    uint64_t* zero,                  /* At least (ncols+63)/64 bitmap words */
+    void*     quantized_row,         /* The ncols packed integers */
+    float*    base,                  /* Base value for the row */
+    int*      bits_per_value,        /* Number of bits per packed data value */
+    const function* const parent)
+{
+    int       ndata;                 /* Number of non-bitmapped data items */
+    int       nop;                   /* Number of words in the row according to header */
+    char*     start_off=*packed_data;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (wgdos_start_row(packed_data, ncols, missing_data, zero, base, bits_per_value, &ndata, &nop, &subroutine)) {
+      return -1;
+    }
+    if (*bits_per_value>8*value_size) {
+      snprintf(message, MAX_MESSAGE_SIZE, "%d bit values do not fit in %d bytes", *bits_per_value, value_size);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      return -1;
+    }
+    wgdos_expand_packed_row_quantized(ncols, missing_data, zero, (unsigned char*)*packed_data,
+                                      *bits_per_value, ndata, value_size, quantized_row);
+    return end_row(packed_data, start_off, *bits_per_value, ndata, nop);
+}
+
+int wgdos_unpack_row_sparse(
+    /* IN */
+    char**    packed_data,           /* Start of the row header, moved on to the next row */
+    int       ncols,                 /* Number of columns in the row */
+    int       first_index,           /* Flat index of the row's first column */
+    int       max_points,            /* Room left in indices and values */
+    float     accuracy,              /* Absolute accuracy to which data held */
+    float     mdi,                   /* Missing data indicator value */
+    /* IN - Workspace supplied by caller */
+    uint64_t* missing_data,          /* At least (ncols+63)/64 bitmap words */
+    uint64_t* zero,                  /* At least (ncols+63)/64 bitmap words */
+    /* OUT */
+    int*      indices,               /* Flat indices of the points that are not missing */
+    float*    values,                /* and their values */
+    int*      npoints,               /* How many there are */
+    const function* const parent)
+{
+    float     base;                  /* Base value for the row */
+    int       bits_per_value;        /* Number of bits per packed data value */
+    int       ndata;                 /* Number of non-bitmapped data items */
+    int       nop;                   /* Number of words in the row according to header */
+    int       nmissing=0;
+    int       word;
+    char*     start_off=*packed_data;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (wgdos_start_row(packed_data, ncols, missing_data, zero, &base, &bits_per_value, &ndata, &nop, &subroutine)) {
+      return -1;
+    }
+    for (word=0; word<(ncols+63)/64; word++) {
+      nmissing+=POPCOUNT64(missing_data[word]);
+    }
+    if (ncols-nmissing>max_points) {
+      snprintf(message, MAX_MESSAGE_SIZE, "No room for the %d points of the row", ncols-nmissing);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      return -1;
+    }
+    *npoints=wgdos_expand_packed_row_sparse(ncols, first_index, mdi, accuracy, base, missing_data, zero,
+                                            (unsigned char*)*packed_data, bits_per_value, ndata,
+                                            indices, values);
+    return end_row(packed_data, start_off, bits_per_value, ndata, nop);
+}
+
+int wgdos_unpack_row_affine(
+    /* IN */
+    char**    packed_data,           /* Start of the row header, moved on to the next row */
+    int       ncols,                 /* Number of columns in the row */
+    float     accuracy,              /* Absolute accuracy to which data held */
+    float     mdi,                   /* Missing data indicator value */
+    const unpack_transform* transform, /* Applied to each value as it is unpacked */
+    /* IN - Workspace supplied by caller */
+    uint64_t* missing_data,          /* At least (ncols+63)/64 bitmap words */
+    uint64_t* zero,                  /* At least (ncols+63)/64 bitmap words */
+    /* OUT */
+    float*    unpacked_row,          /* The ncols unpacked values */
+    int*      mdi_clashes,           /* Number of data values equal to mdi */
+    const function* const parent)
+{
+    float     base;                  /* Base value for the row */
+    int       bits_per_value;        /* Number of bits per packed data value */
+    int       ndata;                 /* Number of non-bitmapped data items */
+    int       nop;                   /* Number of words in the row according to header */
+    char*     start_off=*packed_data;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (wgdos_start_row(packed_data, ncols, missing_data, zero, &base, &bits_per_value, &ndata, &nop, &subroutine)) {
+      return -1;
+    }
+    wgdos_expand_packed_row_affine(ncols, mdi, accuracy, base, transform, missing_data, zero,
+                                   (unsigned char*)*packed_data, bits_per_value, ndata,
+                                   unpacked_row, mdi_clashes);
+    return end_row(packed_data, start_off, bits_per_value, ndata, nop);
+}
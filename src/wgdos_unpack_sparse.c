@@ -0,0 +1,138 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_unpack_sparse.c
+ *
+ * Description:
+ *   Unpack only the points of a WGDOS packed field that are not missing
+ *
+ * Information:
+ *   Gives each point that is not missing as its flat index (row*ncols+col)
+ *   and its value, in order, for fields such as ocean or land only fields
+ *   that are mostly missing. The missing data bitmap of each row says
+ *   which points to leave out, so missing points are never written.
+ *   Optionally also gives where each row's points start, as for a
+ *   compressed sparse row matrix: the points of row r are row_start[r] to
+ *   row_start[r+1]-1.
+ *   The points given are those of the field wgdos_unpack gives that are
+ *   not mdi, so data values that happen to equal mdi are left out too.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+int wgdos_unpack_sparse(
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       max_points,            /* Room in indices and values */
+    int*      indices,               /* Flat indices of the points that are not missing */
+    float*    values,                /* and their values */
+    int*      row_start,             /* nrows+1 offsets of each row's points, or NULL */
+    int*      npoints,               /* Number of points given */
+    float     mdi,                   /* Missing data indicator value */
+    function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_unpack_sparse_ctx(&context, packed_data, unpacked_len, max_points, indices, values,
+                                   row_start, npoints, mdi, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_unpack_sparse, taking the work areas from the context */
+int wgdos_unpack_sparse_ctx(
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       max_points,            /* Room in indices and values */
+    int*      indices,               /* Flat indices of the points that are not missing */
+    float*    values,                /* and their values */
+    int*      row_start,             /* nrows+1 offsets of each row's points, or NULL */
+    int*      npoints,               /* Number of points given */
+    float     mdi,                   /* Missing data indicator value */
+    function* parent)
+{
+    float     accuracy;              /* Absolute accuracy to which data held */
+    int       ncols;                 /* Number of columns in each row */
+    int       nrows;                 /* Number of rows in field */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
+    char*     field_data=packed_data;
+    char*     field_end;             /* End of the field according to the field header */
+    int       row_points;
+    int       row;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    *npoints=0;
+    if (wgdos_decode_field_parameters(&field_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine)) {
+      return -1;
+    }
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+
+    /* Reserve work areas */
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((ncols+63)/64));
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((ncols+63)/64));
+    if (!(missing_data && zero)) {
+      return -1;
+    }
+
+    field_data=packed_data+sizeof(wgdos_field_header);
+    for (row=0; row<nrows; row++) {
+      if (row_start) {
+        row_start[row]=*npoints;
+      }
+      if (!wgdos_row_fits(field_data, field_end) ||
+          wgdos_unpack_row_sparse(&field_data, ncols, row*ncols, max_points-*npoints, accuracy, mdi,
+                                  missing_data, zero, indices+*npoints, values+*npoints,
+                                  &row_points, &subroutine)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+      *npoints+=row_points;
+    }
+    if (row_start) {
+      row_start[nrows]=*npoints;
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_unpack_threaded.c
+ *
+ * Description:
+ *   Unpack a WGDOS packed field as normal unpacked data, using several threads
+ *
+ * Information:
+ *   The row headers are walked first to build a table of row offsets, then
+ *   the rows are shared out between the threads, each of which decodes its
+ *   rows straight into the caller's array using its own work areas.
+ *   Row n goes to thread n%nthreads, which keeps the load even when the
+ *   packed row lengths vary across the field (e.g. land masked rows).
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+/* The rows for one thread to unpack, and how it got on */
+typedef struct wgdos_row_job {
+  char*     packed_data;             /* Packed data, starting at the field header */
+  int*      row_offsets;             /* Byte offsets of each row from packed_data */
+  int       nrows;                   /* Number of rows in field */
+  int       ncols;                   /* Number of columns in each row */
+  float     accuracy;                /* Absolute accuracy to which data held */
+  float     mdi;                     /* Missing data indicator value */
+  float*    unpacked_data;           /* Whole unpacked field */
+  int       first_row;               /* First row for this thread */
+  int       row_step;                /* Then every row_step'th row after it */
+  int       status;                  /* Nonzero if a row failed to unpack */
+  int       failed_row;              /* Which row failed */
+  int       mdi_clashes;             /* Number of MDI values in the rows unpacked */
+  const function* parent;
+} wgdos_row_job;
+
+static void* unpack_row_job(void* arg) {
+  wgdos_row_job* job=(wgdos_row_job*)arg;
+  uint64_t* missing_data;
+  uint64_t* zero;
+  char*     packed_row;
+  int       row_mdi_clashes;
+  int       row;
+
+  missing_data  = (uint64_t *) malloc(sizeof(uint64_t) * ((job->ncols+63)/64));
+  zero          = (uint64_t *) malloc(sizeof(uint64_t) * ((job->ncols+63)/64));
+
+  if (!(missing_data && zero)) {
+    job->status=-1;
+    job->failed_row=job->first_row;
+  } else {
+    for (row=job->first_row; row<job->nrows; row+=job->row_step) {
+      packed_row=job->packed_data+job->row_offsets[row];
+      if (wgdos_unpack_row(&packed_row, job->ncols, job->accuracy, job->mdi,
+                           missing_data, zero,
+                           &job->unpacked_data[row*job->ncols], &row_mdi_clashes, job->parent)) {
+        job->status=-1;
+        job->failed_row=row;
+        break;
+      }
+      job->mdi_clashes+=row_mdi_clashes;
+    }
+  }
+
+  free(missing_data);
+  free(zero);
+  return NULL;
+}
+
+int wgdos_unpack_threaded(
+    /* IN */
+    char*     packed_data,           /* Packed data */
+    int       unpacked_len,          /* Expected length that data should expand */
+                                     /* to when unpacked, >=0 */
+    float*    unpacked_data,
+    float     mdi,                   /* Missing data indicator value */
+    int       nthreads,              /* Number of threads to use, <=0 for one per processor */
+    function* parent)
+{
+    float     accuracy;              /* Absolute accuracy to which data held */
+    int       ncols;                 /* Number of columns in each row */
+    int       nrows;                 /* Number of rows in field */
+    int*      row_offsets;           /* Byte offset of each row from packed_data */
+    pthread_t* threads;
+    Boolean*  started;               /* Did the thread for each job start? */
+    wgdos_row_job* jobs;
+    char*     field_data=packed_data;
+    int       status=0;
+    int       t;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    /* Read field header information */
+    status=wgdos_decode_field_parameters(&field_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine);
+    if (status) {
+      return -1;
+    }
+
+    if (nthreads<=0) {
+      nthreads=sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads>nrows) {
+      nthreads=nrows;
+    }
+    if (nthreads<=1) {
+      return wgdos_unpack(packed_data, unpacked_len, unpacked_data, mdi, parent);
+    }
+
+    /* Find every row before sharing them out */
+    row_offsets = (int *) malloc(sizeof(int) * (nrows+1));
+    if (!row_offsets) {
+      return -1;
+    }
+    if (wgdos_scan_row_offsets(packed_data, nrows, row_offsets, &subroutine)) {
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      free(row_offsets);
+      return -1;
+    }
+
+    threads = (pthread_t *) malloc(sizeof(pthread_t) * nthreads);
+    started = (Boolean *) malloc(sizeof(Boolean) * nthreads);
+    jobs    = (wgdos_row_job *) malloc(sizeof(wgdos_row_job) * nthreads);
+    if (!(threads && started && jobs)) {
+      free(threads);
+      free(started);
+      free(jobs);
+      free(row_offsets);
+      return -1;
+    }
+
+    for (t=0; t<nthreads; t++) {
+      jobs[t].packed_data=packed_data;
+      jobs[t].row_offsets=row_offsets;
+      jobs[t].nrows=nrows;
+      jobs[t].ncols=ncols;
+      jobs[t].accuracy=accuracy;
+      jobs[t].mdi=mdi;
+      jobs[t].unpacked_data=unpacked_data;
+      jobs[t].first_row=t;
+      jobs[t].row_step=nthreads;
+      jobs[t].status=0;
+      jobs[t].failed_row=-1;
+      jobs[t].mdi_clashes=0;
+      jobs[t].parent=&subroutine;
+    }
+
+    /* The calling thread takes the first share of the rows itself. If a thread
+       can't be started, its rows are unpacked here too */
+    for (t=1; t<nthreads; t++) {
+      started[t]=(pthread_create(&threads[t], NULL, unpack_row_job, &jobs[t])==0);
+    }
+    unpack_row_job(&jobs[0]);
+    for (t=1; t<nthreads; t++) {
+      if (started[t]) {
+        pthread_join(threads[t], NULL);
+      } else {
+        unpack_row_job(&jobs[t]);
+      }
+    }
+
+    for (t=0; t<nthreads; t++) {
+      if (jobs[t].status) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", jobs[t].failed_row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        status=-1;
+      }
+    }
+
+    free(threads);
+    free(started);
+    free(jobs);
+    free(row_offsets);
+    return status;
+}
@@ -0,0 +1,188 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_unpack_transformed.c
+ *
+ * Description:
+ *   Unpack a field, changing each value as it is unpacked
+ *
+ * Information:
+ *   Gives value*scale+offset for each value, e.g. to change units, and
+ *   a value of the caller's choosing, e.g. NaN, for missing values, in
+ *   the same pass over memory as the unpacking:
+ *   - WGDOS packed fields are changed as each row is expanded (see
+ *     wgdos_expand_packed_row_affine);
+ *   - RLE packed fields are changed as their runs are expanded;
+ *   - unpacked fields are changed a block at a time as they are put
+ *     into native byte order, while the block is in cache.
+ *   Data values equal to mdi are given as mdi_out whatever the packing,
+ *   and each value is changed in single precision as value*scale+offset.
+ *   With unpack_transform_init's scale of 1, offset of 0 and mdi_out of
+ *   mdi the result is that of wgdos_unpack or unpack_ppfield.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "rlencode.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+#define TRANSFORM_BLOCK_WORDS 1024
+
+/* No change: a scale of 1, offset of 0 and missing values left as mdi */
+void unpack_transform_init(unpack_transform* transform, float mdi) {
+  transform->scale=1.0;
+  transform->offset=0.0;
+  transform->mdi_out=mdi;
+}
+
+int wgdos_unpack_transformed(
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    float*    unpacked_data,         /* unpacked_len values */
+    float     mdi,                   /* Missing data indicator value */
+    const unpack_transform* transform, /* Applied to each value as it is unpacked */
+    function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_unpack_transformed_ctx(&context, packed_data, unpacked_len, unpacked_data, mdi,
+                                        transform, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_unpack_transformed, taking the work areas from the context */
+int wgdos_unpack_transformed_ctx(
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    float*    unpacked_data,         /* unpacked_len values */
+    float     mdi,                   /* Missing data indicator value */
+    const unpack_transform* transform, /* Applied to each value as it is unpacked */
+    function* parent)
+{
+    float     accuracy;              /* Absolute accuracy to which data held */
+    int       ncols;                 /* Number of columns in each row */
+    int       nrows;                 /* Number of rows in field */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
+    char*     field_data=packed_data;
+    char*     field_end;             /* End of the field according to the field header */
+    int       row_mdi_clashes;
+    int       row;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    if (wgdos_decode_field_parameters(&field_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine)) {
+      return -1;
+    }
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+
+    /* Reserve work areas */
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((ncols+63)/64));
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((ncols+63)/64));
+    if (!(missing_data && zero)) {
+      return -1;
+    }
+
+    field_data=packed_data+sizeof(wgdos_field_header);
+    for (row=0; row<nrows; row++) {
+      if (!wgdos_row_fits(field_data, field_end) ||
+          wgdos_unpack_row_affine(&field_data, ncols, accuracy, mdi, transform, missing_data, zero,
+                                  unpacked_data+(size_t)row*ncols, &row_mdi_clashes, &subroutine)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+    }
+    return 0;
+}
+
+/* Put the data_size words of an unpacked field into native order in to, changing them
+   a block at a time while the block is in cache */
+static void transform_unpacked(char* data, int data_size, float* to, float mdi,
+                               const unpack_transform* transform) {
+  int start;
+  int nblock;
+  int i;
+
+  for (start=0; start<data_size; start+=nblock) {
+    nblock=(data_size-start<TRANSFORM_BLOCK_WORDS ? data_size-start : TRANSFORM_BLOCK_WORDS);
+    network_order_words32(data+(size_t)start*sizeof(float), to+start, nblock);
+    for (i=start; i<start+nblock; i++) {
+      to[i]=(to[i]==mdi ? transform->mdi_out : to[i]*transform->scale+transform->offset);
+    }
+  }
+}
+
+/* As unpack_ppfield, applying transform to each value as it is unpacked */
+int unpack_ppfield_transformed(float mdi, int data_size, char* data, int pack, int unpacked_size,
+                               float* to, const unpack_transform* transform, function* parent) {
+  wgdos_context context;
+  int retval;
+  wgdos_context_init(&context);
+  retval=unpack_ppfield_transformed_ctx(&context, mdi, data_size, data, pack, unpacked_size, to,
+                                        transform, parent);
+  wgdos_context_free(&context);
+  return retval;
+}
+
+/* As unpack_ppfield_transformed, taking the work areas from the context */
+int unpack_ppfield_transformed_ctx(wgdos_context* context, float mdi, int data_size, char* data,
+                                   int pack, int unpacked_size, float* to,
+                                   const unpack_transform* transform, function* parent) {
+  function subroutine;
+  set_function_name(__func__, &subroutine, parent);
+
+  switch(pack) {
+  case 0:
+    transform_unpacked(data, data_size, to, mdi, transform);
+    return 0;
+  case 1:
+    return wgdos_unpack_transformed_ctx(context, data, unpacked_size, to, mdi, transform, &subroutine)!=0;
+  case 4:
+    network_order_words32(data, data, data_size);
+    return runlen_decode_affine(to, unpacked_size, (float*)data, data_size, mdi, transform->scale,
+                                transform->offset, transform->mdi_out, &subroutine)!=RL_OK;
+  default:
+    MO_syslog(VERBOSITY_ERROR, "Unrecognised packing code", &subroutine);
+    return 1;
+  }
+}
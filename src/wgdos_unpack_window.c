@@ -0,0 +1,147 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* wgdos_unpack_window.c
+ *
+ * Description:
+ *   Unpack a rectangle of rows and columns out of a WGDOS packed field
+ *
+ * Information:
+ *   Rows before the window are stepped over using the word count in each
+ *   row header, without decoding them, and decoding stops after the last
+ *   row of the window. In each row of the window only the columns wanted
+ *   are unpacked (see wgdos_expand_packed_row_window). The result is the
+ *   same as unpacking the whole field and cutting the window out of it.
+ */
+
+/* Standard header files used */
+#include <stdio.h>
+#include <stdlib.h>
+/* Package header files used */
+#include "wgdosstuff.h"
+#include "wgdosrow.h"
+#include "logerrors.h"
+
+static THREAD_LOCAL char message[MAX_MESSAGE_SIZE];
+/* End of header */
+
+int wgdos_unpack_window(
+    /* IN */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       first_row,             /* First row wanted, from 0 */
+    int       window_rows,           /* Number of rows wanted */
+    int       first_col,             /* First column wanted, from 0 */
+    int       window_cols,           /* Number of columns wanted */
+    /* OUT */
+    float*    unpacked_data,         /* window_rows*window_cols values */
+    float     mdi,                   /* Missing data indicator value */
+    function* parent)
+{
+    wgdos_context context;
+    int status;
+
+    wgdos_context_init(&context);
+    status=wgdos_unpack_window_ctx(&context, packed_data, unpacked_len, first_row, window_rows,
+                                   first_col, window_cols, unpacked_data, mdi, parent);
+    wgdos_context_free(&context);
+    return status;
+}
+
+/* As wgdos_unpack_window, taking the work areas from the context */
+int wgdos_unpack_window_ctx(
+    /* IN */
+    wgdos_context* context,          /* Work areas kept between calls */
+    char*     packed_data,           /* Packed data, starting at the field header */
+    int       unpacked_len,          /* Number of values in the whole field */
+    int       first_row,             /* First row wanted, from 0 */
+    int       window_rows,           /* Number of rows wanted */
+    int       first_col,             /* First column wanted, from 0 */
+    int       window_cols,           /* Number of columns wanted */
+    /* OUT */
+    float*    unpacked_data,         /* window_rows*window_cols values */
+    float     mdi,                   /* Missing data indicator value */
+    function* parent)
+{
+    float     accuracy;              /* Absolute accuracy to which data held */
+    int       ncols;                 /* Number of columns in each row */
+    int       nrows;                 /* Number of rows in field */
+    uint64_t* missing_data;          /* Missing data bitmap for current row */
+    uint64_t* zero;                  /* Zeros bitmap for current row */
+    char*     field_data=packed_data;
+    char*     field_end;             /* End of the field according to the field header */
+    int       row_mdi_clashes;
+    int       row;
+    int       status;
+    function subroutine;
+
+    set_function_name(__func__, &subroutine, parent);
+
+    /* Read field header information */
+    status=wgdos_decode_field_parameters(&field_data, unpacked_len, &accuracy, &ncols, &nrows, &subroutine);
+    if (status) {
+      return -1;
+    }
+    if (first_row<0 || window_rows<0 || first_row+window_rows>nrows ||
+        first_col<0 || window_cols<0 || first_col+window_cols>ncols) {
+      snprintf(message, MAX_MESSAGE_SIZE, "Window of %d rows from %d and %d columns from %d is not within the %d by %d field",
+               window_rows, first_row, window_cols, first_col, nrows, ncols);
+      MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+      return -1;
+    }
+
+    field_end=packed_data+4*(long)ntohl(((wgdos_field_header*)packed_data)->total_length);
+
+    /* Reserve work areas */
+    missing_data  = wgdos_context_scratch(context, WGDOS_SCRATCH_MISSING_DATA, sizeof(uint64_t) * ((ncols+63)/64));
+    zero          = wgdos_context_scratch(context, WGDOS_SCRATCH_ZERO, sizeof(uint64_t) * ((ncols+63)/64));
+    if (!(missing_data && zero)) {
+      return -1;
+    }
+
+    /* Step over the rows before the window by their lengths alone */
+    field_data=packed_data+sizeof(wgdos_field_header);
+    if (wgdos_skip_rows(packed_data, first_row, &field_data, &subroutine)) {
+      set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+      return -1;
+    }
+
+    for (row=0; row<window_rows; row++) {
+      if (!wgdos_row_fits(field_data, field_end) ||
+          wgdos_unpack_row_window(&field_data, ncols, first_col, window_cols, accuracy, mdi,
+                                  missing_data, zero, &unpacked_data[row*window_cols],
+                                  &row_mdi_clashes, &subroutine)) {
+        snprintf(message, MAX_MESSAGE_SIZE, "Failed to properly decode WGDOS row %d", first_row+row);
+        MO_syslog(VERBOSITY_ERROR, message, &subroutine);
+        set_logerrno(LOGERRNO_FORMAT_EXCEPTION);
+        return -1;
+      }
+    }
+    return 0;
+}
@@ -0,0 +1,199 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* Reading n-bit values straight out of a WGDOS bitstream (MSB first).
+   Internal to the library, not installed. */
+
+#include <stdint.h>
+
+#ifndef _WGDOSBITS_H
+  #define _WGDOSBITS_H 1
+
+  /* The 8 bytes from p onwards as a big endian (MSB first) number. Written out byte by
+     byte so it works on any platform; compilers turn this into a single load and swap */
+  #define LOAD_BE64(p) \
+    (((uint64_t)(p)[0]<<56) | ((uint64_t)(p)[1]<<48) | ((uint64_t)(p)[2]<<40) | ((uint64_t)(p)[3]<<32) | \
+     ((uint64_t)(p)[4]<<24) | ((uint64_t)(p)[5]<<16) | ((uint64_t)(p)[6]<<8)  |  (uint64_t)(p)[7])
+
+  /* The W-bit value starting BIT bits into the bytestream P: move its bits to the top of
+     a 64-bit number and then down to the bottom. 1 <= W <= 31. Reads the 8 bytes from
+     byte BIT/8, so the caller must make sure they are there */
+  #define NBIT_VALUE_AT(P, BIT, W) \
+    ((int)((LOAD_BE64((P)+(BIT)/8) << ((BIT)%8)) >> (64-(W))))
+
+  /* As NBIT_VALUE_AT, reading only the bytes that hold the value. For the end of a bitstream */
+  static inline int nbit_value_bytewise(const unsigned char* p, int bit, int w) {
+    uint64_t val=0;
+    int last=(bit+w-1)/8;
+    int b;
+    for (b=bit/8; b<=last; b++) {
+      val=(val<<8)|p[b];
+    }
+    return (int)((val>>(7-(bit+w-1)%8)) & ((1U<<w)-1));
+  }
+
+  /* Bit counting on 64-bit bitmap words, using the processor's instructions where the compiler has them */
+  #ifdef __GNUC__
+    #define POPCOUNT64(x) __builtin_popcountll(x)
+    #define CLZ64(x) __builtin_clzll(x)
+  #else
+    static inline int popcount64(uint64_t x) {
+      x = x - ((x >> 1) & 0x5555555555555555ULL);
+      x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+      x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+      return (int)((x * 0x0101010101010101ULL) >> 56);
+    }
+    static inline int clz64(uint64_t x) {
+      int n=0;
+      while (!(x & 0x8000000000000000ULL)) {
+        x<<=1;
+        n++;
+      }
+      return n;
+    }
+    #define POPCOUNT64(x) popcount64(x)
+    #define CLZ64(x) clz64(x)
+  #endif
+
+  /* x with its bits in the opposite order, so bit 63 becomes bit 0 */
+  static inline uint64_t reverse_bits64(uint64_t x) {
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    x = ((x >> 8) & 0x00FF00FF00FF00FFULL) | ((x & 0x00FF00FF00FF00FFULL) << 8);
+    x = ((x >> 16) & 0x0000FFFF0000FFFFULL) | ((x & 0x0000FFFF0000FFFFULL) << 16);
+    return (x >> 32) | (x << 32);
+  }
+
+  /* A 64-bit word with the top n bits set, 0 <= n <= 64 */
+  #define TOP_BITS64(n) ((n)>=64 ? ~(uint64_t)0 : ~(~(uint64_t)0 >> (n)))
+
+  /* The nbits (<=64) bits starting BIT bits into the bytestream p, MSB first, as the top bits
+     of a 64-bit word with the rest zero. Reads only the bytes that hold them */
+  static inline uint64_t bitstream_word64(const unsigned char* p, int bit, int nbits) {
+    uint64_t val=0;
+    int first=bit/8;
+    int last=(bit+nbits-1)/8;
+    int shift=bit%8;
+    int b;
+    for (b=first; b<=last && b<first+8; b++) {
+      val|=(uint64_t)p[b]<<(56-8*(b-first));
+    }
+    val<<=shift;
+    if (last==first+8) {
+      val|=p[last]>>(8-shift);
+    }
+    return val & TOP_BITS64(nbits);
+  }
+
+  /* The packed data values of a row, read by their number along the row. Values read
+     with a whole 8 byte load while that stays inside the row's packed data, which is
+     padded to whole 32-bit words, and byte by byte after that */
+  typedef struct packed_values {
+    const unsigned char* packed;     /* Packed data values for the row (MSB first) */
+    int      bits_per_value;         /* 0 <= bits_per_value < 32, 0 meaning every value is 0 */
+    int      nfast;                  /* Values that can be read with a whole 8 byte load */
+  } packed_values;
+
+  static inline void packed_values_init(packed_values* values, const unsigned char* packed,
+                                        int bits_per_value, int ndata) {
+    int nbytes=((bits_per_value*ndata+31)/32)*4;
+    values->packed=packed;
+    values->bits_per_value=bits_per_value;
+    values->nfast=(bits_per_value>0 && nbytes>=8 ? ((nbytes-8)*8)/bits_per_value+1 : 0);
+  }
+
+  /* The integer of packed value number index */
+  static inline int packed_value_at(const packed_values* values, int index) {
+    int bit=index*values->bits_per_value;
+    if (values->bits_per_value==0) {
+      return 0;
+    } else if (index<values->nfast) {
+      return NBIT_VALUE_AT(values->packed, bit, values->bits_per_value);
+    }
+    return nbit_value_bytewise(values->packed, bit, values->bits_per_value);
+  }
+
+  /* The columns of a row taken from the bitmap words a run at a time: the data columns
+     up to the next missing or zero column, then that column. Blocks of 64 columns with
+     neither are a single run, so there is no test on each column */
+  typedef struct column_runs {
+    const uint64_t* missing_data;    /* Missing data bitmap words, bit set for missing */
+    const uint64_t* zero;            /* Zeros bitmap words, bit set for zero */
+    int      col;                    /* First column of the next run */
+    int      end_col;                /* Column after the last one wanted */
+    int      word;                   /* Bitmap word of the current block */
+    int      block_start, block_end; /* Columns of the current block */
+    uint64_t special;                /* Missing or zero columns of the block not yet reached */
+  } column_runs;
+
+  static inline void column_runs_init(column_runs* runs, const uint64_t* missing_data,
+                                      const uint64_t* zero, int first_col, int end_col) {
+    runs->missing_data=missing_data;
+    runs->zero=zero;
+    runs->col=first_col;
+    runs->end_col=end_col;
+    runs->word=0;
+    runs->block_start=0;
+    runs->block_end=first_col;       /* So the first run starts a block */
+    runs->special=0;
+  }
+
+  /* The next run: data columns *run_start to *run_end-1, then *special_kind is 1 if column
+     *run_end is missing, 0 if it is zero, or -1 if the run reaches the end of its block
+     and there is no such column. Returns 0 once every column has been given */
+  static inline int column_runs_next(column_runs* runs, int* run_start, int* run_end, int* special_kind) {
+    uint64_t col_bit;
+
+    if (runs->col>=runs->end_col) {
+      return 0;
+    }
+    if (runs->col>=runs->block_end) {
+      runs->word=runs->col/64;
+      runs->block_start=64*runs->word;
+      runs->block_end=(runs->block_start+64<runs->end_col ? runs->block_start+64 : runs->end_col);
+      runs->special=(runs->missing_data[runs->word] | runs->zero[runs->word]) &
+                    ~TOP_BITS64(runs->col-runs->block_start);
+    }
+    *run_start=runs->col;
+    *run_end=(runs->special ? runs->block_start+CLZ64(runs->special) : runs->block_end);
+    if (*run_end>=runs->block_end) {
+      *run_end=runs->block_end;
+      *special_kind=-1;
+      runs->col=runs->block_end;
+    } else {
+      col_bit=(uint64_t)1<<(63-(*run_end-runs->block_start));
+      *special_kind=((runs->missing_data[runs->word] & col_bit) != 0);
+      runs->special&=~col_bit;
+      runs->col=*run_end+1;
+    }
+    return 1;
+  }
+
+#endif
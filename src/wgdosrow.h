@@ -0,0 +1,233 @@
+/*
+# Copyright (c) 2012, The Met Office, UK
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of copyright holder nor the names of any
+#    contributors may be used to endorse or promote products derived
+#    from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+*/
+
+/* Unpacking single rows of a WGDOS packed field, and the context work area slots.
+   Internal to the library, not installed. */
+
+#include "wgdosstuff.h"
+
+#ifndef _WGDOSROW_H
+  #define _WGDOSROW_H 1
+
+  /* The slot of wgdos_context each _ctx routine keeps its work area in */
+  enum {
+    WGDOS_SCRATCH_MISSING_DATA,   /* wgdos_unpack_ctx bitmaps */
+    WGDOS_SCRATCH_ZERO,
+    WGDOS_SCRATCH_ROW_DATA,       /* wgdos_pack_ctx row work areas */
+    WGDOS_SCRATCH_ZERO_BITMAP,
+    WGDOS_SCRATCH_MDI_BITMAP,
+    WGDOS_SCRATCH_PACKED_ROW,
+    WGDOS_SCRATCH_MDI_ARRAY,
+    WGDOS_SCRATCH_ZERO_ARRAY,
+    WGDOS_SCRATCH_FIELD,          /* unpack_ppfield_ctx and pack_ppfield_ctx whole field */
+    WGDOS_SCRATCH_PACKED_FIELD,   /* pp_file_unpack_ctx and ff_file_unpack_ctx copy of the field */
+    WGDOS_SCRATCH_ROW,            /* wgdos_unpack_reduced_ctx one unpacked row */
+    WGDOS_SCRATCH_SUMS,           /* and the sums and counts for its block means */
+    WGDOS_SCRATCH_COUNTS,
+    WGDOS_SCRATCH_SLOTS_USED
+  };
+  /* Does not compile if wgdos_context has too few slots */
+  typedef char wgdos_scratch_slots_fit[WGDOS_SCRATCH_SLOTS_USED<=WGDOS_CONTEXT_SLOTS ? 1 : -1];
+
+  /* The number of 32-bit words after the 8 byte header of the row at row, from the
+     bottom 16 bits of its second word. Read a byte at a time, as a row may start at
+     any offset in a caller's buffer */
+  static inline int wgdos_row_words(const char* row) {
+    return ((const unsigned char*)row)[6]<<8 | ((const unsigned char*)row)[7];
+  }
+
+  int wgdos_row_fits(const char* row,
+    const char* field_end);
+
+  int wgdos_start_row(char** packed_data,
+    int ncols,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    float* base,
+    int* bits_per_value,
+    int* ndata,
+    int* nop,
+    const function* const parent);
+
+  int wgdos_skip_rows(char* packed_data,
+    int nskip,
+    char** row,
+    const function* const parent);
+
+  int wgdos_unpack_row(char** packed_data,
+    int ncols,
+    float accuracy,
+    float mdi,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    float* unpacked_row,
+    int* mdi_clashes,
+    const function* const parent);
+
+  int wgdos_unpack_row_window(char** packed_data,
+    int ncols,
+    int first_col,
+    int window_cols,
+    float accuracy,
+    float mdi,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    float* unpacked_row,
+    int* mdi_clashes,
+    const function* const parent);
+
+  int wgdos_unpack_row_strided(char** packed_data,
+    int ncols,
+    int stride,
+    float accuracy,
+    float mdi,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    float* unpacked_row,
+    int* mdi_clashes,
+    const function* const parent);
+
+  int wgdos_unpack_row_quantized(char** packed_data,
+    int ncols,
+    int value_size,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    void* quantized_row,
+    float* base,
+    int* bits_per_value,
+    const function* const parent);
+
+  int wgdos_unpack_row_sparse(char** packed_data,
+    int ncols,
+    int first_index,
+    int max_points,
+    float accuracy,
+    float mdi,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    int* indices,
+    float* values,
+    int* npoints,
+    const function* const parent);
+
+  int wgdos_unpack_row_affine(char** packed_data,
+    int ncols,
+    float accuracy,
+    float mdi,
+    const unpack_transform* transform,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    float* unpacked_row,
+    int* mdi_clashes,
+    const function* const parent);
+
+  int read_wgdos_bitmap_words(char** data,
+    int ncols,
+    Boolean missing_data_present,
+    Boolean zeros_bitmap_present,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    int* missing_data_count,
+    int* zeros_count);
+
+  int wgdos_expand_packed_row_to_data(int ncols,
+    float mdi,
+    float accuracy,
+    float base,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    unsigned char* packed,
+    int bits_per_value,
+    int ndata,
+    float* unpacked_data,
+    int* mdi_clashes);
+
+  int wgdos_expand_packed_row_window(int ncols,
+    int first_col,
+    int window_cols,
+    float mdi,
+    float accuracy,
+    float base,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    unsigned char* packed,
+    int bits_per_value,
+    int ndata,
+    float* unpacked_data,
+    int* mdi_clashes);
+
+  int wgdos_expand_packed_row_quantized(int ncols,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    unsigned char* packed,
+    int bits_per_value,
+    int ndata,
+    int value_size,
+    void* quantized_data);
+
+  int wgdos_expand_packed_row_sparse(int ncols,
+    int first_index,
+    float mdi,
+    float accuracy,
+    float base,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    unsigned char* packed,
+    int bits_per_value,
+    int ndata,
+    int* indices,
+    float* values);
+
+  int wgdos_expand_packed_row_affine(int ncols,
+    float mdi,
+    float accuracy,
+    float base,
+    const unpack_transform* transform,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    unsigned char* packed,
+    int bits_per_value,
+    int ndata,
+    float* unpacked_data,
+    int* mdi_clashes);
+
+  int wgdos_expand_packed_row_strided(int ncols,
+    int stride,
+    float mdi,
+    float accuracy,
+    float base,
+    uint64_t* missing_data,
+    uint64_t* zero,
+    unsigned char* packed,
+    int bits_per_value,
+    int ndata,
+    float* unpacked_data,
+    int* mdi_clashes);
+
+#endif
@@ -27,8 +27,10 @@
 #
 */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 #ifndef _WGDOSSTUFF_H
   #define _WGDOSSTUFF_H 1
@@ -45,6 +47,14 @@
 
   #define INVALID_PACKING_ACCURACY 31
 
+  /* 16 bit floating point formats for wgdos_unpack_half and unpack_ppfield_half */
+  #define HALF_FLOAT16 0
+  #define HALF_BFLOAT16 1
+
+  /* How wgdos_unpack_reduced reduces a field */
+  #define WGDOS_REDUCE_STRIDE 0
+  #define WGDOS_REDUCE_MEAN 1
+
   #include "logerrors.h"
 
   #ifndef TRUE
@@ -70,12 +80,360 @@
     short len_of_data;
   } wgdos_row_t;
 
+  /* Work areas kept between calls of the _ctx routines, one per use. Which slot holds
+     what is private to the library, so more may be used without changing the struct */
+  #define WGDOS_CONTEXT_SLOTS 16
+
+  typedef struct wgdos_context {
+    void*  scratch[WGDOS_CONTEXT_SLOTS];
+    size_t scratch_size[WGDOS_CONTEXT_SLOTS];
+  } wgdos_context;
+
+  void wgdos_context_init(wgdos_context* context);
+
+  void wgdos_context_free(wgdos_context* context);
+
+  void* wgdos_context_scratch(wgdos_context* context,
+    int slot,
+    size_t size);
+
+  /* A change made to each value as it is unpacked: value*scale+offset, missing values
+     becoming mdi_out (e.g. NAN) */
+  typedef struct unpack_transform {
+    double   scale;
+    double   offset;
+    float    mdi_out;
+  } unpack_transform;
+
+  /* A WGDOS field unpacked to its packed integers by wgdos_unpack_quantized. The
+     caller gives the arrays, sized for the field's rows and columns */
+  typedef struct wgdos_quantized {
+    int      nrows;                  /* OUT */
+    int      ncols;                  /* OUT */
+    float    accuracy;               /* OUT: the field's accuracy */
+    float*   base;                   /* nrows row base values */
+    int*     bits_per_value;         /* nrows bits per value, or NULL if not wanted */
+    void*    values;                 /* nrows*ncols uint16_t or uint32_t integers */
+    uint64_t* missing_data;          /* nrows*((ncols+63)/64) bitmap words, bit set for missing, or NULL */
+    uint64_t* zero;                  /* As missing_data, bit set for zero, or NULL */
+  } wgdos_quantized;
+
+  /* A WGDOS field being unpacked a row at a time by wgdos_row_reader_next */
+  typedef struct wgdos_row_reader {
+    char*    packed_data;            /* Field header */
+    char*    next_row;               /* Header of the next row to unpack, NULL after a broken row */
+    long     total_bytes;            /* Length of the field according to the field header */
+    int      row;                    /* Number of the next row, from 0 */
+    int      nrows;
+    int      ncols;
+    float    accuracy;
+    float    mdi;
+    wgdos_context context;           /* Row bitmaps */
+  } wgdos_row_reader;
+
+  /* A WGDOS field being unpacked by wgdos_push_decoder_feed as its bytes arrive */
+  typedef struct wgdos_push_decoder {
+    float*   unpacked_data;
+    int      unpacked_len;
+    float    mdi;
+    float    accuracy;
+    int      nrows;                  /* -1 until the field header has arrived */
+    int      ncols;
+    int      row;                    /* Number of rows unpacked so far */
+    int      failed;
+    size_t   total_bytes;            /* Length of the field according to the field header */
+    size_t   consumed;               /* Bytes of the field unpacked so far */
+    char*    carry;                  /* Start of a unit split across chunks */
+    size_t   carry_length;
+    size_t   carry_size;
+    wgdos_context context;           /* Row bitmaps */
+  } wgdos_push_decoder;
+
+  /* Statistics of a field from wgdos_field_stats, over the rows read */
+  typedef struct wgdos_stats {
+    int      rows;                   /* Number of rows read */
+    int      count;                  /* Number of values that are not missing, ndata+nzeros */
+    int      ndata;                  /* Number of packed data values */
+    int      nzeros;                 /* Number of zeros from the zeros bitmaps */
+    int      nmissing;               /* Number of missing values from the missing data bitmaps */
+    double   sum;                    /* Sum of the values that are not missing */
+    float    min;                    /* Least and greatest of them, mdi if there are none */
+    float    max;
+  } wgdos_stats;
+
+  /* A PP file, memory mapped, with where each field's records are */
+  #define PP_LOOKUP_WORDS 64
+
+  typedef struct pp_file_field {
+    uint32_t lookup[PP_LOOKUP_WORDS];  /* PP header, native order */
+    size_t   data_offset;            /* Where the data record starts in the file */
+    long     data_length;            /* Data record length in bytes */
+  } pp_file_field;
+
+  typedef struct pp_file {
+    char*    map;
+    size_t   length;
+    int      nfields;
+    pp_file_field* fields;
+  } pp_file;
+
+  /* A UM fieldsfile, memory mapped, with its lookup table */
+  #define FF_FIXED_HEADER_WORDS 256
+
+  typedef struct ff_file_field {
+    uint64_t lookup[PP_LOOKUP_WORDS];  /* Lookup entry, native order */
+    size_t   data_offset;            /* Where the field starts in the file (LBEGIN) */
+    size_t   data_length;            /* Bytes it takes in the file (LBNREC) */
+  } ff_file_field;
+
+  typedef struct ff_file {
+    char*    map;
+    size_t   length;
+    int64_t  fixed_header[FF_FIXED_HEADER_WORDS];
+    int      nfields;                /* Lookup entries in use */
+    ff_file_field* fields;
+  } ff_file;
+
+  /* An index over a lookup table, for lookup_index_query */
+  typedef struct lookup_index {
+    int      n;
+    int*     stash;                  /* Header words of each field, in field order */
+    int*     level;
+    int*     lbproc;
+    int64_t* validity;               /* As lookup_time */
+    int64_t* data_time;
+    int*     by_stash;               /* Fields by STASH code, level then validity time */
+    int*     stash_key;              /* and their keys in that order */
+    int*     level_key;
+    int64_t* validity_key;
+    int*     by_time;                /* Fields by validity time */
+    int64_t* time_key;
+  } lookup_index;
+
+  #define LOOKUP_ANY INT32_MIN
+  #define LOOKUP_ANY_TIME_FROM INT64_MIN
+  #define LOOKUP_ANY_TIME_TO INT64_MAX
+
+  /* Fields wanted: LOOKUP_ANY for any value, times inclusive */
+  typedef struct lookup_query {
+    int      stash;                  /* LBUSER4 */
+    int      level;                  /* LBLEV */
+    int      lbproc;                 /* LBPROC */
+    int64_t  validity_from;          /* LBYR..LBSEC */
+    int64_t  validity_to;
+    int64_t  data_time_from;         /* LBYRD..LBSECD */
+    int64_t  data_time_to;
+  } lookup_query;
+
+  /* One field of a batch for unpack_ppfield_batch32/64 */
+  typedef struct ppfield_batch_item {
+    void*  lookup;                   /* PP header, uint32_t or uint64_t words */
+    char*  data;                     /* Packed data field */
+    float* to;                       /* Unpacked field, NULL to test unpack */
+    int    status;                   /* OUT: as unpack_ppfield32/64 would return */
+  } ppfield_batch_item;
+
   int wgdos_unpack(char* packed_data, 
     int unpacked_len,
     float* unpacked_data,
     float mdi,
     function* parent);
 
+  int wgdos_unpack_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    float* unpacked_data,
+    float mdi,
+    function* parent);
+
+  int wgdos_unpack_threaded(char* packed_data,
+    int unpacked_len,
+    float* unpacked_data,
+    float mdi,
+    int nthreads,
+    function* parent);
+
+  int wgdos_scan_row_offsets(char* packed_data,
+    int nrows,
+    int* row_offsets,
+    const function* const parent);
+
+  int wgdos_unpack_quantized(char* packed_data,
+    int unpacked_len,
+    int value_size,
+    wgdos_quantized* quantized,
+    function* parent);
+
+  int wgdos_unpack_quantized_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    int value_size,
+    wgdos_quantized* quantized,
+    function* parent);
+
+  int wgdos_unpack_half(char* packed_data,
+    int unpacked_len,
+    int format,
+    uint16_t* unpacked_data,
+    float mdi,
+    uint16_t mdi_half,
+    function* parent);
+
+  int wgdos_unpack_half_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    int format,
+    uint16_t* unpacked_data,
+    float mdi,
+    uint16_t mdi_half,
+    function* parent);
+
+  int wgdos_unpack_sparse(char* packed_data,
+    int unpacked_len,
+    int max_points,
+    int* indices,
+    float* values,
+    int* row_start,
+    int* npoints,
+    float mdi,
+    function* parent);
+
+  int wgdos_unpack_sparse_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    int max_points,
+    int* indices,
+    float* values,
+    int* row_start,
+    int* npoints,
+    float mdi,
+    function* parent);
+
+  int wgdos_unpack_transformed(char* packed_data,
+    int unpacked_len,
+    float* unpacked_data,
+    float mdi,
+    const unpack_transform* transform,
+    function* parent);
+
+  int wgdos_unpack_transformed_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    float* unpacked_data,
+    float mdi,
+    const unpack_transform* transform,
+    function* parent);
+
+  int wgdos_validity_mask(char* packed_data,
+    int unpacked_len,
+    uint8_t* mask,
+    int* nvalid,
+    function* parent);
+
+  int wgdos_validity_mask_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    uint8_t* mask,
+    int* nvalid,
+    function* parent);
+
+  int wgdos_unpack_masked(char* packed_data,
+    int unpacked_len,
+    float* unpacked_data,
+    uint8_t* mask,
+    float fill,
+    function* parent);
+
+  int wgdos_unpack_masked_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    float* unpacked_data,
+    uint8_t* mask,
+    float fill,
+    function* parent);
+
+  int wgdos_unpack_window(char* packed_data,
+    int unpacked_len,
+    int first_row,
+    int window_rows,
+    int first_col,
+    int window_cols,
+    float* unpacked_data,
+    float mdi,
+    function* parent);
+
+  int wgdos_unpack_window_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    int first_row,
+    int window_rows,
+    int first_col,
+    int window_cols,
+    float* unpacked_data,
+    float mdi,
+    function* parent);
+
+  int wgdos_unpack_reduced(char* packed_data,
+    int unpacked_len,
+    int factor,
+    int method,
+    float* unpacked_data,
+    float mdi,
+    function* parent);
+
+  int wgdos_unpack_reduced_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    int factor,
+    int method,
+    float* unpacked_data,
+    float mdi,
+    function* parent);
+
+  int wgdos_field_stats(char* packed_data,
+    int unpacked_len,
+    int row_step,
+    float mdi,
+    wgdos_stats* stats,
+    function* parent);
+
+  int wgdos_field_stats_ctx(wgdos_context* context,
+    char* packed_data,
+    int unpacked_len,
+    int row_step,
+    float mdi,
+    wgdos_stats* stats,
+    function* parent);
+
+  int wgdos_row_reader_open(wgdos_row_reader* reader,
+    char* packed_data,
+    int unpacked_len,
+    float mdi,
+    function* parent);
+
+  int wgdos_row_reader_next(wgdos_row_reader* reader,
+    float* row_data,
+    function* parent);
+
+  int wgdos_row_reader_skip(wgdos_row_reader* reader,
+    int nskip,
+    function* parent);
+
+  void wgdos_row_reader_close(wgdos_row_reader* reader);
+
+  int wgdos_push_decoder_open(wgdos_push_decoder* decoder,
+    int unpacked_len,
+    float* unpacked_data,
+    float mdi,
+    function* parent);
+
+  int wgdos_push_decoder_feed(wgdos_push_decoder* decoder,
+    const char* chunk,
+    size_t length,
+    function* parent);
+
+  void wgdos_push_decoder_close(wgdos_push_decoder* decoder);
+
   int wgdos_decode_row_parameters(char** data,
     float* base,
     Boolean* missing_data_present, 
@@ -141,10 +499,19 @@
     Boolean one_true,
     Boolean *unpacked);
 
+  void network_order_words32(const void* in, void* out, int nwords);
+
+  void network_order_words64(const void* in, void* out, int nwords);
+
   int convert_float_ibm_to_ieee32(int ibm[], int ieee[], int* n);
 
   int convert_float_ieee32_to_ibm(int ieee[], int ibm[], int* n);
 
+  void convert_float_ieee32_to_half(const float* in, uint16_t* out, int n, int format,
+    float mdi, uint16_t mdi_half);
+
+  void convert_float_half_to_ieee32(const uint16_t* in, float* out, int n, int format);
+
   int unpack_ppfield(float mdi,
     int data_size,
     char* data,
@@ -163,6 +530,191 @@
     float* to,
     function* parent);
 
+  int unpack_ppfield_half(float mdi,
+    int data_size,
+    char* data,
+    int pack,
+    int unpacked_size,
+    int format,
+    uint16_t* to,
+    uint16_t mdi_half,
+    function* parent);
+
+  int unpack_ppfield_sparse(float mdi,
+    int data_size,
+    char* data,
+    int pack,
+    int unpacked_size,
+    int max_points,
+    int* indices,
+    float* values,
+    int* npoints,
+    function* parent);
+
+  void unpack_transform_init(unpack_transform* transform,
+    float mdi);
+
+  int unpack_ppfield_transformed(float mdi,
+    int data_size,
+    char* data,
+    int pack,
+    int unpacked_size,
+    float* to,
+    const unpack_transform* transform,
+    function* parent);
+
+  int unpack_ppfield_validity(float mdi,
+    int data_size,
+    char* data,
+    int pack,
+    int unpacked_size,
+    uint8_t* mask,
+    int* nvalid,
+    function* parent);
+
+  int unpack_ppfield_iov(float mdi,
+    int data_size,
+    const struct iovec* iov,
+    int iovcnt,
+    int pack,
+    int unpacked_size,
+    float* to,
+    function* parent);
+
+  int unpack_ppfield32_iov(uint32_t* lookup,
+    const struct iovec* iov,
+    int iovcnt,
+    float* to,
+    function* parent);
+
+  int unpack_ppfield64_iov(uint64_t* lookup,
+    const struct iovec* iov,
+    int iovcnt,
+    float* to,
+    function* parent);
+
+  int unpack_ppfield_batch32(ppfield_batch_item* fields,
+    int nfields,
+    int nthreads,
+    function* parent);
+
+  int unpack_ppfield_batch64(ppfield_batch_item* fields,
+    int nfields,
+    int nthreads,
+    function* parent);
+
+  int pp_file_open(const char* path,
+    pp_file* file,
+    function* parent);
+
+  void pp_file_close(pp_file* file);
+
+  int pp_file_unpack(const pp_file* file,
+    int n,
+    float* to,
+    function* parent);
+
+  int pp_file_unpack_ctx(wgdos_context* context,
+    const pp_file* file,
+    int n,
+    float* to,
+    function* parent);
+
+  int ff_file_open(const char* path,
+    ff_file* file,
+    function* parent);
+
+  void ff_file_close(ff_file* file);
+
+  void ff_file_prefetch(const ff_file* file,
+    const int* which,
+    int n);
+
+  int ff_file_unpack(const ff_file* file,
+    int n,
+    float* to,
+    function* parent);
+
+  int ff_file_unpack_ctx(wgdos_context* context,
+    const ff_file* file,
+    int n,
+    float* to,
+    function* parent);
+
+  int64_t lookup_time(int year,
+    int month,
+    int day,
+    int hour,
+    int minute,
+    int second);
+
+  int lookup_index_build(lookup_index* index,
+    const void* lookups,
+    int nlookups,
+    size_t stride,
+    int lookup64,
+    function* parent);
+
+  void lookup_index_free(lookup_index* index);
+
+  void lookup_query_init(lookup_query* query);
+
+  int lookup_index_query(const lookup_index* index,
+    const lookup_query* query,
+    int* found);
+
+  int unpack_ppfield_ctx(wgdos_context* context,
+    float mdi,
+    int data_size,
+    char* data,
+    int pack,
+    int unpacked_size,
+    float* to,
+    function* parent);
+
+  int unpack_ppfield_half_ctx(wgdos_context* context,
+    float mdi,
+    int data_size,
+    char* data,
+    int pack,
+    int unpacked_size,
+    int format,
+    uint16_t* to,
+    uint16_t mdi_half,
+    function* parent);
+
+  int unpack_ppfield_sparse_ctx(wgdos_context* context,
+    float mdi,
+    int data_size,
+    char* data,
+    int pack,
+    int unpacked_size,
+    int max_points,
+    int* indices,
+    float* values,
+    int* npoints,
+    function* parent);
+
+  int unpack_ppfield_transformed_ctx(wgdos_context* context,
+    float mdi,
+    int data_size,
+    char* data,
+    int pack,
+    int unpacked_size,
+    float* to,
+    const unpack_transform* transform,
+    function* parent);
+
+  int unpack_ppfield_validity_ctx(wgdos_context* context,
+    float mdi,
+    int data_size,
+    char* data,
+    int pack,
+    int unpacked_size,
+    uint8_t* mask,
+    int* nvalid,
+    function* parent);
+
   int byteorder_data_unpack_ppfield(float mdi,
     int data_size,
     char* data,
@@ -190,6 +742,16 @@
     int* packed_length,
     function* parent);
 
+  int wgdos_pack_ctx(wgdos_context* context,
+    int ncols,
+    int nrows,
+    float* unpacked_data,
+    float mdi,
+    int bpacc,
+    unsigned char* packed_data,
+    int* packed_length,
+    function* parent);
+
   int wgdos_calc_row_header(
     int* wgdos_header,
     float minval,
@@ -224,4 +786,16 @@
     char* to,
     function* parent);
 
+  int pack_ppfield_ctx(wgdos_context* context,
+    float mdi,
+    int ncols,
+    int nrows,
+    float* data,
+    int pack,
+    int bpacc,
+    int nbits,
+    int* packed_size,
+    char* to,
+    function* parent);
+
 #endif
@@ -66,6 +66,67 @@ START_TEST(test_decompress)
 END_TEST
 
 
+START_TEST(test_decompress_all_missing)
+{
+    float fatvec[5];
+    int fatlen = 5;
+    float thinvec[2] = {6, 5};
+    int thinlen = 2;
+    float bmdi = 6;
+    function *parent = NULL;
+    int rc;
+
+    rc = runlen_decode(fatvec, fatlen, thinvec, thinlen, bmdi, parent);
+
+    ck_assert_int_eq(rc, 0);
+    ck_assert(fatvec[0] == 6);
+    ck_assert(fatvec[4] == 6);
+}
+END_TEST
+
+
+START_TEST(test_decompress_bad_runs)
+{
+    float fatvec[5];
+    int fatlen = 5;
+    float no_length[3] = {3, 9, 6};
+    float too_long[3] = {3, 6, 5};
+    float not_whole[4] = {3, 6, 2.5, 9};
+    float bmdi = 6;
+    function *parent = NULL;
+
+    ck_assert_int_eq(runlen_decode(fatvec, fatlen, no_length, 3, bmdi, parent), 1);
+    ck_assert_int_eq(runlen_decode(fatvec, fatlen, too_long, 3, bmdi, parent), 1);
+    ck_assert_int_eq(runlen_decode(fatvec, fatlen, not_whole, 4, bmdi, parent), 1);
+}
+END_TEST
+
+
+START_TEST(test_decompress_in_pieces)
+{
+    float fatvec[5];
+    int fatlen = 5;
+    float thinvec[4] = {3, 6, 3, 9};
+    float bmdi = 6;
+    runlen_decoder decoder;
+    runlen_expansion expansion;
+    runlen_sink sink;
+    function *parent = NULL;
+
+    runlen_decoder_init(&decoder, fatlen, bmdi);
+    runlen_expansion_sink(&sink, &expansion, fatvec, bmdi);
+    // The run length comes in the piece after its missing data value
+    ck_assert_int_eq(runlen_decoder_feed(&decoder, thinvec, 2, &sink, parent), 0);
+    ck_assert_int_eq(runlen_decoder_finish(&decoder, parent), 1);
+    ck_assert_int_eq(runlen_decoder_feed(&decoder, thinvec + 2, 2, &sink, parent), 0);
+    ck_assert_int_eq(runlen_decoder_finish(&decoder, parent), 0);
+    ck_assert(fatvec[0] == 3);
+    ck_assert(fatvec[3] == 6);
+    ck_assert(fatvec[4] == 9);
+}
+END_TEST
+
+
 Suite *rle_suite()
 {
     Suite *s;
@@ -78,6 +139,9 @@ Suite *rle_suite()
     tcase_add_test(tc_core, test_compress);
     tcase_add_test(tc_core, test_compress_result_larger);
     tcase_add_test(tc_core, test_decompress);
+    tcase_add_test(tc_core, test_decompress_all_missing);
+    tcase_add_test(tc_core, test_decompress_bad_runs);
+    tcase_add_test(tc_core, test_decompress_in_pieces);
     suite_add_tcase(s, tc_core);
 
     return s;
@@ -0,0 +1,1773 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "../src/wgdosstuff.h"
+#include "../src/wgdosrow.h"
+#include "../src/rlencode.h"
+
+
+// libmo_unpack needs this symbol defined ... *rolls eyes*
+void MO_syslog(int value, char *message, const function *const caller)
+{
+}
+
+
+#define NCOLS 96
+#define NROWS 40
+#define MDI -1.0e30f
+#define BPACC -6
+
+
+// A smooth field with a band of missing data and a patch of zeros, so that
+// rows are packed with and without each of the bitmaps.
+static void make_field(float *field)
+{
+    int row, col;
+
+    for (row = 0; row < NROWS; row++) {
+        for (col = 0; col < NCOLS; col++) {
+            float value = 250.0 + 30.0 * sin(row * 0.1) + 5.0 * cos(col * 0.2);
+            if (row % 5 == 1 && col > 40 && col < 70) {
+                value = MDI;
+            } else if (row % 7 == 2 && col < 30) {
+                value = 0.0;
+            }
+            field[row * NCOLS + col] = value;
+        }
+    }
+}
+
+
+static unsigned char *pack_field(float *field, int *packed_length)
+{
+    unsigned char *packed = calloc(2 * NROWS * NCOLS + 1024, sizeof(int));
+    int rc;
+
+    rc = wgdos_pack(NCOLS, NROWS, field, MDI, BPACC, packed, packed_length, NULL);
+    ck_assert_int_eq(rc, 0);
+    return packed;
+}
+
+
+START_TEST(test_unpack_round_trip)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    unsigned char *packed;
+    int packed_length;
+    int i, rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+
+    ck_assert_int_eq(rc, 0);
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        if (field[i] == MDI || field[i] == 0.0) {
+            ck_assert(unpacked[i] == field[i]);
+        } else {
+            ck_assert(fabs(unpacked[i] - field[i]) <= 2 * pow(2.0, BPACC));
+        }
+    }
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_unpack_threaded_matches)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float threaded[NROWS * NCOLS];
+    unsigned char *packed;
+    int packed_length;
+    int rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    rc = wgdos_unpack_threaded((char *)packed, NROWS * NCOLS, threaded, MDI, 3, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    ck_assert(memcmp(unpacked, threaded, sizeof(unpacked)) == 0);
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_row_offsets_truncated)
+{
+    float field[NROWS * NCOLS];
+    unsigned char *packed;
+    int packed_length;
+    int row_offsets[NROWS + 1];
+    int rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+
+    rc = wgdos_scan_row_offsets((char *)packed, NROWS, row_offsets, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(row_offsets[0], 12);
+    ck_assert_int_eq(row_offsets[NROWS], 4 * packed_length);
+
+    // Claim the field is shorter than its rows
+    *(uint32_t *)packed = htonl(packed_length - 1);
+    rc = wgdos_scan_row_offsets((char *)packed, NROWS, row_offsets, NULL);
+    ck_assert_int_ne(rc, 0);
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_unpack_rows_within_field)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    unsigned char *packed, *whole;
+    int packed_length;
+    int row_offsets[NROWS + 1];
+    uint32_t *header, row_word;
+    int rc;
+
+    make_field(field);
+    whole = pack_field(field, &packed_length);
+    // Nothing after the field, so a read beyond it shows up under a memory checker
+    packed = malloc(4 * packed_length);
+    memcpy(packed, whole, 4 * packed_length);
+    free(whole);
+    rc = wgdos_scan_row_offsets((char *)packed, NROWS, row_offsets, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // A last row claiming more words and bits than are left in the field
+    header = (uint32_t *)(packed + row_offsets[NROWS - 1]);
+    row_word = header[1];
+    header[1] = htonl((ntohl(header[1]) & 0xffe00000) | (31 << 16) | 0xffff);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_ne(rc, 0);
+
+    // A last row of no words, within the field, whose 31 bit values would run past it
+    header[1] = htonl(31 << 16);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_ne(rc, 0);
+    header[1] = row_word;
+
+    // A field header too short to hold all the row headers
+    *(uint32_t *)packed = htonl(row_offsets[NROWS - 1] / 4 + 1);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_ne(rc, 0);
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_damaged_row_every_driver)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    uint16_t halves[NROWS * NCOLS];
+    uint32_t values32[NROWS * NCOLS];
+    float base[NROWS];
+    float values[NROWS * NCOLS];
+    int indices[NROWS * NCOLS];
+    int row_start[NROWS + 1];
+    uint8_t mask[(NROWS * NCOLS + 7) / 8];
+    unsigned char *packed, *whole;
+    int packed_length;
+    int row_offsets[NROWS + 1];
+    wgdos_quantized quantized;
+    wgdos_stats stats;
+    unpack_transform transform;
+    int npoints, nvalid, rc;
+
+    make_field(field);
+    whole = pack_field(field, &packed_length);
+    packed = malloc(4 * packed_length);
+    memcpy(packed, whole, 4 * packed_length);
+    free(whole);
+    rc = wgdos_scan_row_offsets((char *)packed, NROWS, row_offsets, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // A last row of no words, within the field, whose 31 bit values would run past it
+    ((uint32_t *)(packed + row_offsets[NROWS - 1]))[1] = htonl(31 << 16);
+    rc = wgdos_unpack_window((char *)packed, NROWS * NCOLS, 0, NROWS, 0, NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_ne(rc, 0);
+    rc = wgdos_unpack_reduced((char *)packed, NROWS * NCOLS, 1, WGDOS_REDUCE_STRIDE, unpacked, MDI, NULL);
+    ck_assert_int_ne(rc, 0);
+    rc = wgdos_unpack_reduced((char *)packed, NROWS * NCOLS, 1, WGDOS_REDUCE_MEAN, unpacked, MDI, NULL);
+    ck_assert_int_ne(rc, 0);
+    rc = wgdos_field_stats((char *)packed, NROWS * NCOLS, 1, MDI, &stats, NULL);
+    ck_assert_int_ne(rc, 0);
+    memset(&quantized, 0, sizeof(quantized));
+    quantized.base = base;
+    quantized.values = values32;
+    rc = wgdos_unpack_quantized((char *)packed, NROWS * NCOLS, 4, &quantized, NULL);
+    ck_assert_int_ne(rc, 0);
+    rc = wgdos_unpack_half((char *)packed, NROWS * NCOLS, HALF_FLOAT16, halves, MDI, 0xffff, NULL);
+    ck_assert_int_ne(rc, 0);
+    rc = wgdos_unpack_sparse((char *)packed, NROWS * NCOLS, NROWS * NCOLS, indices, values,
+                             row_start, &npoints, MDI, NULL);
+    ck_assert_int_ne(rc, 0);
+    unpack_transform_init(&transform, MDI);
+    rc = wgdos_unpack_transformed((char *)packed, NROWS * NCOLS, unpacked, MDI, &transform, NULL);
+    ck_assert_int_ne(rc, 0);
+    memset(mask, 0xff, sizeof(mask));
+    rc = wgdos_validity_mask((char *)packed, NROWS * NCOLS, mask, &nvalid, NULL);
+    ck_assert_int_ne(rc, 0);
+    rc = wgdos_unpack_masked((char *)packed, NROWS * NCOLS, unpacked, mask, -1.0f, NULL);
+    ck_assert_int_ne(rc, 0);
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_unpack_ppfield_in_place)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float to[NROWS * NCOLS];
+    unsigned char *packed;
+    int packed_length;
+    int rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    rc = unpack_ppfield(MDI, packed_length, (char *)packed, WGDOS_PACKED, NROWS * NCOLS, to, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(unpacked, to, sizeof(to)) == 0);
+
+    // A test unpack, with nowhere to put the data
+    rc = unpack_ppfield(MDI, packed_length, (char *)packed, WGDOS_PACKED, NROWS * NCOLS, NULL, NULL);
+    ck_assert_int_eq(rc, 0);
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_extract_nbit_words_all_widths)
+{
+    unsigned char packed[4 * 200];
+    int values[200];
+    int unpacked[200];
+    int bits_per_value, nitems, i, rc;
+
+    srand(1);
+    for (bits_per_value = 1; bits_per_value < 32; bits_per_value++) {
+        // Cover the specialised groups of eight and the odd values left over
+        for (nitems = 1; nitems < 200; nitems += 13) {
+            memset(packed, 0, sizeof(packed));
+            for (i = 0; i < nitems; i++) {
+                values[i] = rand() & ((1U << bits_per_value) - 1);
+                bitstuff(packed, i * bits_per_value, values[i], bits_per_value, NULL);
+            }
+            rc = extract_nbit_words(packed, bits_per_value, nitems, unpacked);
+            ck_assert_int_eq(rc, 0);
+            ck_assert(memcmp(values, unpacked, nitems * sizeof(int)) == 0);
+        }
+    }
+}
+END_TEST
+
+
+START_TEST(test_bitmap_words_match)
+{
+    uint32_t packed[16];
+    char *data;
+    Boolean missing_data[400], zero[400];
+    uint64_t missing_words[4], zero_words[4];
+    int missing_data_count, zeros_count, missing_words_count, zeros_words_count;
+    int ncols, col, i;
+
+    srand(2);
+    // Widths either side of the 64 column words, with both bitmaps present
+    for (ncols = 1; ncols < 200; ncols += 7) {
+        for (i = 0; i < 16; i++) {
+            packed[i] = rand();
+        }
+        data = (char *)packed;
+        read_wgdos_bitmaps(&data, ncols, TRUE, TRUE, NULL, missing_data, zero,
+                           &missing_data_count, &zeros_count);
+        data = (char *)packed;
+        read_wgdos_bitmap_words(&data, ncols, TRUE, TRUE, missing_words, zero_words,
+                                &missing_words_count, &zeros_words_count);
+        ck_assert_int_eq(missing_data_count, missing_words_count);
+        ck_assert_int_eq(zeros_count, zeros_words_count);
+        for (col = 0; col < ncols; col++) {
+            ck_assert_int_eq(missing_data[col], (missing_words[col / 64] >> (63 - col % 64)) & 1);
+            ck_assert_int_eq(zero[col], (zero_words[col / 64] >> (63 - col % 64)) & 1);
+        }
+    }
+}
+END_TEST
+
+
+START_TEST(test_convert_float_batch)
+{
+    // 1.0, -118.625, zero, an unnormalised number, overflow, then a run of others
+    int ibm[19] = { 0x41100000, 0xC276A000, 0, 0x41012345, 0x7F123456 };
+    int ieee[19], single[19], back[19];
+    int i, n, one = 1, rc;
+
+    for (i = 5; i < 19; i++) {
+        ibm[i] = 0x3B000000 + i * 0x0123F4E1;
+    }
+    n = 19;
+    rc = convert_float_ibm_to_ieee32(ibm, ieee, &n);
+    ck_assert_int_eq(rc, -1);
+    ck_assert_int_eq(ieee[0], 0x3F800000);
+    ck_assert_int_eq(ieee[1], (int)0xC2ED4000);
+    ck_assert_int_eq(ieee[2], 0);
+    ck_assert_int_eq(ieee[3], 0x41012345);
+    ck_assert_int_eq(ieee[4], 0x7F800000);
+
+    // The whole array at once must match converting one number at a time
+    for (i = 0; i < 19; i++) {
+        convert_float_ibm_to_ieee32(&ibm[i], &single[i], &one);
+    }
+    ck_assert(memcmp(ieee, single, sizeof(ieee)) == 0);
+
+    n = 19;
+    rc = convert_float_ieee32_to_ibm(ieee, back, &n);
+    ck_assert_int_eq(rc, -1);
+    for (i = 0; i < 19; i++) {
+        convert_float_ieee32_to_ibm(&ieee[i], &single[i], &one);
+    }
+    ck_assert(memcmp(back, single, sizeof(back)) == 0);
+    ck_assert_int_eq(back[0], 0x41100000);
+    ck_assert_int_eq(back[1], (int)0xC276A000);
+}
+END_TEST
+
+
+START_TEST(test_network_order_words)
+{
+    uint32_t words[77], swapped[77], expected[77];
+    uint64_t longs[37], swapped64[37];
+    int nwords, i;
+
+    for (i = 0; i < 77; i++) {
+        words[i] = 0x01020304u * (i + 1);
+    }
+    for (i = 0; i < 37; i++) {
+        longs[i] = 0x0102030405060708ULL * (i + 1);
+    }
+    // Lengths either side of whole vectors, copying and then in place
+    for (nwords = 0; nwords <= 77; nwords++) {
+        for (i = 0; i < nwords; i++) {
+            expected[i] = htonl(words[i]);
+        }
+        network_order_words32(words, swapped, nwords);
+        ck_assert(memcmp(swapped, expected, nwords * sizeof(uint32_t)) == 0);
+        network_order_words32(swapped, swapped, nwords);
+        ck_assert(memcmp(swapped, words, nwords * sizeof(uint32_t)) == 0);
+    }
+    network_order_words64(longs, swapped64, 37);
+    for (i = 0; i < 37; i++) {
+        ck_assert(swapped64[i] == (((uint64_t)htonl(longs[i])) << 32 | htonl(longs[i] >> 32)));
+    }
+    network_order_words64(swapped64, swapped64, 37);
+    ck_assert(memcmp(swapped64, longs, sizeof(longs)) == 0);
+}
+END_TEST
+
+
+START_TEST(test_context_reuse)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float from_context[NROWS * NCOLS];
+    unsigned char *packed, *repacked;
+    void *scratch[WGDOS_CONTEXT_SLOTS];
+    wgdos_context context;
+    int packed_length, repacked_length;
+    int rc, pass;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    repacked = calloc(2 * NROWS * NCOLS + 1024, sizeof(int));
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    wgdos_context_init(&context);
+    for (pass = 0; pass < 3; pass++) {
+        rc = wgdos_unpack_ctx(&context, (char *)packed, NROWS * NCOLS, from_context, MDI, NULL);
+        ck_assert_int_eq(rc, 0);
+        ck_assert(memcmp(unpacked, from_context, sizeof(unpacked)) == 0);
+
+        rc = wgdos_pack_ctx(&context, NCOLS, NROWS, field, MDI, BPACC, repacked, &repacked_length, NULL);
+        ck_assert_int_eq(rc, 0);
+        ck_assert_int_eq(repacked_length, packed_length);
+        ck_assert(memcmp(packed, repacked, 4 * packed_length) == 0);
+
+        // After the first pass, the same work areas are used again
+        if (pass == 0) {
+            memcpy(scratch, context.scratch, sizeof(scratch));
+        } else {
+            ck_assert(memcmp(scratch, context.scratch, sizeof(scratch)) == 0);
+        }
+    }
+    wgdos_context_free(&context);
+    free(repacked);
+    free(packed);
+}
+END_TEST
+
+
+// Unpack the same field a number of times in one thread, noting the error state it is left with
+typedef struct {
+    unsigned char *packed;
+    int rc;
+    int logerrno;
+} unpack_job;
+
+
+static void *unpack_job_run(void *arg)
+{
+    unpack_job *job = (unpack_job *)arg;
+    float unpacked[NROWS * NCOLS];
+    int pass, rc;
+
+    job->rc = 0;
+    for (pass = 0; pass < 20; pass++) {
+        rc = wgdos_unpack((char *)job->packed, NROWS * NCOLS, unpacked, MDI, NULL);
+        if (rc) {
+            job->rc = rc;
+        }
+    }
+    job->logerrno = get_logerrno();
+    return NULL;
+}
+
+
+START_TEST(test_error_state_per_thread)
+{
+    float field[NROWS * NCOLS];
+    unsigned char *packed, *broken;
+    int packed_length;
+    pthread_t threads[4];
+    unpack_job jobs[4];
+    int t;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    broken = malloc(4 * packed_length);
+    memcpy(broken, packed, 4 * packed_length);
+    // Make the first row claim to be longer than it is
+    broken[19]++;
+
+    reset_logerrno();
+    for (t = 0; t < 4; t++) {
+        jobs[t].packed = (t == 0) ? broken : packed;
+        ck_assert_int_eq(pthread_create(&threads[t], NULL, unpack_job_run, &jobs[t]), 0);
+    }
+    for (t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // Only the thread given the broken field sees the error
+    ck_assert_int_ne(jobs[0].rc, 0);
+    ck_assert_int_eq(jobs[0].logerrno, LOGERRNO_FORMAT_EXCEPTION);
+    for (t = 1; t < 4; t++) {
+        ck_assert_int_eq(jobs[t].rc, 0);
+        ck_assert_int_eq(jobs[t].logerrno, LOGERRNO_NO_EXCEPTION);
+    }
+    ck_assert_int_eq(get_logerrno(), LOGERRNO_NO_EXCEPTION);
+    free(broken);
+    free(packed);
+}
+END_TEST
+
+
+// PP header words used by the batch unpack
+#define LBLREC 14
+#define LBROW 17
+#define LBNPT 18
+#define LBEXT 19
+#define LBPACK 20
+#define BMDI 62
+#define BIG_NCOLS 300
+#define BIG_NROWS 250
+
+
+static void make_lookup(uint32_t *lookup, int ncols, int nrows, int pack, int data_size)
+{
+    float mdi = MDI;
+
+    memset(lookup, 0, 64 * sizeof(uint32_t));
+    lookup[LBLREC] = data_size;
+    lookup[LBROW] = nrows;
+    lookup[LBNPT] = ncols;
+    lookup[LBPACK] = pack;
+    memcpy(&lookup[BMDI], &mdi, sizeof(float));
+}
+
+
+START_TEST(test_unpack_batch)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float *big, *big_unpacked;
+    static float to[6][BIG_NROWS * BIG_NCOLS];
+    uint32_t lookups[6][64];
+    uint32_t raw[NROWS * NCOLS];
+    unsigned char *packed, *big_packed, *broken;
+    ppfield_batch_item items[6];
+    int packed_length, big_length;
+    int i, rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // One field big enough to be split into runs of rows
+    big = malloc(BIG_NROWS * BIG_NCOLS * sizeof(float));
+    big_unpacked = malloc(BIG_NROWS * BIG_NCOLS * sizeof(float));
+    big_packed = calloc(2 * BIG_NROWS * BIG_NCOLS + 1024, sizeof(int));
+    for (i = 0; i < BIG_NROWS * BIG_NCOLS; i++) {
+        big[i] = (i % 97 == 3) ? MDI : 280.0 + 20.0 * sin(i * 0.001);
+    }
+    rc = wgdos_pack(BIG_NCOLS, BIG_NROWS, big, MDI, BPACC, big_packed, &big_length, NULL);
+    ck_assert_int_eq(rc, 0);
+    rc = wgdos_unpack((char *)big_packed, BIG_NROWS * BIG_NCOLS, big_unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    broken = malloc(4 * packed_length);
+    memcpy(broken, packed, 4 * packed_length);
+    broken[19]++;
+
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        memcpy(&raw[i], &field[i], sizeof(float));
+        raw[i] = htonl(raw[i]);
+    }
+
+    make_lookup(lookups[0], NCOLS, NROWS, WGDOS_PACKED, packed_length);
+    make_lookup(lookups[1], BIG_NCOLS, BIG_NROWS, WGDOS_PACKED, big_length);
+    make_lookup(lookups[2], NCOLS, NROWS, UNPACKED, NROWS * NCOLS);
+    make_lookup(lookups[3], NCOLS, NROWS, WGDOS_PACKED, packed_length);
+    make_lookup(lookups[4], NCOLS, NROWS, WGDOS_PACKED, packed_length);
+    make_lookup(lookups[5], NCOLS, NROWS, WGDOS_PACKED, packed_length);
+    for (i = 0; i < 6; i++) {
+        items[i].lookup = lookups[i];
+        items[i].data = (char *)packed;
+        items[i].to = to[i];
+    }
+    items[1].data = (char *)big_packed;
+    items[2].data = (char *)raw;
+    items[4].data = (char *)broken;
+    items[5].to = NULL;
+
+    // The broken field fails on its own, the rest unpack as they would one at a time
+    rc = unpack_ppfield_batch32(items, 6, 4, NULL);
+    ck_assert_int_eq(rc, 1);
+    for (i = 0; i < 6; i++) {
+        ck_assert_int_eq(items[i].status, i == 4);
+        ck_assert_int_eq(lookups[i][LBPACK], 0);
+    }
+    ck_assert(memcmp(to[0], unpacked, sizeof(unpacked)) == 0);
+    ck_assert(memcmp(to[1], big_unpacked, BIG_NROWS * BIG_NCOLS * sizeof(float)) == 0);
+    ck_assert(memcmp(to[2], field, sizeof(field)) == 0);
+    ck_assert(memcmp(to[3], unpacked, sizeof(unpacked)) == 0);
+    reset_logerrno();
+
+    free(broken);
+    free(big_packed);
+    free(big_unpacked);
+    free(big);
+    free(packed);
+}
+END_TEST
+
+
+// Write one field to a PP file as a header record and a data record
+static void write_pp_field(FILE *fp, uint32_t *lookup, void *data, int data_words, int swap_data)
+{
+    uint32_t words[64];
+    uint32_t marker;
+    uint32_t *data_words_p = (uint32_t *)data;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        words[i] = htonl(lookup[i]);
+    }
+    marker = htonl(sizeof(words));
+    fwrite(&marker, 4, 1, fp);
+    fwrite(words, 4, 64, fp);
+    fwrite(&marker, 4, 1, fp);
+    marker = htonl(4 * data_words);
+    fwrite(&marker, 4, 1, fp);
+    for (i = 0; i < data_words; i++) {
+        uint32_t word = swap_data ? htonl(data_words_p[i]) : data_words_p[i];
+        fwrite(&word, 4, 1, fp);
+    }
+    fwrite(&marker, 4, 1, fp);
+}
+
+
+START_TEST(test_pp_file)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float to[NROWS * NCOLS];
+    uint32_t lookup[64];
+    unsigned char *packed;
+    char path[] = "/tmp/check_wgdos_XXXXXX";
+    pp_file file;
+    FILE *fp;
+    int packed_length;
+    int fd, rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    fp = fdopen(fd, "wb");
+    make_lookup(lookup, NCOLS, NROWS, WGDOS_PACKED, packed_length);
+    write_pp_field(fp, lookup, packed, packed_length, 0);
+    make_lookup(lookup, NCOLS, NROWS, UNPACKED, NROWS * NCOLS);
+    write_pp_field(fp, lookup, field, NROWS * NCOLS, 1);
+    fclose(fp);
+
+    rc = pp_file_open(path, &file, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(file.nfields, 2);
+    ck_assert_int_eq(file.fields[0].lookup[LBPACK], WGDOS_PACKED);
+    ck_assert_int_eq(file.fields[1].lookup[LBNPT], NCOLS);
+
+    // Either field can be unpacked, as often as wanted
+    rc = pp_file_unpack(&file, 1, to, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(to, field, sizeof(field)) == 0);
+    rc = pp_file_unpack(&file, 0, to, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(to, unpacked, sizeof(unpacked)) == 0);
+    rc = pp_file_unpack(&file, 0, to, NULL);
+    ck_assert_int_eq(rc, 0);
+    rc = pp_file_unpack(&file, 2, to, NULL);
+    ck_assert_int_ne(rc, 0);
+    pp_file_close(&file);
+
+    // A file cut short is not opened
+    rc = truncate(path, 4 * (64 + 4 + packed_length) + 100);
+    ck_assert_int_eq(rc, 0);
+    rc = pp_file_open(path, &file, NULL);
+    ck_assert_int_ne(rc, 0);
+    ck_assert(file.map == NULL);
+    reset_logerrno();
+
+    unlink(path);
+    free(packed);
+}
+END_TEST
+
+
+// Fieldsfile header and lookup words used, from 0
+#define FF_LOOKUP_START 149
+#define FF_LOOKUP_LENGTH 150
+#define FF_LOOKUP_COUNT 151
+#define LBEGIN 28
+#define LBNREC 29
+// Packing code of 32 bit reals, two to a word
+#define CRAY32_PACKED 2
+
+
+static uint64_t big_endian64(uint64_t word)
+{
+    return ((uint64_t)htonl(word) << 32) | htonl(word >> 32);
+}
+
+
+START_TEST(test_ff_file)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float to[NROWS * NCOLS];
+    uint64_t header[256];
+    uint64_t lookups[3][64];
+    double values[NROWS * NCOLS];
+    uint32_t cray32[NROWS * NCOLS];
+    uint32_t word32;
+    double mdi = MDI;
+    unsigned char *packed;
+    char path[] = "/tmp/check_wgdos_XXXXXX";
+    ff_file file;
+    FILE *fp;
+    int packed_length, wgdos_words;
+    int which[2] = {1, 0};
+    int fd, i, rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    wgdos_words = (packed_length + 1) / 2;
+
+    // A WGDOS field, a field of 64 bit reals and an unused lookup entry
+    memset(header, 0, sizeof(header));
+    header[FF_LOOKUP_START] = 257;
+    header[FF_LOOKUP_LENGTH] = 64;
+    header[FF_LOOKUP_COUNT] = 3;
+    memset(lookups, 0, sizeof(lookups));
+    for (i = 0; i < 2; i++) {
+        lookups[i][LBROW] = NROWS;
+        lookups[i][LBNPT] = NCOLS;
+        memcpy(&lookups[i][BMDI], &mdi, sizeof(double));
+    }
+    lookups[0][LBPACK] = WGDOS_PACKED;
+    lookups[0][LBLREC] = wgdos_words;
+    lookups[0][LBEGIN] = 256 + 3 * 64;
+    lookups[0][LBNREC] = wgdos_words;
+    lookups[1][LBPACK] = UNPACKED;
+    lookups[1][LBLREC] = NROWS * NCOLS;
+    lookups[1][LBEGIN] = 256 + 3 * 64 + wgdos_words;
+    lookups[1][LBNREC] = NROWS * NCOLS;
+    for (i = 0; i < 64; i++) {
+        lookups[2][i] = (uint64_t)-99;
+    }
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        uint64_t word;
+        values[i] = field[i];
+        memcpy(&word, &values[i], sizeof(double));
+        word = big_endian64(word);
+        memcpy(&values[i], &word, sizeof(double));
+    }
+    for (i = 0; i < 256; i++) {
+        header[i] = big_endian64(header[i]);
+    }
+    for (i = 0; i < 3 * 64; i++) {
+        lookups[i / 64][i % 64] = big_endian64(lookups[i / 64][i % 64]);
+    }
+
+    fd = mkstemp(path);
+    ck_assert_int_ge(fd, 0);
+    fp = fdopen(fd, "wb");
+    fwrite(header, sizeof(header), 1, fp);
+    fwrite(lookups, sizeof(lookups), 1, fp);
+    fwrite(packed, 8, wgdos_words, fp);
+    fwrite(values, sizeof(values), 1, fp);
+    fclose(fp);
+
+    rc = ff_file_open(path, &file, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(file.nfields, 2);
+    ck_assert_int_eq(file.fixed_header[FF_LOOKUP_COUNT], 3);
+    ck_assert_int_eq(file.fields[1].lookup[LBNPT], NCOLS);
+    ck_assert_int_eq(file.fields[0].data_offset, 8 * (256 + 3 * 64));
+
+    ff_file_prefetch(&file, which, 2);
+    rc = ff_file_unpack(&file, 1, to, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(to, field, sizeof(field)) == 0);
+    rc = ff_file_unpack(&file, 0, to, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(to, unpacked, sizeof(unpacked)) == 0);
+    ff_file_close(&file);
+
+    // The second field as 32 bit reals, two to each 64 bit word
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        memcpy(&word32, &field[i], sizeof(float));
+        cray32[i] = htonl(word32);
+    }
+    lookups[1][LBPACK] = big_endian64(CRAY32_PACKED);
+    lookups[1][LBLREC] = big_endian64(NROWS * NCOLS / 2);
+    fp = fopen(path, "r+b");
+    fseek(fp, sizeof(header), SEEK_SET);
+    fwrite(lookups, sizeof(lookups), 1, fp);
+    fseek(fp, 8 * (256 + 3 * 64 + wgdos_words), SEEK_SET);
+    fwrite(cray32, sizeof(cray32), 1, fp);
+    fclose(fp);
+    rc = ff_file_open(path, &file, NULL);
+    ck_assert_int_eq(rc, 0);
+    memset(to, 0, sizeof(to));
+    rc = ff_file_unpack(&file, 1, to, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(to, field, sizeof(field)) == 0);
+    ff_file_close(&file);
+
+    // Too few words for all the values
+    lookups[1][LBLREC] = big_endian64(NROWS * NCOLS / 2 - 1);
+    fp = fopen(path, "r+b");
+    fseek(fp, sizeof(header), SEEK_SET);
+    fwrite(lookups, sizeof(lookups), 1, fp);
+    fclose(fp);
+    rc = ff_file_open(path, &file, NULL);
+    ck_assert_int_eq(rc, 0);
+    rc = ff_file_unpack(&file, 1, to, NULL);
+    ck_assert_int_ne(rc, 0);
+    reset_logerrno();
+    ff_file_close(&file);
+
+    // Sizes whose products in words or bytes overflow 64 bits
+    fp = fopen(path, "r+b");
+    header[FF_LOOKUP_LENGTH] = big_endian64(((uint64_t)1 << 62) + 16);
+    header[FF_LOOKUP_COUNT] = big_endian64(4);
+    fwrite(header, sizeof(header), 1, fp);
+    fclose(fp);
+    rc = ff_file_open(path, &file, NULL);
+    ck_assert_int_ne(rc, 0);
+    reset_logerrno();
+    fp = fopen(path, "r+b");
+    header[FF_LOOKUP_LENGTH] = big_endian64(64);
+    header[FF_LOOKUP_COUNT] = big_endian64(3);
+    lookups[0][LBEGIN] = big_endian64((uint64_t)1 << 60);
+    lookups[0][LBNREC] = big_endian64(((uint64_t)1 << 60) + 10);
+    fwrite(header, sizeof(header), 1, fp);
+    fwrite(lookups, sizeof(lookups), 1, fp);
+    fclose(fp);
+    rc = ff_file_open(path, &file, NULL);
+    ck_assert_int_ne(rc, 0);
+    reset_logerrno();
+
+    // A lookup table that runs past the end of the file
+    rc = truncate(path, 8 * (256 + 64));
+    ck_assert_int_eq(rc, 0);
+    rc = ff_file_open(path, &file, NULL);
+    ck_assert_int_ne(rc, 0);
+    reset_logerrno();
+
+    unlink(path);
+    free(packed);
+}
+END_TEST
+
+
+// PP header words used by the lookup index
+#define LBREL 21
+#define LBPROC 24
+#define LBLEV 32
+#define LBUSER4 41
+
+
+START_TEST(test_lookup_index)
+{
+    uint32_t lookups[300][64];
+    int found[300];
+    lookup_index index;
+    lookup_query query;
+    int stashes[3] = {16203, 3236, 16222};
+    int i, n, q, rc, expected;
+
+    memset(lookups, 0, sizeof(lookups));
+    for (i = 0; i < 300; i++) {
+        lookups[i][LBUSER4] = stashes[i % 3];
+        lookups[i][LBLEV] = (i / 3) % 10;
+        lookups[i][LBPROC] = (i % 7 == 0) ? 128 : 0;
+        lookups[i][LBREL] = 3;
+        // Validity times hourly from 2020-01-01 00:00, data time the day before
+        lookups[i][0] = 2020;
+        lookups[i][1] = 1;
+        lookups[i][2] = 1 + i / 30 / 24;
+        lookups[i][3] = (i / 30) % 24;
+        lookups[i][6] = 2019;
+        lookups[i][7] = 12;
+        lookups[i][8] = 31;
+    }
+    rc = lookup_index_build(&index, lookups, 300, sizeof(lookups[0]), FALSE, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // Each sort of query must give what checking every field would
+    for (q = 0; q < 6; q++) {
+        lookup_query_init(&query);
+        if (q != 4) {
+            query.stash = 16203;
+        }
+        if (q == 1 || q == 2) {
+            query.level = 4;
+        }
+        if (q == 2 || q == 3 || q == 4) {
+            query.validity_from = lookup_time(2020, 1, 1, 2, 0, 0);
+            query.validity_to = lookup_time(2020, 1, 1, 6, 0, 0);
+        }
+        if (q == 5) {
+            query.lbproc = 128;
+            query.data_time_from = lookup_time(2019, 12, 31, 0, 0, 0);
+        }
+        n = lookup_index_query(&index, &query, found);
+        expected = 0;
+        for (i = 0; i < 300; i++) {
+            int64_t validity = lookup_time(2020, 1, lookups[i][2], lookups[i][3], 0, 0);
+            if ((query.stash == LOOKUP_ANY || (int)lookups[i][LBUSER4] == query.stash) &&
+                (query.level == LOOKUP_ANY || (int)lookups[i][LBLEV] == query.level) &&
+                (query.lbproc == LOOKUP_ANY || (int)lookups[i][LBPROC] == query.lbproc) &&
+                validity >= query.validity_from && validity <= query.validity_to) {
+                ck_assert(expected < n);
+                ck_assert_int_eq(found[expected], i);
+                expected++;
+            }
+        }
+        ck_assert_int_eq(n, expected);
+        ck_assert_int_gt(n, 0);
+    }
+
+    query.stash = 1;
+    ck_assert_int_eq(lookup_index_query(&index, &query, found), 0);
+    lookup_index_free(&index);
+}
+END_TEST
+
+
+START_TEST(test_unpack_window)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float window[NROWS * NCOLS];
+    unsigned char *packed;
+    int windows[6][4] = {
+        {0, NROWS, 0, NCOLS}, {3, 10, 5, 50}, {10, 5, 64, 32},
+        {NROWS - 1, 1, NCOLS - 1, 1}, {0, 1, 63, 2}, {21, 12, 41, 29}
+    };
+    int packed_length;
+    int w, row, col, rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // Each window must be what cutting it out of the whole field gives
+    for (w = 0; w < 6; w++) {
+        int first_row = windows[w][0], nrows = windows[w][1];
+        int first_col = windows[w][2], ncols = windows[w][3];
+        rc = wgdos_unpack_window((char *)packed, NROWS * NCOLS, first_row, nrows,
+                                 first_col, ncols, window, MDI, NULL);
+        ck_assert_int_eq(rc, 0);
+        for (row = 0; row < nrows; row++) {
+            for (col = 0; col < ncols; col++) {
+                ck_assert(window[row * ncols + col] ==
+                          unpacked[(first_row + row) * NCOLS + first_col + col]);
+            }
+        }
+    }
+
+    rc = wgdos_unpack_window((char *)packed, NROWS * NCOLS, 30, 11, 0, 10, window, MDI, NULL);
+    ck_assert_int_ne(rc, 0);
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_unpack_reduced)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float reduced[NROWS * NCOLS];
+    unsigned char *packed;
+    int factors[4] = {1, 3, 7, 64};
+    int packed_length;
+    int f, k, out_rows, out_cols, row, col, r, c, n, rc;
+    double sum;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // Each must match reducing the whole unpacked field
+    for (f = 0; f < 4; f++) {
+        k = factors[f];
+        out_rows = (NROWS + k - 1) / k;
+        out_cols = (NCOLS + k - 1) / k;
+
+        rc = wgdos_unpack_reduced((char *)packed, NROWS * NCOLS, k, WGDOS_REDUCE_STRIDE, reduced, MDI, NULL);
+        ck_assert_int_eq(rc, 0);
+        for (row = 0; row < out_rows; row++) {
+            for (col = 0; col < out_cols; col++) {
+                ck_assert(reduced[row * out_cols + col] == unpacked[row * k * NCOLS + col * k]);
+            }
+        }
+
+        rc = wgdos_unpack_reduced((char *)packed, NROWS * NCOLS, k, WGDOS_REDUCE_MEAN, reduced, MDI, NULL);
+        ck_assert_int_eq(rc, 0);
+        for (row = 0; row < out_rows; row++) {
+            for (col = 0; col < out_cols; col++) {
+                sum = 0.0;
+                n = 0;
+                for (r = row * k; r < NROWS && r < (row + 1) * k; r++) {
+                    for (c = col * k; c < NCOLS && c < (col + 1) * k; c++) {
+                        if (unpacked[r * NCOLS + c] != MDI) {
+                            sum += unpacked[r * NCOLS + c];
+                            n++;
+                        }
+                    }
+                }
+                if (n == 0) {
+                    ck_assert(reduced[row * out_cols + col] == MDI);
+                } else {
+                    ck_assert(fabs(reduced[row * out_cols + col] - sum / n) <= 1e-4 * fabs(sum / n));
+                }
+            }
+        }
+    }
+
+    // With a factor of 1, the mean is the field itself
+    rc = wgdos_unpack_reduced((char *)packed, NROWS * NCOLS, 1, WGDOS_REDUCE_MEAN, reduced, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(reduced, unpacked, sizeof(unpacked)) == 0);
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_field_stats)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    unsigned char *packed;
+    wgdos_stats stats;
+    int packed_length;
+    int step, row, col, count, nmissing, rc;
+    float least, greatest;
+    double sum;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // Must agree with the unpacked field, over all the rows and over every third
+    for (step = 1; step <= 3; step += 2) {
+        rc = wgdos_field_stats((char *)packed, NROWS * NCOLS, step, MDI, &stats, NULL);
+        ck_assert_int_eq(rc, 0);
+
+        count = nmissing = 0;
+        sum = 0.0;
+        least = 1e30;
+        greatest = -1e30;
+        for (row = 0; row < NROWS; row += step) {
+            for (col = 0; col < NCOLS; col++) {
+                float value = unpacked[row * NCOLS + col];
+                if (value == MDI) {
+                    nmissing++;
+                    continue;
+                }
+                count++;
+                sum += value;
+                least = value < least ? value : least;
+                greatest = value > greatest ? value : greatest;
+            }
+        }
+        ck_assert_int_eq(stats.rows, (NROWS + step - 1) / step);
+        ck_assert_int_eq(stats.count, count);
+        ck_assert_int_eq(stats.ndata + stats.nzeros, count);
+        ck_assert_int_gt(stats.nzeros, 0);
+        ck_assert_int_eq(stats.nmissing, nmissing);
+        ck_assert(stats.min == least);
+        ck_assert(stats.max == greatest);
+        ck_assert(fabs(stats.sum - sum) <= 1e-6 * fabs(sum));
+    }
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_row_reader)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float row_data[NCOLS];
+    unsigned char *packed;
+    wgdos_row_reader reader;
+    int packed_length;
+    int row_offsets[NROWS + 1];
+    uint32_t total_length;
+    int row, rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // Every row as wgdos_unpack gives it, then the end
+    rc = wgdos_row_reader_open(&reader, (char *)packed, NROWS * NCOLS, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(reader.nrows, NROWS);
+    ck_assert_int_eq(reader.ncols, NCOLS);
+    for (row = 0; row < NROWS; row++) {
+        ck_assert_int_eq(wgdos_row_reader_next(&reader, row_data, NULL), 1);
+        ck_assert(memcmp(row_data, &unpacked[row * NCOLS], sizeof(row_data)) == 0);
+    }
+    ck_assert_int_eq(wgdos_row_reader_next(&reader, row_data, NULL), 0);
+    wgdos_row_reader_close(&reader);
+
+    // Stepping over rows lands on the right one
+    rc = wgdos_row_reader_open(&reader, (char *)packed, NROWS * NCOLS, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(wgdos_row_reader_skip(&reader, 5, NULL), 0);
+    ck_assert_int_eq(wgdos_row_reader_next(&reader, row_data, NULL), 1);
+    ck_assert(memcmp(row_data, &unpacked[5 * NCOLS], sizeof(row_data)) == 0);
+    ck_assert_int_eq(wgdos_row_reader_skip(&reader, NROWS, NULL), 0);
+    ck_assert_int_eq(wgdos_row_reader_next(&reader, row_data, NULL), 0);
+    wgdos_row_reader_close(&reader);
+
+    // A field cut short fails at the row that runs past its end
+    total_length = ((uint32_t *)packed)[0];
+    ((uint32_t *)packed)[0] = htonl(ntohl(total_length) / 2);
+    rc = wgdos_row_reader_open(&reader, (char *)packed, NROWS * NCOLS, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    while ((rc = wgdos_row_reader_next(&reader, row_data, NULL)) == 1)
+        ;
+    ck_assert_int_eq(rc, -1);
+    ck_assert_int_lt(reader.row, NROWS);
+    wgdos_row_reader_close(&reader);
+    ((uint32_t *)packed)[0] = total_length;
+
+    // A last row of no words whose 31 bit values would run past the field
+    rc = wgdos_scan_row_offsets((char *)packed, NROWS, row_offsets, NULL);
+    ck_assert_int_eq(rc, 0);
+    ((uint32_t *)(packed + row_offsets[NROWS - 1]))[1] = htonl(31 << 16);
+    rc = wgdos_row_reader_open(&reader, (char *)packed, NROWS * NCOLS, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    while ((rc = wgdos_row_reader_next(&reader, row_data, NULL)) == 1)
+        ;
+    ck_assert_int_eq(rc, -1);
+    ck_assert_int_eq(reader.row, NROWS - 1);
+    wgdos_row_reader_close(&reader);
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_push_decoder)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float pushed[NROWS * NCOLS];
+    unsigned char *packed;
+    wgdos_push_decoder decoder;
+    uint32_t row_word;
+    int packed_length, field_bytes;
+    int chunk, offset, step, rc;
+    static const int chunks[] = {1, 3, 7, 8, 12, 100, 4096};
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    field_bytes = 4 * ntohl(*(uint32_t *)packed);
+
+    // Chunks of every size, so splitting the field header, row headers and rows anywhere
+    for (chunk = 0; chunk < (int)(sizeof(chunks) / sizeof(chunks[0])); chunk++) {
+        memset(pushed, 0, sizeof(pushed));
+        rc = wgdos_push_decoder_open(&decoder, NROWS * NCOLS, pushed, MDI, NULL);
+        ck_assert_int_eq(rc, 0);
+        for (offset = 0, rc = 0; offset < field_bytes && rc == 0; offset += step) {
+            step = field_bytes - offset < chunks[chunk] ? field_bytes - offset : chunks[chunk];
+            rc = wgdos_push_decoder_feed(&decoder, (char *)packed + offset, step, NULL);
+            ck_assert_int_ge(rc, 0);
+        }
+        ck_assert_int_eq(rc, 1);
+        ck_assert_int_eq(decoder.row, NROWS);
+        ck_assert(memcmp(pushed, unpacked, sizeof(pushed)) == 0);
+        wgdos_push_decoder_close(&decoder);
+    }
+
+    // Rows are unpacked as they arrive, and a broken field fails
+    rc = wgdos_push_decoder_open(&decoder, NROWS * NCOLS, pushed, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(wgdos_push_decoder_feed(&decoder, (char *)packed, field_bytes / 2, NULL), 0);
+    ck_assert_int_gt(decoder.row, 0);
+    ck_assert_int_lt(decoder.row, NROWS);
+    wgdos_push_decoder_close(&decoder);
+
+    // A first row of no words whose 31 bit values would run past the carry buffer
+    row_word = ((uint32_t *)packed)[4];
+    ((uint32_t *)packed)[4] = htonl(31 << 16);
+    rc = wgdos_push_decoder_open(&decoder, NROWS * NCOLS, pushed, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    for (offset = 0, rc = 0; offset < field_bytes && rc == 0; offset++) {
+        rc = wgdos_push_decoder_feed(&decoder, (char *)packed + offset, 1, NULL);
+    }
+    ck_assert_int_eq(rc, -1);
+    ck_assert_int_eq(decoder.row, 0);
+    wgdos_push_decoder_close(&decoder);
+    ((uint32_t *)packed)[4] = row_word;
+
+    ((uint32_t *)packed)[0] = htonl(ntohl(((uint32_t *)packed)[0]) / 2);
+    rc = wgdos_push_decoder_open(&decoder, NROWS * NCOLS, pushed, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(wgdos_push_decoder_feed(&decoder, (char *)packed, field_bytes, NULL), -1);
+    ck_assert_int_eq(wgdos_push_decoder_feed(&decoder, (char *)packed, 4, NULL), -1);
+    wgdos_push_decoder_close(&decoder);
+    free(packed);
+}
+END_TEST
+
+
+// Cut nbytes of data into segments of the sizes given, over and over
+static int cut_segments(char *data, int nbytes, const int *sizes, int nsizes, struct iovec *iov)
+{
+    int iovcnt, offset, size;
+
+    for (iovcnt = 0, offset = 0; offset < nbytes; iovcnt++, offset += size) {
+        size = sizes[iovcnt % nsizes];
+        size = nbytes - offset < size ? nbytes - offset : size;
+        iov[iovcnt].iov_base = data + offset;
+        iov[iovcnt].iov_len = size;
+    }
+    return iovcnt;
+}
+
+
+START_TEST(test_unpack_iov)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float from_iov[NROWS * NCOLS];
+    float thin[NROWS * NCOLS];
+    float raw[NROWS * NCOLS];
+    unsigned char *packed;
+    char *copy;
+    struct iovec iov[NROWS * NCOLS * 4];
+    uint32_t lookup[64];
+    int packed_length, field_bytes, thin_length;
+    int iovcnt, rc;
+    static const int sizes[] = {1, 3, 5, 7, 64, 333, 2};
+
+    make_field(field);
+
+    // WGDOS packed
+    packed = pack_field(field, &packed_length);
+    field_bytes = 4 * ntohl(*(uint32_t *)packed);
+    copy = malloc(field_bytes);
+    memcpy(copy, packed, field_bytes);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    iovcnt = cut_segments(copy, field_bytes, sizes, 7, iov);
+    make_lookup(lookup, NCOLS, NROWS, WGDOS_PACKED, field_bytes / 4);
+    rc = unpack_ppfield32_iov(lookup, iov, iovcnt, from_iov, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(from_iov, unpacked, sizeof(unpacked)) == 0);
+    ck_assert_int_eq(lookup[LBPACK], 0);
+    ck_assert(memcmp(copy, packed, field_bytes) == 0);
+
+    // Missing the end
+    rc = unpack_ppfield_iov(MDI, field_bytes / 4, iov, iovcnt - 2, WGDOS_PACKED, NROWS * NCOLS, from_iov, NULL);
+    ck_assert_int_ne(rc, 0);
+    free(copy);
+    free(packed);
+
+    // Unpacked, in network order
+    network_order_words32(field, raw, NROWS * NCOLS);
+    iovcnt = cut_segments((char *)raw, sizeof(raw), sizes, 7, iov);
+    rc = unpack_ppfield_iov(MDI, NROWS * NCOLS, iov, iovcnt, UNPACKED, NROWS * NCOLS, from_iov, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(from_iov, field, sizeof(field)) == 0);
+
+    // RLE packed, in network order
+    thin_length = NROWS * NCOLS;
+    rc = runlen_encode(field, NROWS * NCOLS, thin, &thin_length, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_lt(thin_length, NROWS * NCOLS);
+    network_order_words32(thin, raw, thin_length);
+    iovcnt = cut_segments((char *)raw, thin_length * 4, sizes, 7, iov);
+    rc = unpack_ppfield_iov(MDI, thin_length, iov, iovcnt, RLE_PACKED, NROWS * NCOLS, from_iov, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(from_iov, field, sizeof(field)) == 0);
+    rc = unpack_ppfield_iov(MDI, thin_length, iov, iovcnt - 1, RLE_PACKED, NROWS * NCOLS, from_iov, NULL);
+    ck_assert_int_ne(rc, 0);
+}
+END_TEST
+
+
+START_TEST(test_unpack_quantized)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    unsigned char *packed;
+    uint32_t values32[NROWS * NCOLS];
+    uint16_t values16[NROWS * NCOLS];
+    uint64_t missing[NROWS * ((NCOLS + 63) / 64)];
+    uint64_t zero[NROWS * ((NCOLS + 63) / 64)];
+    float base[NROWS];
+    int bits[NROWS];
+    wgdos_quantized quantized;
+    int packed_length, nwords, widest;
+    int row, col, i, rc;
+    uint64_t bit;
+    float value;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // base+accuracy*n, the bitmaps and the mdi give back the unpacked field exactly
+    memset(&quantized, 0, sizeof(quantized));
+    quantized.base = base;
+    quantized.bits_per_value = bits;
+    quantized.values = values32;
+    quantized.missing_data = missing;
+    quantized.zero = zero;
+    rc = wgdos_unpack_quantized((char *)packed, NROWS * NCOLS, 4, &quantized, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(quantized.nrows, NROWS);
+    ck_assert_int_eq(quantized.ncols, NCOLS);
+    nwords = (NCOLS + 63) / 64;
+    widest = 0;
+    for (row = 0; row < NROWS; row++) {
+        widest = bits[row] > widest ? bits[row] : widest;
+        for (col = 0; col < NCOLS; col++) {
+            i = row * NCOLS + col;
+            bit = (uint64_t)1 << (63 - col % 64);
+            if (missing[row * nwords + col / 64] & bit) {
+                value = MDI;
+            } else if (zero[row * nwords + col / 64] & bit) {
+                value = 0.0;
+            } else {
+                value = (double)quantized.accuracy * values32[i] + (double)base[row];
+                ck_assert(values32[i] < (1u << bits[row]) || bits[row] == 0);
+            }
+            ck_assert(value == unpacked[i]);
+        }
+    }
+
+    // The same integers as uint16_t, without the bitmaps, if they fit
+    quantized.values = values16;
+    quantized.missing_data = NULL;
+    quantized.zero = NULL;
+    quantized.bits_per_value = NULL;
+    rc = wgdos_unpack_quantized((char *)packed, NROWS * NCOLS, 2, &quantized, NULL);
+    if (widest <= 16) {
+        ck_assert_int_eq(rc, 0);
+        for (i = 0; i < NROWS * NCOLS; i++) {
+            ck_assert_int_eq(values16[i], values32[i]);
+        }
+    } else {
+        ck_assert_int_ne(rc, 0);
+    }
+    ck_assert_int_ne(wgdos_unpack_quantized((char *)packed, NROWS * NCOLS, 3, &quantized, NULL), 0);
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_unpack_half)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float back[NROWS * NCOLS];
+    uint16_t halves[NROWS * NCOLS];
+    float nans[11];
+    uint32_t nan_bits[11];
+    unsigned char *packed;
+    int packed_length;
+    int i, format, rc;
+    // Rounding, overflow, subnormals and mdi, more than 8 so as to need the scalar code too
+    static const float values[11] = {1.0f, -2.0f, 1.0f / 3.0f, 65504.0f, 65519.0f, 65520.0f,
+                                     5.9604645e-8f, 2.9802322e-8f, 4.4703484e-8f, MDI, 0.0f};
+    static const uint16_t float16[11] = {0x3c00, 0xc000, 0x3555, 0x7bff, 0x7bff, 0x7c00,
+                                         0x0001, 0x0000, 0x0001, 0x7e00, 0x0000};
+    static const uint16_t bfloat16[11] = {0x3f80, 0xc000, 0x3eab, 0x4780, 0x4780, 0x4780,
+                                          0x3380, 0x3300, 0x3340, 0x7fc0, 0x0000};
+
+    convert_float_ieee32_to_half(values, halves, 11, HALF_FLOAT16, MDI, 0x7e00);
+    for (i = 0; i < 11; i++) {
+        ck_assert_int_eq(halves[i], float16[i]);
+    }
+    convert_float_ieee32_to_half(values, halves, 11, HALF_BFLOAT16, MDI, 0x7fc0);
+    for (i = 0; i < 11; i++) {
+        ck_assert_int_eq(halves[i], bfloat16[i]);
+    }
+
+    // NaNs keep their sign and the top of their payload, the same with F16C (the first 8) as without
+    for (i = 0; i < 11; i++) {
+        nan_bits[i] = (i % 2 ? 0xff800000u : 0x7f800000u) | (0x00400000u >> (i % 3)) | ((uint32_t)i << 16) | 0x1fff;
+        memcpy(&nans[i], &nan_bits[i], sizeof(float));
+    }
+    convert_float_ieee32_to_half(nans, halves, 11, HALF_FLOAT16, MDI, 0x7e00);
+    for (i = 0; i < 11; i++) {
+        ck_assert_int_eq(halves[i], ((nan_bits[i] >> 16) & 0x8000) | 0x7e00 | ((nan_bits[i] & 0x7fffff) >> 13));
+    }
+
+    // A whole field, to within the precision of each format
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    for (format = HALF_FLOAT16; format <= HALF_BFLOAT16; format++) {
+        rc = wgdos_unpack_half((char *)packed, NROWS * NCOLS, format, halves, MDI, 0xffff, NULL);
+        ck_assert_int_eq(rc, 0);
+        convert_float_half_to_ieee32(halves, back, NROWS * NCOLS, format);
+        for (i = 0; i < NROWS * NCOLS; i++) {
+            if (unpacked[i] == MDI) {
+                ck_assert_int_eq(halves[i], 0xffff);
+            } else {
+                ck_assert(fabs(back[i] - unpacked[i]) <= fabs(unpacked[i]) / (format == HALF_FLOAT16 ? 2048 : 256));
+            }
+        }
+    }
+    free(packed);
+}
+END_TEST
+
+
+START_TEST(test_unpack_sparse)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float thin[NROWS * NCOLS];
+    float values[NROWS * NCOLS];
+    int indices[NROWS * NCOLS];
+    int row_start[NROWS + 1];
+    unsigned char *packed;
+    int packed_length, thin_length;
+    int npoints, nvalid, i, n, row, rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // Exactly the points of the unpacked field that are not mdi, in order
+    rc = wgdos_unpack_sparse((char *)packed, NROWS * NCOLS, NROWS * NCOLS, indices, values,
+                             row_start, &npoints, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    for (i = 0, n = 0; i < NROWS * NCOLS; i++) {
+        if (unpacked[i] != MDI) {
+            ck_assert_int_lt(n, npoints);
+            ck_assert_int_eq(indices[n], i);
+            ck_assert(values[n] == unpacked[i]);
+            n++;
+        }
+    }
+    ck_assert_int_eq(npoints, n);
+    ck_assert_int_lt(npoints, NROWS * NCOLS);
+    nvalid = npoints;
+    for (row = 0; row < NROWS; row++) {
+        ck_assert_int_le(row_start[row], row_start[row + 1]);
+        for (i = row_start[row]; i < row_start[row + 1]; i++) {
+            ck_assert_int_eq(indices[i] / NCOLS, row);
+        }
+    }
+    ck_assert_int_eq(row_start[NROWS], npoints);
+
+    // Not enough room
+    rc = wgdos_unpack_sparse((char *)packed, NROWS * NCOLS, nvalid - 1, indices, values,
+                             NULL, &npoints, MDI, NULL);
+    ck_assert_int_ne(rc, 0);
+    free(packed);
+
+    // RLE packed, through unpack_ppfield_sparse
+    thin_length = NROWS * NCOLS;
+    rc = runlen_encode(field, NROWS * NCOLS, thin, &thin_length, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    network_order_words32(thin, thin, thin_length);
+    rc = unpack_ppfield_sparse(MDI, thin_length, (char *)thin, RLE_PACKED, NROWS * NCOLS,
+                               NROWS * NCOLS, indices, values, &npoints, NULL);
+    ck_assert_int_eq(rc, 0);
+    for (i = 0, n = 0; i < NROWS * NCOLS; i++) {
+        if (field[i] != MDI) {
+            ck_assert_int_eq(indices[n], i);
+            ck_assert(values[n] == field[i]);
+            n++;
+        }
+    }
+    ck_assert_int_eq(npoints, n);
+
+    // Unpacked
+    network_order_words32(field, thin, NROWS * NCOLS);
+    rc = unpack_ppfield_sparse(MDI, NROWS * NCOLS, (char *)thin, UNPACKED, NROWS * NCOLS,
+                               NROWS * NCOLS, indices, values, &npoints, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(npoints, n);
+    ck_assert_int_eq(indices[npoints - 1], NROWS * NCOLS - 1);
+}
+END_TEST
+
+
+START_TEST(test_unpack_transformed)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float transformed[NROWS * NCOLS];
+    float thin[NROWS * NCOLS];
+    unsigned char *packed;
+    unpack_transform transform;
+    int packed_length, thin_length;
+    float clash;
+    int i, rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+
+    // No change gives the unpacked field exactly
+    unpack_transform_init(&transform, MDI);
+    rc = wgdos_unpack_transformed((char *)packed, NROWS * NCOLS, transformed, MDI, &transform, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(transformed, unpacked, sizeof(unpacked)) == 0);
+
+    // Kelvin to Fahrenheit, with NaN for missing values
+    transform.scale = 1.8;
+    transform.offset = -459.67;
+    transform.mdi_out = NAN;
+    rc = unpack_ppfield_transformed(MDI, packed_length, (char *)packed, WGDOS_PACKED, NROWS * NCOLS,
+                                    transformed, &transform, NULL);
+    ck_assert_int_eq(rc, 0);
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        ck_assert(unpacked[i] == MDI ? isnan(transformed[i]) : transformed[i] == (float)(unpacked[i] * 1.8 - 459.67));
+    }
+
+    // A data value that clashes with mdi is taken as missing, as for the other packings
+    clash = unpacked[NCOLS + 3];
+    rc = wgdos_unpack_transformed((char *)packed, NROWS * NCOLS, transformed, clash, &transform, NULL);
+    ck_assert_int_eq(rc, 0);
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        if (unpacked[i] == MDI || unpacked[i] == clash) {
+            ck_assert(isnan(transformed[i]));
+        } else {
+            ck_assert(transformed[i] == (float)(unpacked[i] * 1.8 - 459.67));
+        }
+    }
+    network_order_words32(unpacked, thin, NROWS * NCOLS);
+    rc = unpack_ppfield_transformed(clash, NROWS * NCOLS, (char *)thin, UNPACKED, NROWS * NCOLS,
+                                    field, &transform, NULL);
+    ck_assert_int_eq(rc, 0);
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        if (unpacked[i] != MDI) {
+            ck_assert(isnan(field[i]) ? isnan(transformed[i]) : field[i] == transformed[i]);
+        }
+    }
+    free(packed);
+    make_field(field);
+
+    // RLE packed and unpacked fields
+    thin_length = NROWS * NCOLS;
+    rc = runlen_encode(field, NROWS * NCOLS, thin, &thin_length, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    network_order_words32(thin, thin, thin_length);
+    rc = unpack_ppfield_transformed(MDI, thin_length, (char *)thin, RLE_PACKED, NROWS * NCOLS,
+                                    transformed, &transform, NULL);
+    ck_assert_int_eq(rc, 0);
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        ck_assert(field[i] == MDI ? isnan(transformed[i]) : transformed[i] == (float)(field[i] * 1.8 - 459.67));
+    }
+    network_order_words32(field, thin, NROWS * NCOLS);
+    memset(transformed, 0, sizeof(transformed));
+    rc = unpack_ppfield_transformed(MDI, NROWS * NCOLS, (char *)thin, UNPACKED, NROWS * NCOLS,
+                                    transformed, &transform, NULL);
+    ck_assert_int_eq(rc, 0);
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        ck_assert(field[i] == MDI ? isnan(transformed[i]) : transformed[i] == (float)(field[i] * 1.8 - 459.67));
+    }
+}
+END_TEST
+
+
+START_TEST(test_validity_mask)
+{
+    float field[NROWS * NCOLS];
+    float unpacked[NROWS * NCOLS];
+    float masked[NROWS * NCOLS];
+    float thin[NROWS * NCOLS];
+    uint8_t mask[(NROWS * NCOLS + 7) / 8];
+    uint8_t expected[(NROWS * NCOLS + 7) / 8];
+    unsigned char *packed;
+    int packed_length, thin_length;
+    int nvalid, count, i, rc;
+
+    make_field(field);
+    packed = pack_field(field, &packed_length);
+    rc = wgdos_unpack((char *)packed, NROWS * NCOLS, unpacked, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    memset(expected, 0, sizeof(expected));
+    for (i = 0, count = 0; i < NROWS * NCOLS; i++) {
+        if (unpacked[i] != MDI) {
+            expected[i / 8] |= 1 << (i % 8);
+            count++;
+        }
+    }
+
+    // From the bitmaps alone
+    memset(mask, 0xaa, sizeof(mask));
+    rc = wgdos_validity_mask((char *)packed, NROWS * NCOLS, mask, &nvalid, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(mask, expected, sizeof(mask)) == 0);
+    ck_assert_int_eq(nvalid, count);
+
+    // With the values, missing points filled
+    memset(mask, 0xaa, sizeof(mask));
+    rc = wgdos_unpack_masked((char *)packed, NROWS * NCOLS, masked, mask, -1.0f, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert(memcmp(mask, expected, sizeof(mask)) == 0);
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        ck_assert(masked[i] == (unpacked[i] == MDI ? -1.0f : unpacked[i]));
+    }
+    free(packed);
+
+    // RLE packed and unpacked fields, leaving the packed data as it is
+    thin_length = NROWS * NCOLS;
+    rc = runlen_encode(field, NROWS * NCOLS, thin, &thin_length, MDI, NULL);
+    ck_assert_int_eq(rc, 0);
+    network_order_words32(thin, thin, thin_length);
+    rc = unpack_ppfield_validity(MDI, thin_length, (char *)thin, RLE_PACKED, NROWS * NCOLS, mask, &nvalid, NULL);
+    ck_assert_int_eq(rc, 0);
+    network_order_words32(field, masked, NROWS * NCOLS);
+    rc = unpack_ppfield_validity(MDI, NROWS * NCOLS, (char *)masked, UNPACKED, NROWS * NCOLS, expected, &count, NULL);
+    ck_assert_int_eq(rc, 0);
+    ck_assert_int_eq(nvalid, count);
+    ck_assert(memcmp(mask, expected, sizeof(mask)) == 0);
+    for (i = 0; i < NROWS * NCOLS; i++) {
+        ck_assert_int_eq((mask[i / 8] >> (i % 8)) & 1, field[i] != MDI);
+    }
+}
+END_TEST
+
+
+// The row by row reference wgdos_pack keeps for rows it cannot analyse in one pass
+int count_zeros(int ncols, float *row_data, function *parent);
+int fill_bitmap(int ncols, float *row_data, float bitmap_value, int true_bits,
+                unsigned char *bitmap, int *array, function *parent);
+
+
+START_TEST(test_pack_row_analysis)
+{
+    static const int widths[] = {37, 96};
+    float field[12 * 96];
+    float unpacked[12 * 96];
+    unsigned char ref_zero[12], ref_mdi[12];
+    int array[96];
+    unsigned char *packed, *ptr;
+    int packed_length, ncols, nrows = 12;
+    int w, row, col, zeros, mdis, flags, nop, rc;
+
+    for (w = 0; w < 2; w++) {
+        ncols = widths[w];
+        // Rows that keep and drop the zero bitmap, with signed zeros, missing
+        // data, nothing but missing data and a zero in the first column
+        for (row = 0; row < nrows; row++) {
+            for (col = 0; col < ncols; col++) {
+                float value = 250.0 + 5.0 * cos(col * 0.2);
+                switch (row % 6) {
+                case 1: value = 1.0 + col; break;
+                case 2: if (col % 9 == 4) value = MDI; break;
+                case 3: value = MDI; break;
+                case 4: value = -10.0 - col % 13; break;
+                }
+                if (row % 6 != 3 && row % 6 != 5 && (col + row) % 5 == 0) {
+                    value = ((col + row) % 10 == 0) ? 0.0 : -0.0;
+                }
+                field[row * ncols + col] = value;
+            }
+        }
+        packed = calloc(2 * nrows * ncols + 1024, sizeof(int));
+        rc = wgdos_pack(ncols, nrows, field, MDI, BPACC, packed, &packed_length, NULL);
+        ck_assert_int_eq(rc, 0);
+
+        // Each row's bitmaps are those count_zeros and fill_bitmap give
+        ptr = packed + sizeof(wgdos_field_header);
+        for (row = 0; row < nrows; row++) {
+            float *row_data = &field[row * ncols];
+            flags = ntohl(((int *)ptr)[1]);
+            nop = flags % 65536;
+            zeros = count_zeros(ncols, row_data, NULL);
+            if (zeros) {
+                zeros = fill_bitmap(ncols, row_data, 0.0, 0, ref_zero, array, NULL);
+            }
+            mdis = fill_bitmap(ncols, row_data, MDI, 1, ref_mdi, array, NULL);
+            ck_assert_int_eq((flags >> 16) & 128, zeros ? 128 : 0);
+            ck_assert_int_eq((flags >> 16) & 32, mdis ? 32 : 0);
+            if (mdis) {
+                ck_assert(memcmp(ptr + 8, ref_mdi, (ncols + 7) / 8) == 0);
+            }
+            if (zeros) {
+                ck_assert(memcmp(ptr + 8 + (mdis ? (ncols + 7) / 8 : 0), ref_zero, (ncols + 7) / 8) == 0);
+            }
+            ptr += 8 + 4 * nop;
+        }
+        ck_assert_int_eq(ptr - packed, 4 * packed_length);
+        ck_assert(count_zeros(ncols, &field[1 * ncols], NULL) == 0);
+        ck_assert(count_zeros(ncols, &field[0], NULL) > 0);
+
+        // wgdos_pack starts the zero bitmap on a byte, so only whole bytes of
+        // columns read back where a row has both bitmaps
+        if (ncols % 8 == 0) {
+            rc = wgdos_unpack((char *)packed, nrows * ncols, unpacked, MDI, NULL);
+            ck_assert_int_eq(rc, 0);
+            for (col = 0; col < nrows * ncols; col++) {
+                if (field[col] == MDI) {
+                    ck_assert(unpacked[col] == MDI);
+                } else {
+                    ck_assert(fabs(unpacked[col] - field[col]) <= 2 * pow(2.0, BPACC));
+                }
+            }
+        }
+        free(packed);
+    }
+}
+END_TEST
+
+
+Suite *wgdos_suite()
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("WGDOS");
+
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_unpack_round_trip);
+    tcase_add_test(tc_core, test_unpack_threaded_matches);
+    tcase_add_test(tc_core, test_row_offsets_truncated);
+    tcase_add_test(tc_core, test_unpack_rows_within_field);
+    tcase_add_test(tc_core, test_damaged_row_every_driver);
+    tcase_add_test(tc_core, test_unpack_ppfield_in_place);
+    tcase_add_test(tc_core, test_extract_nbit_words_all_widths);
+    tcase_add_test(tc_core, test_bitmap_words_match);
+    tcase_add_test(tc_core, test_convert_float_batch);
+    tcase_add_test(tc_core, test_network_order_words);
+    tcase_add_test(tc_core, test_context_reuse);
+    tcase_add_test(tc_core, test_error_state_per_thread);
+    tcase_add_test(tc_core, test_unpack_batch);
+    tcase_add_test(tc_core, test_pp_file);
+    tcase_add_test(tc_core, test_ff_file);
+    tcase_add_test(tc_core, test_lookup_index);
+    tcase_add_test(tc_core, test_unpack_window);
+    tcase_add_test(tc_core, test_unpack_reduced);
+    tcase_add_test(tc_core, test_field_stats);
+    tcase_add_test(tc_core, test_row_reader);
+    tcase_add_test(tc_core, test_push_decoder);
+    tcase_add_test(tc_core, test_unpack_iov);
+    tcase_add_test(tc_core, test_unpack_quantized);
+    tcase_add_test(tc_core, test_unpack_half);
+    tcase_add_test(tc_core, test_unpack_sparse);
+    tcase_add_test(tc_core, test_unpack_transformed);
+    tcase_add_test(tc_core, test_validity_mask);
+    tcase_add_test(tc_core, test_pack_row_analysis);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = wgdos_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}